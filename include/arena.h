@@ -2,6 +2,8 @@
 
 #include "include/defines.h"
 
+#include <mutex>
+
 #define MEMORY_PAGE_SIZE 2000000
 #define MEMORY_PAGE_COUNT 64
 
@@ -19,6 +21,9 @@ struct MemoryPool
     MemoryPage pages[MEMORY_PAGE_COUNT];
     u32 free_pages[MEMORY_PAGE_COUNT];
     u32 free_count;
+
+    // Arenas of different job workers share the pool
+    std::mutex lock;
 };
 
 struct Arena
@@ -43,6 +48,8 @@ void* push_size(Arena* arena, u32 size);
 void begin_tmp(Arena* arena);
 void end_tmp(Arena* arena);
 void dispose(Arena* arena);
+// Keeps the first page around for reuse
+void clear(Arena* arena);
 void copy(Arena* arena, void* dst);
 
 // 0 => static meshes, 1 => skinned meshses
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "include/defines.h"
+#include "include/spatial.h"
 #include <glm/mat4x4.hpp>
 
 #define MODEL_BUFFER_MAX_MODELS 32
@@ -33,6 +34,33 @@ struct Model
     u32 index_offset;
     u32 vertex_offset;
     u8 flags;
+    // dense, used for render queue sort keys
+    u16 id;
+
+    // model space, used for culling and picking
+    Bounds bounds;
 };
 
 typedef glm::mat4 Bone;
+
+enum LightType
+{
+    LIGHT_POINT,
+    LIGHT_SPOT,
+};
+
+// Punctual light, lit fragments are found through the light clusters
+struct Light
+{
+    glm::vec3 position;
+    // Premultiplied by the intensity
+    glm::vec3 color;
+    // Spot lights only
+    glm::vec3 direction;
+    // No light reaches beyond
+    float range;
+    // Cosines of the spot cone, full intensity inside the inner one
+    float cos_inner;
+    float cos_outer;
+    u32 type;
+};
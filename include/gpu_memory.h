@@ -0,0 +1,71 @@
+#pragma once
+
+#include "include/defines.h"
+
+#include <vulkan/vulkan_core.h>
+
+// Device memory is allocated in blocks of this size per memory type and
+// handed out with a buddy allocator. Smaller heaps use smaller blocks
+#define GPU_BLOCK_SIZE (64 * 1024 * 1024)
+// Smallest buddy, every allocation is aligned to its rounded up size
+#define GPU_MIN_ALLOCATION 1024
+#define GPU_MAX_BLOCKS 64
+// Allocations bigger than half a block get their own VkDeviceMemory
+#define GPU_DEDICATED_THRESHOLD (GPU_BLOCK_SIZE / 2)
+#define GPU_MAX_MOVABLE 256
+
+struct GpuAllocation
+{
+    VkDeviceMemory memory;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    // NULL if the memory is not host visible. Blocks stay mapped, so
+    // vkMapMemory must not be called on the memory
+    u8* mapped;
+
+    i32 block;
+    // buddy node in the block, -1 => dedicated
+    i32 node;
+};
+
+// Called by gpu_defragment after new memory was reserved. Has to recreate the
+// resource in new_allocation, copy the contents over and drop the old resource.
+// The old allocation is freed afterwards
+typedef void GpuRelocateFunc(GpuAllocation* old_allocation,
+                             GpuAllocation* new_allocation,
+                             void* data);
+
+struct GpuMemoryStats
+{
+    u32 block_count;
+    u32 dedicated_count;
+    u32 allocation_count;
+    // bytes of all VkDeviceMemory objects
+    VkDeviceSize reserved;
+    // bytes handed out, including rounding up to a buddy
+    VkDeviceSize used;
+    // bytes asked for
+    VkDeviceSize requested;
+};
+
+void init_gpu_memory(VkPhysicalDevice physical_device, VkDevice device);
+// Frees all blocks, everything allocated has to be freed before
+void shutdown_gpu_memory();
+
+// linear => buffers and linear images, keeps them and optimal images apart
+// when bufferImageGranularity requires it
+GpuAllocation gpu_alloc(VkMemoryRequirements* requirements,
+                        VkMemoryPropertyFlags properties,
+                        bool linear);
+void gpu_free(GpuAllocation* allocation);
+
+// The allocation may be moved by gpu_defragment, the pointer has to stay
+// valid until it is freed
+void gpu_set_movable(GpuAllocation* allocation, GpuRelocateFunc* relocate, void* data);
+// Moves movable allocations out of the emptiest block into other blocks of
+// the same memory type. Returns the number of moved allocations.
+// The gpu must not use any of the movable resources while this runs
+u32 gpu_defragment(u32 max_moves);
+
+GpuMemoryStats get_gpu_memory_stats();
+void print_gpu_memory_stats();
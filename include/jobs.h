@@ -0,0 +1,66 @@
+#pragma once
+
+#include "include/defines.h"
+
+#include <atomic>
+
+// Includes the main thread, which is always worker 0, and attached threads
+#define MAX_WORKERS 16
+// Threads besides the workers that run and submit jobs, like the render thread
+#define MAX_ATTACHED_THREADS 2
+// Per worker, has to be a power of 2
+#define JOB_QUEUE_SIZE 1024
+#define MAX_TRACE_EVENTS 4096
+
+// Called with the range [first, last) of the job
+typedef void JobFunc(void* data, u32 first, u32 last);
+
+// Counts the unfinished jobs of a submit. Waiting on it runs other jobs in
+// the meantime
+struct JobCounter
+{
+    std::atomic<i32> value;
+};
+
+struct Job
+{
+    const char* name;
+    JobFunc* func;
+    void* data;
+    u32 first;
+    u32 last;
+    JobCounter* counter;
+};
+
+struct TraceEvent
+{
+    const char* name;
+    u64 start;
+    u64 end;
+};
+
+// worker_count = 0 => one worker per core
+void init_jobs(u32 worker_count);
+void shutdown_jobs();
+// Gives the calling thread its own deque and worker index
+void attach_thread(const char* name);
+// Includes attached threads
+u32 get_worker_count();
+// 0 on the main thread
+u32 get_worker_index();
+
+// Pushes the jobs onto the deque of the calling worker, idle workers
+// steal from there. counter has to outlive the jobs
+void submit_jobs(Job* jobs, u32 job_count, JobCounter* counter);
+void wait_for(JobCounter* counter);
+// Splits [0, count) into ranges of at most grain and waits for all of them
+void parallel_for(const char* name, u32 count, u32 grain, JobFunc* func, void* data);
+
+// Every job is traced, other work can be traced by hand
+u64 trace_begin();
+void trace_end(const char* name, u64 start);
+// Drops the recorded events. Events are only recorded if capture is set.
+// No jobs may run while this is called
+void begin_trace_frame(bool capture);
+// Writes the recorded events in the chrome://tracing format
+void write_trace(const char* path);
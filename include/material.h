@@ -0,0 +1,94 @@
+#pragma once
+
+#include "include/defines.h"
+#include "include/shader_cache.h"
+
+#include <glm/vec3.hpp>
+
+// Each description becomes one pipeline per vertex layout it has a vertex
+// shader for. Limited by the pipeline bits of the sort key
+#define MAX_PIPELINE_DESCS 8
+// Limited by the material bits of the sort key
+#define MAX_MATERIAL_DESCS 64
+#define SHADER_PATH_SIZE 64
+// Sizes of the arrays in pbr.frag and skinned.vert
+#define MAX_SHADER_LIGHTS 2
+#define MAX_BONE_INFLUENCES 3
+
+// Also indexes the vertex and index buffers of the renderer
+enum VertexLayout
+{
+    VERTEX_LAYOUT_STATIC,
+    VERTEX_LAYOUT_SKINNED,
+    VERTEX_LAYOUT_COUNT,
+};
+
+enum BlendMode
+{
+    BLEND_OPAQUE,
+    BLEND_ALPHA,
+    BLEND_ADDITIVE,
+};
+
+enum DepthTest
+{
+    DEPTH_TEST_LESS,
+    DEPTH_TEST_LESS_EQUAL,
+    DEPTH_TEST_EQUAL,
+    DEPTH_TEST_OFF,
+};
+
+enum CullMode
+{
+    CULL_BACK,
+    CULL_FRONT,
+    CULL_NONE,
+};
+
+enum BrdfModel
+{
+    BRDF_GGX,
+    BRDF_LAMBERT,
+};
+
+// Specialization constants, the constant_id is the index of the member.
+// Every stage gets all of them
+struct ShaderSpecialization
+{
+    u32 light_count;
+    u32 bone_influences;
+    u32 brdf;
+};
+
+struct PipelineDesc
+{
+    // GLSL sources, empty => the layout is not supported
+    char vertex[VERTEX_LAYOUT_COUNT][SHADER_PATH_SIZE];
+    char fragment[SHADER_PATH_SIZE];
+    // Of both stages, see load_shader
+    char defines[SHADER_DEFINES_SIZE];
+    ShaderSpecialization specialization;
+    u8 blend;
+    u8 depth_test;
+    u8 depth_write;
+    u8 cull;
+};
+
+// Parameters of pbr.frag
+struct MaterialDesc
+{
+    u32 pipeline;
+    float roughness;
+    float smoothness;
+    glm::vec3 specular;
+    glm::vec3 diffuse;
+};
+
+// Materials refer to their pipeline description by index
+struct MaterialLibrary
+{
+    PipelineDesc pipelines[MAX_PIPELINE_DESCS];
+    u32 pipeline_count;
+    MaterialDesc materials[MAX_MATERIAL_DESCS];
+    u32 material_count;
+};
@@ -1,11 +1,27 @@
 #pragma once
 
 #include "include/defines.h"
+#include "include/arena.h"
+#include "include/jobs.h"
 
-#define MAX_MESSAGES 128
+// Messages are pushed in chunks from the frame arena
+#define MESSAGE_CHUNK_SIZE 512
+// Shadow map cascades of the sun, each has its own queue
+#define SHADOW_CASCADES 4
+
+// Sort key layout, most significant first:
+// 63 - 60 pipeline | 59 - 44 model | 43 - 32 material | 31 - 0 depth
+// Transparent queue:
+// 63 - 32 inverted depth | 31 - 28 pipeline | 27 - 12 model | 11 - 0 material
+#define SORT_KEY_PIPELINE_SHIFT 60
+#define SORT_KEY_MODEL_SHIFT 44
+#define SORT_KEY_MATERIAL_SHIFT 32
 
 struct Message 
 {
+    u64 sort_key;
+
+    // index into the frames instance data, until the queue is built
     u32 uniform_slot;
     u32 material;
     u32 vertex_offset;
@@ -18,8 +34,79 @@ struct Message
     u32 pipeline;
 };
 
+// Consecutive instances of the same mesh, drawn with one instanced draw
+struct Batch
+{
+    u32 pipeline;
+    u32 vertex_offset;
+    u32 index_offset;
+    u32 index_count;
+    u32 first_instance;
+    u32 instance_count;
+};
+
+enum QueueType
+{
+    QUEUE_OPAQUE,
+    // sorted back to front, see make_sort_key
+    QUEUE_TRANSPARENT,
+    // QUEUE_SHADOW + i => casters of cascade i
+    QUEUE_SHADOW,
+    QUEUE_UI = QUEUE_SHADOW + SHADOW_CASCADES,
+    QUEUE_COUNT,
+};
+
+struct MessageChunk
+{
+    Message messages[MESSAGE_CHUNK_SIZE];
+    u32 count;
+    MessageChunk* next;
+};
+
+struct MessageList
+{
+    MessageChunk* first;
+    MessageChunk* last;
+    u32 count;
+};
+
+// Every queue is filled independently. build_batches merges them into one
+// array, in the order of QueueType. Each job worker pushes into its own
+// lists, so queues can be filled from jobs
 struct RenderQueue
 {
-    Message messages[MAX_MESSAGES];
+    // Cleared in reset_queue, everything below lives in here
+    Arena arenas[MAX_WORKERS];
+    MessageList lists[MAX_WORKERS][QUEUE_COUNT];
+
+    Message* messages;
     u32 message_count;
+    // messages of queue i are [queue_messages[i], queue_messages[i + 1])
+    u32 queue_messages[QUEUE_COUNT + 1];
+
+    Batch* batches;
+    u32 batch_count;
+    // batches of queue i are [queue_batches[i], queue_batches[i + 1])
+    u32 queue_batches[QUEUE_COUNT + 1];
+    // The QUEUE_OPAQUE batches by their nearest instance, for the depth prepass
+    u32* depth_order;
+    u32 depth_order_count;
 };
+
+void init_queue(RenderQueue* queue, MemoryPool* pool);
+void reset_queue(RenderQueue* queue);
+// Returned message is uninitialized. Safe to call from any job
+Message* push_message(RenderQueue* queue, u32 type);
+
+// Model comes before material, materials are per instance and must not
+// split batches. depth has to be >= 0. For QUEUE_TRANSPARENT depth is the
+// most significant field and inverted
+u64 make_sort_key(u32 type, u32 pipeline, u32 model, u32 material, float depth);
+
+// Sorts (key, value) pairs. tmp_keys and tmp_values need room for count elements
+void radix_sort(u64* keys, u32* values, u64* tmp_keys, u32* tmp_values, u32 count);
+
+// Merges the queues, sorts the messages of each queue by their key and
+// merges the runs of the same model into batches. Afterwards message i owns
+// instance slot i. Also orders the opaque batches front to back
+void build_batches(RenderQueue* queue);
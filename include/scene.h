@@ -2,10 +2,14 @@
 
 #include "include/defines.h"
 #include "include/assets.h"
+#include "include/material.h"
 
 #include <glm/mat4x4.hpp>
 
 #define ACTOR_COUNT 16
+// Enough for the light benchmark
+#define MAX_SCENE_LIGHTS 4096
+#define SCENE_CELL_SIZE 8.0f
 
 struct Actor
 {
@@ -29,7 +33,30 @@ struct Scene
 {
     Actor actors[ACTOR_COUNT];
     u32 actor_count;
+
+    Light lights[MAX_SCENE_LIGHTS];
+    u32 light_count;
+
+    // Actor materials index into this
+    MaterialLibrary library;
+
+    // indexed by actor id
+    SpatialGrid grid;
 };
 
 void init_scene(Scene* scene);
 void push_actor(Scene* scene, Actor actor);
+void push_light(Scene* scene, Light light);
+// Return the index of the description
+u32 push_pipeline_desc(Scene* scene, PipelineDesc desc);
+u32 push_material_desc(Scene* scene, MaterialDesc desc);
+ShaderSpecialization default_specialization();
+PipelineDesc default_pipeline_desc();
+MaterialDesc default_material_desc();
+
+glm::mat4 get_actor_transform(Actor* actor);
+Bounds get_actor_bounds(Actor* actor, glm::mat4* transform);
+
+// Has to be called once all actors are pushed
+void build_grid(Scene* scene);
+void update_grid(Scene* scene, u32 actor, glm::mat4* transform);
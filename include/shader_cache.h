@@ -0,0 +1,15 @@
+#pragma once
+
+#include "include/defines.h"
+
+// Compiled SPIR-V, named after the hash of the source and its defines
+#define SHADER_CACHE_DIR "shader_cache/"
+// Space separated NAME or NAME=VALUE, passed to the compiler as -D
+#define SHADER_DEFINES_SIZE 128
+
+// Compiles the GLSL source with glslc unless the cache has it already. The
+// stage is taken from the extension (.vert, .frag, .comp). Thread safe.
+// Returns NULL if the source doesn't compile, the result has to be freed
+char* load_shader(const char* source, const char* defines, i32* len);
+// Last modification of the source, 0 if it can't be read
+u64 get_shader_time(const char* source);
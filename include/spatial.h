@@ -0,0 +1,82 @@
+#pragma once
+
+#include "include/defines.h"
+
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+#include <glm/mat4x4.hpp>
+
+struct Bounds
+{
+    glm::vec3 min;
+    glm::vec3 max;
+};
+
+struct Frustum
+{
+    // xyz => inward facing normal, w => distance
+    glm::vec4 planes[6];
+    // world space bounds of the 8 frustum corners
+    Bounds bounds;
+};
+
+struct SpatialEntry
+{
+    Bounds bounds;
+    i32 cell;
+    i32 prev;
+    i32 next;
+    u32 stamp;
+};
+
+// Loose uniform grid over the xy plane (z is up). Entries are binned by the
+// center of their bounds, queries widen their search by the largest half
+// extent ever inserted. Entries with a center outside of the grid go into
+// an overflow cell that every query checks.
+struct SpatialGrid
+{
+    glm::vec2 origin;
+    float cell_size;
+    u32 dim_x;
+    u32 dim_y;
+
+    float max_extent;
+    float min_z;
+    float max_z;
+
+    // dim_x * dim_y cells + 1 overflow cell, -1 => empty
+    i32* cells;
+    SpatialEntry* entries;
+    u32 capacity;
+
+    // used to skip entries that were already tested in the current query
+    u32 stamp;
+};
+
+void init_grid(SpatialGrid* grid, glm::vec2 min, glm::vec2 max, float cell_size, u32 capacity);
+void dispose_grid(SpatialGrid* grid);
+
+// ids are owned by the caller and have to be < capacity
+void grid_insert(SpatialGrid* grid, u32 id, Bounds bounds);
+void grid_remove(SpatialGrid* grid, u32 id);
+// Refits the bounds of an entry. Only relinks the entry if it changed cells
+void grid_update(SpatialGrid* grid, u32 id, Bounds bounds);
+
+u32 grid_query_frustum(SpatialGrid* grid, Frustum* frustum, u32* result, u32 max_results);
+u32 grid_query_radius(SpatialGrid* grid,
+                      glm::vec3 center,
+                      float radius,
+                      u32* result,
+                      u32 max_results);
+// returns id of the closest hit or -1
+i32 grid_raycast(SpatialGrid* grid, glm::vec3 origin, glm::vec3 dir, float max_t, float* t);
+
+Frustum frustum_from_matrix(glm::mat4 proj_view);
+Bounds transform_bounds(Bounds bounds, glm::mat4* transform);
+bool frustum_intersects(Frustum* frustum, Bounds* bounds);
+bool sphere_intersects(Bounds* bounds, glm::vec3 center, float radius);
+bool ray_intersects(Bounds* bounds, glm::vec3 origin, glm::vec3 inv_dir, float max_t, float* t);
+
+// Compares the grid queries against brute force for 1k - 1M entries
+void bench_spatial();
@@ -10,20 +10,113 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include "include/assets.h"
+#include "include/material.h"
+#include "include/spatial.h"
+#include "include/render_queue.h"
 
+// Capacity of the per frame storage buffers, derived from the scene
+struct RenderLimits
+{
+    u32 max_instances;
+    u32 max_materials;
+    u32 max_bones;
+    u32 max_lights;
+};
 
-void init_vulkan(GLFWwindow* window);
-void init_materials();
+// Camera of a frame, proj has to be a perspective projection
+struct RenderView
+{
+    glm::vec3 camera_pos;
+    glm::mat4 view;
+    glm::mat4 proj;
+    float near_plane;
+    float far_plane;
+    // Normalized, points towards the sun. Casts the shadows
+    glm::vec3 sun_direction;
+};
 
+// Counted while recording the last frame
+struct RenderStats
+{
+    u32 pipeline_binds;
+    u32 buffer_binds;
+    u32 descriptor_binds;
+    u32 draws;
+    u32 instances;
+    // Of the depth prepass, not included in draws
+    u32 prepass_draws;
+    // Fragment shader invocations of the color pass per pixel, measured on
+    // a frame that finished earlier. 0 => not measured
+    float overdraw;
+    // Per cascade, the gpu time is measured on a frame that finished
+    // earlier. 0 ms => the device can't time it
+    u32 shadow_draws[SHADOW_CASCADES];
+    float shadow_ms[SHADOW_CASCADES];
+
+    u32 record_threads;
+    float record_ms;
+    // Shadow and main passes of a frame that finished earlier, 0 ms => the
+    // device can't time it
+    float gpu_ms;
+    // Of the main pass, see set_dynamic_resolution
+    float render_scale;
+};
+
+// Transient gpu memory, valid until the frame it was allocated in finished
+struct StreamAllocation
+{
+    VkBuffer buffer;
+    u32 offset;
+    void* memory;
+};
+
+
+// Creates a pipeline for every material and vertex layout it supports
+void init_vulkan(GLFWwindow* window, RenderLimits limits, MaterialLibrary* library);
+// Uploads the material parameters, the library has to be the one passed
+// to init_vulkan
+void init_materials(MaterialLibrary* library);
+
+// Objects outside of the view are only drawn into the shadow cascades
+// they touch
 void draw_object(glm::mat4* transform, glm::mat4* prev_mvp, Model* model, u32 material);
 void draw_rigged(glm::mat4* transform, 
                  glm::mat4* prev_mvp, 
                  Model* model, 
                  u32 material, 
                  Bone* pose, 
+                 Bone* prev_pose, 
                  u32 bone_count);
+// Between start_frame and end_frame, from any thread
+void draw_lights(Light* lights, u32 count);
+
+// Culls and builds the draws on the gpu if the device supports it
+void set_gpu_driven(bool enabled);
+// Draws the depth of opaque objects before shading them. Recreates the
+// pipelines with the next start_frame
+void set_depth_prepass(bool enabled);
+// Needs the pipelineStatisticsQuery feature, see RenderStats::overdraw
+void set_overdraw_measurement(bool enabled);
+// Jitters the projection and resolves against the history of the last frames
+void set_taa(bool enabled);
+// Scales the resolution of the main pass to keep the gpu time of the
+// shadow and main passes below 16.6 ms, the taa resolve upscales it
+void set_dynamic_resolution(bool enabled);
+// Has to be called from the thread that renders, before start_frame
+void set_framebuffer_size(i32 width, i32 height);
+
+// Between start_frame and end_frame, from any thread. Works for every usage
+// of the stream buffer, alignment can be any value
+StreamAllocation stream_alloc(u32 size, u32 alignment);
+// Smallest alignment for binding an allocation with the given usage
+u32 get_stream_alignment(VkBufferUsageFlags usage);
+
+// Light space volume of each cascade of the view. Objects in there cast
+// shadows into the view, even if the camera doesn't see them
+void get_shadow_frustums(RenderView* view, Frustum* frustums);
 
 void end_frame(GLFWwindow* window);
-void start_frame(glm::vec3 camera_pos, glm::mat4 proj_view);
+RenderStats get_render_stats();
+void start_frame(RenderView* view);
 
 void cleanup_vulkan();
@@ -0,0 +1,39 @@
+#version 450
+
+// Depth prepass of static meshes, reads position_buffer. Has to compute
+// gl_Position exactly like pbr.vert, the color pass tests for EQUAL
+
+layout(binding = 0, set = 0) uniform GlobalUniform 
+{
+    mat4 proj_view;
+    vec3 camera_pos;
+} global;
+
+struct InstanceData
+{
+    mat4 model;
+    mat4 prev_mvp;
+    vec4 bounds;
+    uint material;
+    uint bone_offset;
+    uint index_count;
+    uint first_index;
+    int vertex_offset;
+    uint pipeline;
+};
+
+layout(std430, binding = 0, set = 2) readonly buffer InstanceBuffer
+{
+    InstanceData instances[];
+};
+
+layout(location = 0) in vec3 in_position;
+
+invariant gl_Position;
+
+void main() 
+{
+    mat4 model = instances[gl_InstanceIndex].model;
+    vec4 world_pos = model * vec4(in_position, 1.0);
+    gl_Position = global.proj_view * world_pos;
+}
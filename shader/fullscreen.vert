@@ -0,0 +1,11 @@
+#version 450
+
+// One triangle covering the target, drawn with 3 vertices and no buffers
+
+layout(location = 0) out vec2 out_uv;
+
+void main()
+{
+    out_uv = vec2((gl_VertexIndex << 1) & 2, gl_VertexIndex & 2);
+    gl_Position = vec4(out_uv * 2 - 1, 0, 1);
+}
@@ -1,7 +1,15 @@
 #version 450
 
 #define PI 3.14
-#define NDF_GGX
+#define MAX_LIGHTS 2
+#define BRDF_GGX 0
+#define BRDF_LAMBERT 1
+#define LIGHT_SPOT 1
+#define SHADOW_CASCADES 4
+
+// Specialized per pipeline, see ShaderSpecialization
+layout(constant_id = 0) const int LIGHT_COUNT = MAX_LIGHTS;
+layout(constant_id = 2) const int BRDF = BRDF_GGX;
 
 layout(binding = 0, set = 0) uniform GlobalUniform 
 {
@@ -9,44 +17,83 @@ layout(binding = 0, set = 0) uniform GlobalUniform
     vec3 camera_pos;
     int _a;              // this has to be there for byte alignment
     vec2 screen_size;
-    int jitter_index;
+    // ndc offset of this frame, see taa.frag
+    vec2 jitter;
+    mat4 view;
+    mat4 inv_proj;
+    // x => near, y => far, z and w => scale and bias from log(depth) to slice
+    vec4 cluster_depth;
+    // xyz => clusters per axis, w => entries per cluster
+    uvec4 cluster_grid;
+    // world => shadow map of each cascade
+    mat4 shadow_matrices[SHADOW_CASCADES];
+    // view depth where each cascade ends
+    vec4 cascade_splits;
+    // xyz => towards the sun
+    vec4 sun_direction;
 } global;
 
-layout(binding = 1, set = 0) uniform sampler2D prev_frame;
+// One layer per cascade, compares against the stored depth
+layout(binding = 4, set = 0) uniform sampler2DArrayShadow shadow_map;
 
-layout(binding = 0, set = 1) uniform MaterialUniform 
+struct Light
+{
+    // xyz => position, w => range
+    vec4 position;
+    // rgb => color, w => type
+    vec4 color;
+    // xyz => direction, w => cos of the outer cone
+    vec4 direction;
+    // x => cos of the inner cone
+    vec4 params;
+};
+
+layout(std430, binding = 2, set = 0) readonly buffer LightBuffer
+{
+    Light lights[];
+};
+
+// Written by cluster.comp
+layout(std430, binding = 3, set = 0) readonly buffer ClusterBuffer
+{
+    uint cluster_lights[];
+};
+
+struct MaterialUniform
 {
     float roughness;
     float smoothness;
     vec3 specular;
     vec3 diffuse;
-} material;
+};
+
+layout(std430, binding = 0, set = 1) readonly buffer MaterialBuffer
+{
+    MaterialUniform materials[];
+};
 
 layout(location = 0) in vec3 in_normal;
 layout(location = 1) in vec3 in_pos;
 layout(location = 2) in vec3 in_prev_screen_pos;
+layout(location = 3) flat in uint in_material;
 
 layout(location = 0) out vec4 out_color;
+// uv offset from the last frame, without the jitter
+layout(location = 1) out vec2 out_velocity;
+
+MaterialUniform material;
 
-int light_count = 2;
-vec3 light_colors[] = {
+vec3 light_colors[MAX_LIGHTS] = {
     vec3(1.0, 1.0, 1.0),
     vec3(0.7, 0.2, 0.2)
 };
 
-vec3 light_dir[] = {
+// The first light is the sun, see global.sun_direction
+vec3 light_dir[MAX_LIGHTS] = {
     normalize(vec3(1, 1, 2)),
     normalize(vec3(-1, 0, 1))
 };
 
-vec2 jitter_offsets[] = {
-    vec2(0.2, -0.2),
-    vec2(0, 0),
-    vec2(-0.2, 0.2),
-    vec2(0.2, 0.2),
-    vec2(-0.2, -0.2),
-};
-
 
 float a(vec3 n, vec3 s)
 {
@@ -58,7 +105,6 @@ float bin_clamp(float x)
     return x > 0 ? 1 : 0;
 }
 
-#ifdef NDF_GGX
 float ndf_lambda(float a)
 {
     return (-1 + sqrt(1 + 1 / (a * a))) / 2;
@@ -72,7 +118,6 @@ float ndf(vec3 n, vec3 m)
     float z = PI * y * y;
     return x / z;
 }
-#endif
 
 vec3 fresnel(vec3 n, vec3 l)
 {
@@ -95,6 +140,10 @@ float shadow_masking(vec3 l, vec3 v, vec3 m, vec3 n)
 
 vec3 brdf(vec3 l, vec3 v, vec3 n) 
 {
+    if (BRDF == BRDF_LAMBERT) {
+        return material.diffuse / PI;
+    }
+
     vec3 h = normalize(l + v);
 
     vec3 fresnel_term = fresnel(h, l);
@@ -111,23 +160,81 @@ vec3 brdf(vec3 l, vec3 v, vec3 n)
     return diffuse + specular;
 }
 
+// First entry of the cluster of this fragment
+uint get_cluster()
+{
+    uvec3 grid = global.cluster_grid.xyz;
+    uvec2 tile = uvec2(gl_FragCoord.xy / global.screen_size * grid.xy);
+    tile = min(tile, grid.xy - 1);
+    float depth = -(global.view * vec4(in_pos, 1)).z;
+    float slice = log(max(depth, global.cluster_depth.x)) * global.cluster_depth.z + global.cluster_depth.w;
+    uint z = min(uint(max(slice, 0)), grid.z - 1);
+    return ((z * grid.y + tile.y) * grid.x + tile.x) * global.cluster_grid.w;
+}
+
+// 0 => in shadow, 1 => lit. Beyond the last cascade everything is lit.
+// 3x3 filtered compares, each already blends 4 texels
+float sun_shadow()
+{
+    float depth = -(global.view * vec4(in_pos, 1)).z;
+    int cascade = 0;
+    while (cascade < SHADOW_CASCADES && depth > global.cascade_splits[cascade]) {
+        cascade++;
+    }
+    if (cascade == SHADOW_CASCADES) {
+        return 1;
+    }
+    vec4 pos = global.shadow_matrices[cascade] * vec4(in_pos, 1);
+    vec2 uv = pos.xy * 0.5 + 0.5;
+    vec2 texel = 1.0 / vec2(textureSize(shadow_map, 0).xy);
+    float lit = 0;
+    for (int x = -1; x <= 1; ++x) {
+        for (int y = -1; y <= 1; ++y) {
+            lit += texture(shadow_map, vec4(uv + vec2(x, y) * texel, cascade, pos.z));
+        }
+    }
+    return lit / 9;
+}
+
+// Inverse square falloff, windowed to reach 0 at the range
+vec3 local_light(Light light, vec3 v, vec3 n)
+{
+    vec3 to_light = light.position.xyz - in_pos;
+    float dist_sq = dot(to_light, to_light);
+    vec3 l = to_light * inversesqrt(dist_sq);
+    float ratio = dist_sq / (light.position.w * light.position.w);
+    float window = clamp(1 - ratio * ratio, 0, 1);
+    float attenuation = window * window / max(dist_sq, 0.0001);
+    if (uint(light.color.w) == LIGHT_SPOT) {
+        float cos_angle = dot(-l, light.direction.xyz);
+        attenuation *= smoothstep(light.direction.w, light.params.x, cos_angle);
+    }
+    return brdf(l, v, n) * light.color.rgb * attenuation * clamp(dot(n, l), 0, 1);
+}
+
 void main() 
 {
+    material = materials[in_material];
     vec3 n = normalize(in_normal);
     vec3 v = normalize(global.camera_pos - in_pos);
 
     out_color = vec4(0, 0, 0, 1);
-    for (int i = 0; i < light_count; ++i) {
-        vec3 l = light_dir[i];
+    for (int i = 0; i < min(LIGHT_COUNT, MAX_LIGHTS); ++i) {
+        vec3 l = i == 0? global.sun_direction.xyz : light_dir[i];
         vec3 c_light = light_colors[i];
+        float shadow = i == 0? sun_shadow() : 1;
 
-        out_color.rgb += brdf(l, v, n) * c_light * clamp(dot(n, l), 0, 1);
+        out_color.rgb += brdf(l, v, n) * c_light * clamp(dot(n, l), 0, 1) * shadow;
+    }
+    uint cluster = get_cluster();
+    uint count = cluster_lights[cluster];
+    for (uint i = 0; i < count; ++i) {
+        out_color.rgb += local_light(lights[cluster_lights[cluster + 1 + i]], v, n);
     }
     out_color.rgb *= PI;
     // QUESTION: ambient lighting?
 
-    // TODO: Fix moving of "negative highlights"
-    vec2 prev_pos = ((in_prev_screen_pos.xy / in_prev_screen_pos.z) + 1) / 2;
-    prev_pos += jitter_offsets[global.jitter_index] / global.screen_size;
-    out_color = 1.00 * out_color + 0.00 * texture(prev_frame, prev_pos);
+    vec2 ndc = gl_FragCoord.xy / global.screen_size * 2 - 1 - global.jitter;
+    vec2 prev_ndc = in_prev_screen_pos.xy / in_prev_screen_pos.z;
+    out_velocity = (ndc - prev_ndc) * 0.5;
 }
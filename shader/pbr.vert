@@ -6,16 +6,23 @@ layout(binding = 0, set = 0) uniform GlobalUniform
     vec3 camera_pos;
 } global;
 
-layout(binding = 0, set = 1) uniform MaterialUniform 
-{
-    float roughness;
-} material;
-
-layout(binding = 0, set = 2) uniform ObjectUniform 
+struct InstanceData
 {
     mat4 model;
     mat4 prev_mvp;
-} object;
+    vec4 bounds;
+    uint material;
+    uint bone_offset;
+    uint index_count;
+    uint first_index;
+    int vertex_offset;
+    uint pipeline;
+};
+
+layout(std430, binding = 0, set = 2) readonly buffer InstanceBuffer
+{
+    InstanceData instances[];
+};
 
 layout(location = 0) in vec3 in_position;
 layout(location = 1) in vec3 in_normal;
@@ -23,16 +30,21 @@ layout(location = 1) in vec3 in_normal;
 layout(location = 0) out vec3 out_normal;
 layout(location = 1) out vec3 out_pos;
 layout(location = 2) out vec3 out_prev_screen_pos;
+layout(location = 3) flat out uint out_material;
+
+// Has to match depth.vert exactly, the color pass tests for EQUAL
+invariant gl_Position;
 
 void main() 
 {
-    vec4 world_pos = object.model * vec4(in_position, 1.0);
-    out_normal = (object.model * vec4(in_normal, 0.0)).xyz;
+    mat4 model = instances[gl_InstanceIndex].model;
+    vec4 world_pos = model * vec4(in_position, 1.0);
+    out_normal = (model * vec4(in_normal, 0.0)).xyz;
     out_pos = world_pos.xyz;
     gl_Position = global.proj_view * world_pos;
 
     // taa stuff...
-    vec4 prev_pos = object.prev_mvp * vec4(in_position, 1.0);
+    vec4 prev_pos = instances[gl_InstanceIndex].prev_mvp * vec4(in_position, 1.0);
     out_prev_screen_pos = prev_pos.xyw;
-
+    out_material = instances[gl_InstanceIndex].material;
 }
@@ -0,0 +1,80 @@
+#version 450
+
+// Shadow map of one cascade, compiled with SKINNED for skinned meshes.
+// Static meshes read position_buffer
+
+#define SHADOW_CASCADES 4
+#define MAX_BONE_INFLUENCES 3
+
+// Specialized per pipeline, see ShaderSpecialization
+layout(constant_id = 1) const int BONE_INFLUENCES = MAX_BONE_INFLUENCES;
+
+layout(binding = 0, set = 0) uniform GlobalUniform
+{
+    mat4 proj_view;
+    vec3 camera_pos;
+    int _a;              // this has to be there for byte alignment
+    vec2 screen_size;
+    vec2 jitter;
+    mat4 view;
+    mat4 inv_proj;
+    vec4 cluster_depth;
+    uvec4 cluster_grid;
+    // world => shadow map of each cascade
+    mat4 shadow_matrices[SHADOW_CASCADES];
+} global;
+
+struct InstanceData
+{
+    mat4 model;
+    mat4 prev_mvp;
+    vec4 bounds;
+    uint material;
+    uint bone_offset;
+    uint index_count;
+    uint first_index;
+    int vertex_offset;
+    uint pipeline;
+};
+
+layout(std430, binding = 0, set = 2) readonly buffer InstanceBuffer
+{
+    InstanceData instances[];
+};
+
+layout(push_constant) uniform Constants
+{
+    uint cascade;
+} constants;
+
+layout(location = 0) in vec3 in_position;
+
+#ifdef SKINNED
+layout(std430, binding = 0, set = 3) readonly buffer BoneBuffer
+{
+    mat4 transforms[];
+} bones;
+
+layout(location = 2) in ivec3 in_bone_ids;
+layout(location = 3) in vec3 in_bone_weights;
+#endif
+
+void main()
+{
+    mat4 model = instances[gl_InstanceIndex].model;
+#ifdef SKINNED
+    // Same as skinned.vert
+    uint bone_offset = instances[gl_InstanceIndex].bone_offset;
+    mat4 bone_transform = mat4(0.0);
+    float weight_sum = 0.0;
+    for (int i = 0; i < min(BONE_INFLUENCES, MAX_BONE_INFLUENCES); ++i) {
+        bone_transform += in_bone_weights[i] * bones.transforms[bone_offset + in_bone_ids[i]];
+        weight_sum += in_bone_weights[i];
+    }
+    if (BONE_INFLUENCES < MAX_BONE_INFLUENCES) {
+        bone_transform /= max(weight_sum, 0.0001);
+    }
+    model = model * bone_transform;
+#endif
+    gl_Position = global.shadow_matrices[constants.cascade] * model * vec4(in_position, 1.0);
+}
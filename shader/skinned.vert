@@ -1,33 +1,41 @@
 #version 450
 
 
+#define MAX_BONE_INFLUENCES 3
+
+// Specialized per pipeline, see ShaderSpecialization
+layout(constant_id = 1) const int BONE_INFLUENCES = MAX_BONE_INFLUENCES;
+
 layout(binding = 0, set = 0) uniform GlobalUniform 
 {
     mat4 proj_view;
     vec3 camera_pos;
 } global;
 
-layout(binding = 0, set = 1) uniform MaterialUniform 
-{
-    float roughness;
-} material;
-
-layout(binding = 0, set = 2) uniform ObjectUniform 
+struct InstanceData
 {
     mat4 model;
     mat4 prev_mvp;
-} object;
+    vec4 bounds;
+    uint material;
+    uint bone_offset;
+    uint index_count;
+    uint first_index;
+    int vertex_offset;
+    uint pipeline;
+    // Pose of the last frame
+    uint prev_bone_offset;
+};
 
-layout(binding = 0, set = 3) uniform BoneUniform
+layout(std430, binding = 0, set = 2) readonly buffer InstanceBuffer
 {
-    mat4 transforms[20];
-} bones;
+    InstanceData instances[];
+};
 
-layout(push_constant) uniform Constants
+layout(std430, binding = 0, set = 3) readonly buffer BoneBuffer
 {
-    uint bone_offset;
-} constants;
-
+    mat4 transforms[];
+} bones;
 
 layout(location = 0) in vec3 in_position;
 layout(location = 1) in vec3 in_normal;
@@ -37,20 +45,40 @@ layout(location = 3) in vec3 in_bone_weights;
 layout(location = 0) out vec3 out_normal;
 layout(location = 1) out vec3 out_pos;
 layout(location = 2) out vec3 out_prev_screen_pos;
+layout(location = 3) flat out uint out_material;
+
+// Also compiled into the depth prepass pipeline, the color pass tests for EQUAL
+invariant gl_Position;
+
+// Unrolled once BONE_INFLUENCES is known, the weights of the dropped
+// influences are spread over the others
+mat4 skin(uint bone_offset)
+{
+    mat4 bone_transform = mat4(0.0);
+    float weight_sum = 0.0;
+    for (int i = 0; i < min(BONE_INFLUENCES, MAX_BONE_INFLUENCES); ++i) {
+        bone_transform += in_bone_weights[i] * bones.transforms[bone_offset + in_bone_ids[i]];
+        weight_sum += in_bone_weights[i];
+    }
+    if (BONE_INFLUENCES < MAX_BONE_INFLUENCES) {
+        bone_transform /= max(weight_sum, 0.0001);
+    }
+    return bone_transform;
+}
 
 void main() 
 {
-    mat4 bone_transform;
-    bone_transform = in_bone_weights.x * bones.transforms[constants.bone_offset + in_bone_ids.x];
-    bone_transform += in_bone_weights.y * bones.transforms[constants.bone_offset + in_bone_ids.y];
-    bone_transform += in_bone_weights.z * bones.transforms[constants.bone_offset + in_bone_ids.z];
+    mat4 model = instances[gl_InstanceIndex].model;
+    mat4 bone_transform = skin(instances[gl_InstanceIndex].bone_offset);
 
-    vec4 world_pos = object.model * bone_transform * vec4(in_position, 1.0);
-    out_normal = (object.model * bone_transform * vec4(in_normal, 0.0)).xyz;
+    vec4 world_pos = model * bone_transform * vec4(in_position, 1.0);
+    out_normal = (model * bone_transform * vec4(in_normal, 0.0)).xyz;
     out_pos = world_pos.xyz;
     gl_Position = global.proj_view * world_pos;
 
-    // taa stuff...
-    vec4 prev_pos = object.prev_mvp * vec4(in_position, 1.0);
+    // Velocity of the vertex, see pbr.frag
+    mat4 prev_bone_transform = skin(instances[gl_InstanceIndex].prev_bone_offset);
+    vec4 prev_pos = instances[gl_InstanceIndex].prev_mvp * prev_bone_transform * vec4(in_position, 1.0);
     out_prev_screen_pos = prev_pos.xyw;
+    out_material = instances[gl_InstanceIndex].material;
 }
@@ -0,0 +1,95 @@
+#version 450
+
+// Blends the current frame with the history reprojected by the velocity of
+// the pixel. The history is clipped to the colors around the pixel, which
+// rejects what got disoccluded or changed since. The current frame only
+// covers render_scale of its images and is upscaled to the history
+
+layout(binding = 0, set = 0) uniform sampler2D current_frame;
+// uv offset from the last frame, see pbr.frag
+layout(binding = 1, set = 0) uniform sampler2D velocity;
+layout(binding = 2, set = 0) uniform sampler2D history;
+
+layout(push_constant) uniform Constants
+{
+    float current_weight;
+    // true => there is no history
+    bool reset;
+    // Part of current_frame and velocity that was rendered to
+    vec2 render_scale;
+} constants;
+
+layout(location = 0) in vec2 in_uv;
+
+// History of the next frame
+layout(location = 0) out vec4 out_color;
+// The swap chain image
+layout(location = 1) out vec4 out_present;
+
+vec3 rgb_to_ycocg(vec3 c)
+{
+    return vec3(dot(c, vec3(0.25, 0.5, 0.25)),
+                dot(c, vec3(0.5, 0, -0.5)),
+                dot(c, vec3(-0.25, 0.5, -0.25)));
+}
+
+vec3 ycocg_to_rgb(vec3 c)
+{
+    return vec3(c.x + c.y - c.z, c.x + c.z, c.x - c.y - c.z);
+}
+
+// Moves the color towards the center of the box until it is inside
+vec3 clip_aabb(vec3 box_min, vec3 box_max, vec3 color)
+{
+    vec3 center = (box_min + box_max) * 0.5;
+    vec3 extent = (box_max - box_min) * 0.5 + 0.0001;
+    vec3 offset = color - center;
+    vec3 units = abs(offset / extent);
+    float max_unit = max(units.x, max(units.y, units.z));
+    return max_unit > 1? center + offset / max_unit : color;
+}
+
+vec3 resolve()
+{
+    vec2 size = vec2(textureSize(current_frame, 0));
+    ivec2 render_size = max(ivec2(size * constants.render_scale + 0.5), ivec2(1));
+    vec2 render_pos = in_uv * vec2(render_size);
+    ivec2 pixel = min(ivec2(render_pos), render_size - 1);
+    // Kept half a texel inside, the filter would read past the rendered part
+    vec2 uv = clamp(render_pos, vec2(0.5), vec2(render_size) - 0.5) / size;
+    vec3 current = texture(current_frame, uv).rgb;
+    if (constants.reset) {
+        return current;
+    }
+
+    vec3 center = rgb_to_ycocg(current);
+    vec3 box_min = center;
+    vec3 box_max = center;
+    for (int x = -1; x <= 1; ++x) {
+        for (int y = -1; y <= 1; ++y) {
+            ivec2 neighbour = clamp(pixel + ivec2(x, y), ivec2(0), render_size - 1);
+            vec3 color = rgb_to_ycocg(texelFetch(current_frame, neighbour, 0).rgb);
+            box_min = min(box_min, color);
+            box_max = max(box_max, color);
+        }
+    }
+
+    vec2 prev_uv = in_uv - texelFetch(velocity, pixel, 0).xy;
+    if (any(lessThan(prev_uv, vec2(0))) || any(greaterThan(prev_uv, vec2(1)))) {
+        return current;
+    }
+    vec3 prev = rgb_to_ycocg(texture(history, prev_uv).rgb);
+    prev = clip_aabb(box_min, box_max, prev);
+
+    // Weighted by the inverse luma, keeps bright pixels from flickering
+    float current_weight = constants.current_weight * (1 / (1 + center.x));
+    float prev_weight = (1 - constants.current_weight) * (1 / (1 + prev.x));
+    vec3 color = (center * current_weight + prev * prev_weight) / (current_weight + prev_weight);
+    return ycocg_to_rgb(color);
+}
+
+void main()
+{
+    out_color = vec4(resolve(), 1);
+    out_present = out_color;
+}
@@ -20,7 +20,8 @@ void init_arena(Arena* arena, MemoryPool* pool)
 {
     arena->page = -1;
     arena->first = -1;
-    pool->pages[arena->page].current = 0;
+    arena->size = 0;
+    arena->tmp_page = -1;
     arena->pool = pool;
 }
 
@@ -62,11 +63,13 @@ void end_tmp(Arena* arena)
 
     i32 page_ptr = arena->pool->pages[arena->tmp_page].next;
     while (page_ptr >= 0) {
+        // Once freed the page can be taken and relinked by another thread
+        i32 next = arena->pool->pages[page_ptr].next;
         free_page(arena->pool, page_ptr);
         if (page_ptr == arena->page) {
             break;
         }
-        page_ptr = arena->pool->pages[page_ptr].next;
+        page_ptr = next;
     }
 
     arena->page = arena->tmp_page;
@@ -92,6 +95,8 @@ void copy(Arena* arena, void* dst)
 
 i32 get_page(MemoryPool* pool, u32 min_size)
 {
+    std::lock_guard<std::mutex> guard(pool->lock);
+
     // TODO: Handle this somehow
     assert(pool->free_count > 0);
 
@@ -135,6 +140,7 @@ i32 get_page(MemoryPool* pool, u32 min_size)
 
 void free_page(MemoryPool* pool, i32 page_id)
 {
+    std::lock_guard<std::mutex> guard(pool->lock);
     pool->free_pages[pool->free_count] = page_id;
     pool->free_count++;
 }
@@ -142,9 +148,10 @@ void free_page(MemoryPool* pool, i32 page_id)
 void dispose(Arena* arena)
 {
     i32 page = arena->first;
-    while (page > 0) {
+    while (page >= 0) {
+        i32 next = arena->pool->pages[page].next;
         free_page(arena->pool, page);
-        page = arena->pool->pages[page].next;
+        page = next;
     }
     arena->first = -1;
     arena->page = -1;
@@ -154,6 +161,31 @@ void dispose(Arena* arena)
     arena->tmp_current = 0;
 }
 
+void clear(Arena* arena)
+{
+    if (arena->first < 0) {
+        return;
+    }
+
+    if (arena->page != arena->first) {
+        i32 page_ptr = arena->pool->pages[arena->first].next;
+        while (page_ptr >= 0) {
+            i32 next = arena->pool->pages[page_ptr].next;
+            free_page(arena->pool, page_ptr);
+            if (page_ptr == arena->page) {
+                break;
+            }
+            page_ptr = next;
+        }
+    }
+
+    arena->page = arena->first;
+    arena->size = 0;
+    arena->pool->pages[arena->first].current = 0;
+    arena->pool->pages[arena->first].next = -1;
+    arena->tmp_page = -1;
+}
+
 Arena vertex_arena[2];
 Arena index_arena[2];
 Arena asset_arena;
@@ -0,0 +1,423 @@
+#include "include/gpu_memory.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include <mutex>
+
+// Buddy tree of a block, node i has the children 2i + 1 and 2i + 2.
+// A buddy of order o spans GPU_MIN_ALLOCATION << o bytes, the root has
+// the order levels. free_order[i] is 1 + the order of the largest free
+// buddy below node i, 0 => nothing free
+struct GpuBlock
+{
+    VkDeviceMemory memory;
+    VkDeviceSize size;
+    u8* mapped;
+    u32 type;
+    bool linear;
+    bool dedicated;
+
+    u32 levels;
+    u8* free_order;
+
+    u32 allocation_count;
+    VkDeviceSize used;
+    VkDeviceSize requested;
+};
+
+struct GpuMovable
+{
+    GpuAllocation* allocation;
+    GpuRelocateFunc* relocate;
+    void* data;
+};
+
+VkDevice gpu_device;
+VkPhysicalDeviceMemoryProperties gpu_memory_properties;
+// Optimal images and linear resources have to be this far apart
+VkDeviceSize gpu_granularity;
+VkDeviceSize gpu_block_sizes[VK_MAX_MEMORY_TYPES];
+GpuBlock gpu_blocks[GPU_MAX_BLOCKS];
+GpuMovable gpu_movables[GPU_MAX_MOVABLE];
+u32 gpu_movable_count;
+std::mutex gpu_memory_lock;
+
+void init_gpu_memory(VkPhysicalDevice physical_device, VkDevice device)
+{
+    gpu_device = device;
+    vkGetPhysicalDeviceMemoryProperties(physical_device, &gpu_memory_properties);
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physical_device, &properties);
+    gpu_granularity = properties.limits.bufferImageGranularity;
+
+    // Small heaps (like the host visible part of vram) get smaller blocks,
+    // so a single block can't take most of it
+    for (u32 i = 0; i < gpu_memory_properties.memoryTypeCount; ++i) {
+        VkMemoryType* type = gpu_memory_properties.memoryTypes + i;
+        VkDeviceSize heap_size = gpu_memory_properties.memoryHeaps[type->heapIndex].size;
+        VkDeviceSize size = GPU_BLOCK_SIZE;
+        while (size > heap_size / 8 && size > GPU_MIN_ALLOCATION * 64) {
+            size /= 2;
+        }
+        gpu_block_sizes[i] = size;
+    }
+    for (u32 i = 0; i < GPU_MAX_BLOCKS; ++i) {
+        gpu_blocks[i] = {};
+    }
+    gpu_movable_count = 0;
+}
+
+u32 find_gpu_memory_type(u32 type_bits, VkMemoryPropertyFlags properties)
+{
+    for (u32 i = 0; i < gpu_memory_properties.memoryTypeCount; ++i) {
+        VkMemoryPropertyFlags flags = gpu_memory_properties.memoryTypes[i].propertyFlags;
+        if (type_bits & (1 << i) && (flags & properties) == properties) {
+            return i;
+        }
+    }
+    printf("Failed to find suitable memory type\n");
+    exit(1);
+}
+
+void release_block(GpuBlock* block)
+{
+    // Unmapped implicitly
+    vkFreeMemory(gpu_device, block->memory, NULL);
+    free(block->free_order);
+    *block = {};
+}
+
+i32 create_block(u32 type, VkDeviceSize size, bool linear, bool dedicated)
+{
+    i32 index = -1;
+    for (u32 i = 0; i < GPU_MAX_BLOCKS && index < 0; ++i) {
+        if (gpu_blocks[i].memory == VK_NULL_HANDLE) {
+            index = i;
+        }
+    }
+    if (index < 0) {
+        printf("Out of gpu memory blocks\n");
+        exit(1);
+    }
+
+    GpuBlock* block = gpu_blocks + index;
+    VkMemoryAllocateInfo alloc_info{};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.allocationSize = size;
+    alloc_info.memoryTypeIndex = type;
+    if (vkAllocateMemory(gpu_device, &alloc_info, NULL, &block->memory) != VK_SUCCESS) {
+        printf("Failed to allocate %llu bytes of gpu memory\n", (unsigned long long) size);
+        exit(1);
+    }
+    block->size = size;
+    block->type = type;
+    block->linear = linear;
+    block->dedicated = dedicated;
+    block->mapped = NULL;
+    VkMemoryPropertyFlags flags = gpu_memory_properties.memoryTypes[type].propertyFlags;
+    if (flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        vkMapMemory(gpu_device, block->memory, 0, size, 0, (void**) &block->mapped);
+    }
+
+    if (!dedicated) {
+        block->levels = 0;
+        while ((VkDeviceSize) GPU_MIN_ALLOCATION << block->levels < size) {
+            block->levels++;
+        }
+        u32 node_count = (2 << block->levels) - 1;
+        block->free_order = (u8*) malloc(node_count);
+        // Everything free, every node spans its full order
+        u32 order = block->levels;
+        for (u32 first = 0; first < node_count; first = first * 2 + 1) {
+            for (u32 i = first; i < first * 2 + 1; ++i) {
+                block->free_order[i] = order + 1;
+            }
+            order--;
+        }
+    }
+    return index;
+}
+
+void update_parents(GpuBlock* block, u32 node, u32 order)
+{
+    u8* free_order = block->free_order;
+    while (node > 0) {
+        u32 parent = (node - 1) / 2;
+        u32 left = free_order[parent * 2 + 1];
+        u32 right = free_order[parent * 2 + 2];
+        // Both buddies free => merged
+        if (left == order + 1 && right == order + 1) {
+            free_order[parent] = order + 2;
+        } else {
+            free_order[parent] = left > right? left : right;
+        }
+        node = parent;
+        order++;
+    }
+}
+
+i32 buddy_alloc(GpuBlock* block, u32 order)
+{
+    if (block->free_order[0] < order + 1) {
+        return -1;
+    }
+    u32 node = 0;
+    for (u32 node_order = block->levels; node_order > order; --node_order) {
+        u32 left = node * 2 + 1;
+        node = block->free_order[left] >= order + 1? left : left + 1;
+    }
+    block->free_order[node] = 0;
+    update_parents(block, node, order);
+    return node;
+}
+
+u32 get_node_depth(u32 node)
+{
+    u32 depth = 0;
+    for (u32 i = node + 1; i > 1; i >>= 1) {
+        depth++;
+    }
+    return depth;
+}
+
+u32 get_order(VkDeviceSize size)
+{
+    u32 order = 0;
+    while ((VkDeviceSize) GPU_MIN_ALLOCATION << order < size) {
+        order++;
+    }
+    return order;
+}
+
+// Only looks at existing blocks, skip = -1 => none skipped
+bool alloc_from_blocks(u32 type, bool linear, u32 order, i32 skip, GpuAllocation* allocation)
+{
+    for (i32 i = 0; i < GPU_MAX_BLOCKS; ++i) {
+        GpuBlock* block = gpu_blocks + i;
+        if (block->memory == VK_NULL_HANDLE || block->dedicated || i == skip ||
+            block->type != type || block->linear != linear || order > block->levels) {
+            continue;
+        }
+        i32 node = buddy_alloc(block, order);
+        if (node < 0) {
+            continue;
+        }
+
+        u32 depth = get_node_depth(node);
+        allocation->memory = block->memory;
+        allocation->offset = (VkDeviceSize) (node + 1 - (1 << depth)) *
+            ((VkDeviceSize) GPU_MIN_ALLOCATION << order);
+        allocation->mapped = block->mapped? block->mapped + allocation->offset : NULL;
+        allocation->block = i;
+        allocation->node = node;
+        block->allocation_count++;
+        block->used += (VkDeviceSize) GPU_MIN_ALLOCATION << order;
+        block->requested += allocation->size;
+        return true;
+    }
+    return false;
+}
+
+GpuAllocation gpu_alloc(VkMemoryRequirements* requirements,
+                        VkMemoryPropertyFlags properties,
+                        bool linear)
+{
+    std::lock_guard<std::mutex> guard(gpu_memory_lock);
+    u32 type = find_gpu_memory_type(requirements->memoryTypeBits, properties);
+    // Buddies never share a granularity page if it is smaller than them
+    if (gpu_granularity <= GPU_MIN_ALLOCATION) {
+        linear = true;
+    }
+
+    GpuAllocation allocation{};
+    allocation.size = requirements->size;
+    VkDeviceSize size = requirements->size > requirements->alignment?
+        requirements->size : requirements->alignment;
+
+    if (size > gpu_block_sizes[type] / 2) {
+        i32 index = create_block(type, requirements->size, linear, true);
+        GpuBlock* block = gpu_blocks + index;
+        block->allocation_count = 1;
+        block->used = requirements->size;
+        block->requested = requirements->size;
+        allocation.memory = block->memory;
+        allocation.offset = 0;
+        allocation.mapped = block->mapped;
+        allocation.block = index;
+        allocation.node = -1;
+        return allocation;
+    }
+
+    u32 order = get_order(size);
+    if (!alloc_from_blocks(type, linear, order, -1, &allocation)) {
+        create_block(type, gpu_block_sizes[type], linear, false);
+        bool allocated = alloc_from_blocks(type, linear, order, -1, &allocation);
+        assert(allocated);
+    }
+    return allocation;
+}
+
+// Expects the lock to be held
+void free_allocation(GpuAllocation* allocation)
+{
+    GpuBlock* block = gpu_blocks + allocation->block;
+    if (allocation->node < 0) {
+        release_block(block);
+        return;
+    }
+
+    u32 order = block->levels - get_node_depth(allocation->node);
+    block->free_order[allocation->node] = order + 1;
+    update_parents(block, allocation->node, order);
+    block->allocation_count--;
+    block->used -= (VkDeviceSize) GPU_MIN_ALLOCATION << order;
+    block->requested -= allocation->size;
+
+    // One empty block per type is kept around, render targets get
+    // recreated on every resize
+    if (block->allocation_count == 0) {
+        for (i32 i = 0; i < GPU_MAX_BLOCKS; ++i) {
+            GpuBlock* other = gpu_blocks + i;
+            if (i != allocation->block && other->memory != VK_NULL_HANDLE &&
+                !other->dedicated && other->allocation_count == 0 &&
+                other->type == block->type && other->linear == block->linear) {
+                release_block(block);
+                break;
+            }
+        }
+    }
+}
+
+// Like vkFreeMemory, freeing nothing is fine
+void gpu_free(GpuAllocation* allocation)
+{
+    if (allocation->memory == VK_NULL_HANDLE) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(gpu_memory_lock);
+    for (u32 i = 0; i < gpu_movable_count; ++i) {
+        if (gpu_movables[i].allocation == allocation) {
+            gpu_movables[i] = gpu_movables[--gpu_movable_count];
+            break;
+        }
+    }
+    free_allocation(allocation);
+    *allocation = {};
+}
+
+void gpu_set_movable(GpuAllocation* allocation, GpuRelocateFunc* relocate, void* data)
+{
+    std::lock_guard<std::mutex> guard(gpu_memory_lock);
+    assert(gpu_movable_count < GPU_MAX_MOVABLE);
+    GpuMovable* movable = gpu_movables + gpu_movable_count++;
+    movable->allocation = allocation;
+    movable->relocate = relocate;
+    movable->data = data;
+}
+
+u32 gpu_defragment(u32 max_moves)
+{
+    // The relocate callbacks create resources themselves, the lock is
+    // not held while they run
+    i32 source = -1;
+    {
+        std::lock_guard<std::mutex> guard(gpu_memory_lock);
+        for (u32 i = 0; i < gpu_movable_count; ++i) {
+            GpuAllocation* allocation = gpu_movables[i].allocation;
+            if (allocation->node < 0) {
+                continue;
+            }
+            if (source < 0 || gpu_blocks[allocation->block].used < gpu_blocks[source].used) {
+                source = allocation->block;
+            }
+        }
+    }
+    if (source < 0) {
+        return 0;
+    }
+
+    u32 moved = 0;
+    for (u32 i = 0; i < gpu_movable_count && moved < max_moves; ++i) {
+        GpuMovable movable = gpu_movables[i];
+        GpuAllocation* allocation = movable.allocation;
+        if (allocation->block != source) {
+            continue;
+        }
+
+        GpuAllocation new_allocation{};
+        new_allocation.size = allocation->size;
+        {
+            std::lock_guard<std::mutex> guard(gpu_memory_lock);
+            GpuBlock* block = gpu_blocks + source;
+            u32 order = block->levels - get_node_depth(allocation->node);
+            if (!alloc_from_blocks(block->type, block->linear, order, source, &new_allocation)) {
+                // The other blocks are full
+                break;
+            }
+        }
+
+        movable.relocate(allocation, &new_allocation, movable.data);
+        GpuAllocation old_allocation = *allocation;
+        *allocation = new_allocation;
+        {
+            std::lock_guard<std::mutex> guard(gpu_memory_lock);
+            free_allocation(&old_allocation);
+        }
+        moved++;
+    }
+    return moved;
+}
+
+GpuMemoryStats get_gpu_memory_stats()
+{
+    std::lock_guard<std::mutex> guard(gpu_memory_lock);
+    GpuMemoryStats stats{};
+    for (u32 i = 0; i < GPU_MAX_BLOCKS; ++i) {
+        GpuBlock* block = gpu_blocks + i;
+        if (block->memory == VK_NULL_HANDLE) {
+            continue;
+        }
+        if (block->dedicated) {
+            stats.dedicated_count++;
+        } else {
+            stats.block_count++;
+        }
+        stats.allocation_count += block->allocation_count;
+        stats.reserved += block->size;
+        stats.used += block->used;
+        stats.requested += block->requested;
+    }
+    return stats;
+}
+
+void print_gpu_memory_stats()
+{
+    GpuMemoryStats stats = get_gpu_memory_stats();
+    const double mb = 1024.0 * 1024.0;
+    printf("Gpu memory: %u allocations in %u blocks + %u dedicated, "
+           "%.1f MB reserved, %.1f MB used, %.1f MB requested\n",
+           stats.allocation_count,
+           stats.block_count,
+           stats.dedicated_count,
+           stats.reserved / mb,
+           stats.used / mb,
+           stats.requested / mb);
+}
+
+void shutdown_gpu_memory()
+{
+    for (u32 i = 0; i < GPU_MAX_BLOCKS; ++i) {
+        GpuBlock* block = gpu_blocks + i;
+        if (block->memory == VK_NULL_HANDLE) {
+            continue;
+        }
+        if (block->allocation_count > 0) {
+            printf("Gpu memory block %u still has %u allocations\n", i, block->allocation_count);
+        }
+        release_block(block);
+    }
+    gpu_movable_count = 0;
+}
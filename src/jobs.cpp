@@ -0,0 +1,293 @@
+#include "include/jobs.h"
+
+#include <stdio.h>
+#include <assert.h>
+
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+// Owner pushes and pops at the bottom, thieves take from the top
+struct JobQueue
+{
+    std::mutex lock;
+    Job jobs[JOB_QUEUE_SIZE];
+    u32 top;
+    u32 bottom;
+};
+
+struct Worker
+{
+    const char* name;
+    JobQueue queue;
+    std::thread thread;
+
+    // only written by the worker itself
+    TraceEvent events[MAX_TRACE_EVENTS];
+    u32 event_count;
+};
+
+Worker workers[MAX_WORKERS];
+std::atomic<u32> worker_count = 1;
+// Workers spawned by init_jobs, attached threads come after them
+u32 thread_count = 1;
+thread_local u32 worker_index = 0;
+
+std::atomic<u32> pending_jobs;
+std::atomic<bool> running;
+// Idle workers sleep here until jobs are submitted
+std::mutex sleep_lock;
+std::condition_variable sleep_cond;
+
+std::atomic<bool> tracing;
+std::chrono::steady_clock::time_point trace_origin = std::chrono::steady_clock::now();
+
+void push_job(JobQueue* queue, Job* job)
+{
+    std::lock_guard<std::mutex> guard(queue->lock);
+    assert(queue->bottom - queue->top < JOB_QUEUE_SIZE);
+    queue->jobs[queue->bottom & (JOB_QUEUE_SIZE - 1)] = *job;
+    queue->bottom++;
+}
+
+bool pop_job(JobQueue* queue, Job* job)
+{
+    std::lock_guard<std::mutex> guard(queue->lock);
+    if (queue->bottom == queue->top) {
+        return false;
+    }
+    queue->bottom--;
+    *job = queue->jobs[queue->bottom & (JOB_QUEUE_SIZE - 1)];
+    return true;
+}
+
+bool steal_job(JobQueue* queue, Job* job)
+{
+    std::lock_guard<std::mutex> guard(queue->lock);
+    if (queue->bottom == queue->top) {
+        return false;
+    }
+    *job = queue->jobs[queue->top & (JOB_QUEUE_SIZE - 1)];
+    queue->top++;
+    return true;
+}
+
+u64 trace_begin()
+{
+    auto time = std::chrono::steady_clock::now() - trace_origin;
+    return std::chrono::duration_cast<std::chrono::microseconds>(time).count();
+}
+
+void trace_end(const char* name, u64 start)
+{
+    if (!tracing) {
+        return;
+    }
+
+    Worker* worker = workers + worker_index;
+    if (worker->event_count < MAX_TRACE_EVENTS) {
+        TraceEvent* event = worker->events + worker->event_count++;
+        event->name = name;
+        event->start = start;
+        event->end = trace_begin();
+    }
+}
+
+// Runs a job of the own deque or steals one from another worker
+bool run_one()
+{
+    Job job;
+    bool found = pop_job(&workers[worker_index].queue, &job);
+    for (u32 i = 1; i < worker_count && !found; ++i) {
+        u32 victim = (worker_index + i) % worker_count;
+        found = steal_job(&workers[victim].queue, &job);
+    }
+    if (!found) {
+        return false;
+    }
+    pending_jobs--;
+
+    u64 start = trace_begin();
+    job.func(job.data, job.first, job.last);
+    trace_end(job.name, start);
+
+    job.counter->value--;
+    return true;
+}
+
+void worker_main(u32 index)
+{
+    worker_index = index;
+    while (running) {
+        if (run_one()) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_lock);
+        sleep_cond.wait(lock, [] { return pending_jobs > 0 || !running; });
+    }
+}
+
+void init_jobs(u32 count)
+{
+    if (count == 0) {
+        count = std::thread::hardware_concurrency();
+    }
+    if (count < 1) {
+        count = 1;
+    }
+    if (count > MAX_WORKERS - MAX_ATTACHED_THREADS) {
+        count = MAX_WORKERS - MAX_ATTACHED_THREADS;
+    }
+
+    worker_count = count;
+    worker_index = 0;
+    running = true;
+    workers[0].name = "main";
+    for (u32 i = 1; i < count; ++i) {
+        workers[i].name = "worker";
+        workers[i].thread = std::thread(worker_main, i);
+    }
+    thread_count = count;
+}
+
+void shutdown_jobs()
+{
+    {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        running = false;
+    }
+    sleep_cond.notify_all();
+    for (u32 i = 1; i < thread_count; ++i) {
+        workers[i].thread.join();
+    }
+    worker_count = 1;
+}
+
+void attach_thread(const char* name)
+{
+    worker_index = worker_count++;
+    assert(worker_index < MAX_WORKERS);
+    workers[worker_index].name = name;
+}
+
+u32 get_worker_count()
+{
+    return worker_count;
+}
+
+u32 get_worker_index()
+{
+    return worker_index;
+}
+
+void submit_jobs(Job* jobs, u32 job_count, JobCounter* counter)
+{
+    counter->value += job_count;
+    JobQueue* queue = &workers[worker_index].queue;
+    for (u32 i = 0; i < job_count; ++i) {
+        jobs[i].counter = counter;
+        push_job(queue, jobs + i);
+    }
+    pending_jobs += job_count;
+
+    // Taking the lock makes sure no worker is between checking
+    // pending_jobs and going to sleep
+    {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+    }
+    sleep_cond.notify_all();
+}
+
+void wait_for(JobCounter* counter)
+{
+    while (counter->value > 0) {
+        if (!run_one()) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void parallel_for(const char* name, u32 count, u32 grain, JobFunc* func, void* data)
+{
+    const u32 max_jobs = JOB_QUEUE_SIZE / 4;
+    if (count == 0) {
+        return;
+    }
+    if (grain == 0) {
+        grain = 1;
+    }
+    if ((count + grain - 1) / grain > max_jobs) {
+        grain = (count + max_jobs - 1) / max_jobs;
+    }
+
+    // Not worth handing out
+    if (count <= grain) {
+        u64 start = trace_begin();
+        func(data, 0, count);
+        trace_end(name, start);
+        return;
+    }
+
+    Job jobs[max_jobs];
+    u32 job_count = 0;
+    for (u32 first = 0; first < count; first += grain) {
+        Job* job = jobs + job_count++;
+        job->name = name;
+        job->func = func;
+        job->data = data;
+        job->first = first;
+        job->last = first + grain < count? first + grain : count;
+    }
+
+    JobCounter counter;
+    counter.value = 0;
+    submit_jobs(jobs, job_count, &counter);
+    wait_for(&counter);
+}
+
+void begin_trace_frame(bool capture)
+{
+    for (u32 i = 0; i < worker_count; ++i) {
+        workers[i].event_count = 0;
+    }
+    tracing = capture;
+}
+
+void write_trace(const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        printf("Failed to open %s\n", path);
+        return;
+    }
+
+    fprintf(file, "{\"traceEvents\":[\n");
+    bool first = true;
+    for (u32 i = 0; i < worker_count; ++i) {
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,"
+                "\"args\":{\"name\":\"%s %u\"}}",
+                first? "" : ",\n",
+                i,
+                workers[i].name,
+                i);
+        first = false;
+    }
+    for (u32 i = 0; i < worker_count; ++i) {
+        Worker* worker = workers + i;
+        for (u32 j = 0; j < worker->event_count; ++j) {
+            TraceEvent* event = worker->events + j;
+            fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,"
+                    "\"ts\":%llu,\"dur\":%llu}",
+                    first? "" : ",\n",
+                    event->name,
+                    i,
+                    (unsigned long long) event->start,
+                    (unsigned long long) (event->end - event->start));
+            first = false;
+        }
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+}
@@ -8,6 +8,12 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <float.h>
+#include <math.h>
+
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+#include <glm/trigonometric.hpp>
 
 #define MAX_MODELS 64
 #define MAX_SKELETONS 64
@@ -20,6 +26,9 @@ enum ContextType
     MODEL,
     ACTOR,
     SKELETON,
+    PIPELINE,
+    MATERIAL,
+    LIGHT,
 };
 
 struct ModelContext 
@@ -41,6 +50,9 @@ struct Context
         ModelContext model;
         Actor actor;
         SkeletonContext skeleton;
+        PipelineDesc pipeline;
+        MaterialDesc material;
+        Light light;
     };
 
     ContextType type;
@@ -52,6 +64,16 @@ struct Context
     char* skeleton_names[MAX_SKELETONS];
     u32 skeleton_count;
 
+    // Same order as the library of the scene
+    char* pipeline_names[MAX_PIPELINE_DESCS];
+    char* material_names[MAX_MATERIAL_DESCS];
+
+    // For errors found when the actor is flushed. The line of its ACTOR,
+    // or of its MATERIAL once it has one
+    const char* file;
+    const char* content;
+    u32 material_line;
+
     Arena arena;
 };
 
@@ -76,6 +98,16 @@ void skip_whitespaces(const char** ptr)
     }
 }
 
+// 1-based line of ptr in content
+u32 line_number(const char* content, const char* ptr)
+{
+    u32 line = 1;
+    for (const char* c = content; c < ptr; ++c) {
+        line += *c == '\n';
+    }
+    return line;
+}
+
 void next_line(const char** ptr) 
 {
     while (**ptr != '\n' && **ptr != 0) {
@@ -137,6 +169,65 @@ i32 read_int(const char** ptr)
     return result;
 }
 
+glm::vec3 read_vec3(const char** ptr)
+{
+    glm::vec3 result;
+    for (u32 i = 0; i < 3; ++i) {
+        skip_whitespaces(ptr);
+        result[i] = read_float(ptr);
+    }
+    return result;
+}
+
+void read_shader_path(const char** ptr, char* dst, Arena* arena)
+{
+    char* path = read_ident(ptr, arena);
+    if (strlen(path) >= SHADER_PATH_SIZE) {
+        printf("Shader path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(dst, path);
+}
+
+// Reads up to the next whitespace
+char* read_token(const char** ptr, Arena* arena)
+{
+    const char* start = *ptr;
+    i32 len = 0;
+    while (**ptr != 0 && **ptr != ' ' && **ptr != '\n' && **ptr != '\r') {
+        (*ptr)++;
+        len++;
+    }
+    char* str = (char*) push_size(arena, len + 1);
+    memcpy(str, start, len);
+    str[len] = 0;
+    return str;
+}
+
+// Returns -1 if the name is unknown
+i32 find_name(char** names, u32 count, const char* name)
+{
+    for (u32 i = 0; i < count; ++i) {
+        if (strcmp(names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Returns -1 if the mode is unknown
+i32 read_mode(const char** ptr, const char** modes, u32 mode_count, Arena* arena)
+{
+    char* mode = read_ident(ptr, arena);
+    for (u32 i = 0; i < mode_count; ++i) {
+        if (strcmp(modes[i], mode) == 0) {
+            return i;
+        }
+    }
+    printf("Unknown mode: %s\n", mode);
+    return -1;
+}
+
 void load_model(const char* file, ModelContext* model, Arena* arena) 
 {
     begin_tmp(arena);
@@ -176,6 +267,16 @@ void load_model(const char* file, ModelContext* model, Arena* arena)
     // TODO: does little / big endian matter here? Investigate!
     u8* ptr = (u8*) int_ptr;
     memcpy(vertex_memory, ptr, byte_size);
+
+    // Position is the first member of both vertex types
+    model->model.bounds.min = glm::vec3(FLT_MAX);
+    model->model.bounds.max = glm::vec3(-FLT_MAX);
+    for (u32 i = 0; i < vertex_count; ++i) {
+        float* pos = (float*) (vertex_memory + i * vertex_stride);
+        glm::vec3 p = glm::vec3(pos[0], pos[1], pos[2]);
+        model->model.bounds.min = glm::min(model->model.bounds.min, p);
+        model->model.bounds.max = glm::max(model->model.bounds.max, p);
+    }
     ptr += byte_size;
 
     u32 index_bytes = sizeof(u32) * index_count;
@@ -184,9 +285,37 @@ void load_model(const char* file, ModelContext* model, Arena* arena)
     end_tmp(arena);
 }
 
+// The renderer asserts on a missing vertex shader, report it while the
+// line is still known. Without materials the default ones are used
+void check_actor_pipeline(Context* context, Scene* scene)
+{
+    Actor* actor = &context->actor;
+    MaterialLibrary* library = &scene->library;
+    if (!actor->model || actor->material >= library->material_count) {
+        return;
+    }
+    MaterialDesc* material = library->materials + actor->material;
+    if (material->pipeline >= library->pipeline_count) {
+        return;
+    }
+    PipelineDesc* pipeline = library->pipelines + material->pipeline;
+    bool skinned = actor->model->flags & MODEL_FLAG_SKINNED;
+    u32 layout = skinned? VERTEX_LAYOUT_SKINNED : VERTEX_LAYOUT_STATIC;
+    if (!pipeline->vertex[layout][0]) {
+        printf("%s:%u: Pipeline %s of material %s has no %s shader\n",
+               context->file,
+               context->material_line,
+               context->pipeline_names[material->pipeline],
+               context->material_names[actor->material],
+               skinned? "SKINNED_VERTEX" : "VERTEX");
+        exit(1);
+    }
+}
+
 void flush_ctx(Context* context, Scene* scene)
 {
     if (context->type == ACTOR) {
+        check_actor_pipeline(context, scene);
         push_actor(scene, context->actor);
     } else if (context->type == MODEL) {
         if (!context->model.file) {
@@ -197,14 +326,42 @@ void flush_ctx(Context* context, Scene* scene)
         assert(context->model_count < MAX_MODELS);
         Model* model = (Model*) push_size(&asset_arena, sizeof(Model));
         *model = context->model.model;
+        model->id = context->model_count;
         context->model_names[context->model_count] = context->model.name;
         context->models[context->model_count] = model;
         context->model_count++;
     } else if (context->type == SKELETON) {
 
+    } else if (context->type == PIPELINE) {
+        PipelineDesc* desc = &context->pipeline;
+        bool has_vertex = false;
+        for (u32 i = 0; i < VERTEX_LAYOUT_COUNT; ++i) {
+            has_vertex = has_vertex || desc->vertex[i][0];
+        }
+        if (!has_vertex || !desc->fragment[0]) {
+            printf("Pipeline needs a vertex and a fragment shader: %s\n", 
+                   context->pipeline_names[scene->library.pipeline_count]);
+            exit(1);
+        }
+        push_pipeline_desc(scene, *desc);
+    } else if (context->type == MATERIAL) {
+        push_material_desc(scene, context->material);
+    } else if (context->type == LIGHT) {
+        push_light(scene, context->light);
     }
 }
 
+void read_vertex_shader(const char** ptr, Context* context, u32 layout)
+{
+    if (context->type != PIPELINE) {
+        printf("VERTEX has to be in pipeline context\n");
+        exit(1);
+    }
+    skip_whitespaces(ptr);
+    read_shader_path(ptr, context->pipeline.vertex[layout], &context->arena);
+    next_line(ptr);
+}
+
 void source_file(const char* file, Scene* scene) 
 {
     i32 len;
@@ -216,6 +373,8 @@ void source_file(const char* file, Scene* scene)
         exit(1);
     }
     printf("Parsing scene: %s\n", file);
+    context.file = file;
+    context.content = content;
     const char** ptr = &content;
     bool reached_end = false;
 
@@ -232,6 +391,7 @@ void source_file(const char* file, Scene* scene)
             context.model.name = name;
         } else if (prefix("ACTOR", ptr)) {
             flush_ctx(&context, scene);
+            context.material_line = line_number(context.content, *ptr);
 
             skip_whitespaces(ptr);
             char* model = read_ident(ptr, &context.arena);
@@ -259,6 +419,9 @@ void source_file(const char* file, Scene* scene)
             }
         } else if (prefix("POSITION", ptr)) {
             skip_whitespaces(ptr);
+            if (context.type == LIGHT) {
+                context.light.position = read_vec3(ptr);
+            }
             if (context.type == ACTOR) {
                 float x = read_float(ptr);
                 skip_whitespaces(ptr);
@@ -300,12 +463,201 @@ void source_file(const char* file, Scene* scene)
             }
             next_line(ptr);
         } else if (prefix("MATERIAL", ptr)) {
+            // Refers to a material in actor context, starts one otherwise.
+            // Materials have to be described before the actors using them
             skip_whitespaces(ptr);
+            MaterialLibrary* library = &scene->library;
             if (context.type == ACTOR) {
-                i32 material = read_int(ptr);
+                context.material_line = line_number(context.content, *ptr);
+                i32 material;
+                if (**ptr >= '0' && **ptr <= '9') {
+                    material = read_int(ptr);
+                    if (material >= (i32) library->material_count) {
+                        material = -1;
+                    }
+                } else {
+                    char* name = read_ident(ptr, &context.arena);
+                    material = find_name(context.material_names, library->material_count, name);
+                }
                 if (material >= 0) {
                     context.actor.material = material;
+                } else {
+                    printf("Unknown material in actor\n");
                 }
+            } else {
+                flush_ctx(&context, scene);
+                char* name = read_ident(ptr, &context.arena);
+                assert(library->material_count < MAX_MATERIAL_DESCS);
+                context.material_names[library->material_count] = name;
+                context.type = MATERIAL;
+                context.material = default_material_desc();
+            }
+            next_line(ptr);
+        } else if (prefix("PIPELINE", ptr)) {
+            flush_ctx(&context, scene);
+            skip_whitespaces(ptr);
+            char* name = read_ident(ptr, &context.arena);
+            assert(scene->library.pipeline_count < MAX_PIPELINE_DESCS);
+            context.pipeline_names[scene->library.pipeline_count] = name;
+            context.type = PIPELINE;
+            context.pipeline = PipelineDesc{};
+            context.pipeline.depth_write = true;
+            context.pipeline.specialization = default_specialization();
+            next_line(ptr);
+        } else if (prefix("VERTEX", ptr)) {
+            read_vertex_shader(ptr, &context, VERTEX_LAYOUT_STATIC);
+        } else if (prefix("SKINNED_VERTEX", ptr)) {
+            read_vertex_shader(ptr, &context, VERTEX_LAYOUT_SKINNED);
+        } else if (prefix("DEFINE", ptr)) {
+            skip_whitespaces(ptr);
+            if (context.type != PIPELINE) {
+                printf("DEFINE has to be in pipeline context\n");
+                exit(1);
+            }
+            char* define = read_token(ptr, &context.arena);
+            char* defines = context.pipeline.defines;
+            if (strlen(defines) + strlen(define) + 2 > SHADER_DEFINES_SIZE) {
+                printf("Too many defines: %s\n", define);
+                exit(1);
+            }
+            if (defines[0]) {
+                strcat(defines, " ");
+            }
+            strcat(defines, define);
+            next_line(ptr);
+        } else if (prefix("FRAGMENT", ptr)) {
+            skip_whitespaces(ptr);
+            if (context.type != PIPELINE) {
+                printf("FRAGMENT has to be in pipeline context\n");
+                exit(1);
+            }
+            read_shader_path(ptr, context.pipeline.fragment, &context.arena);
+            next_line(ptr);
+        } else if (prefix("BLEND", ptr)) {
+            skip_whitespaces(ptr);
+            const char* modes[] = {"opaque", "alpha", "additive"};
+            i32 mode = read_mode(ptr, modes, 3, &context.arena);
+            if (context.type == PIPELINE && mode >= 0) {
+                context.pipeline.blend = mode;
+            }
+            next_line(ptr);
+        } else if (prefix("DEPTH_WRITE", ptr)) {
+            skip_whitespaces(ptr);
+            i32 write = read_int(ptr);
+            if (context.type == PIPELINE) {
+                context.pipeline.depth_write = write != 0;
+            }
+            next_line(ptr);
+        } else if (prefix("DEPTH", ptr)) {
+            skip_whitespaces(ptr);
+            const char* modes[] = {"less", "less_equal", "equal", "off"};
+            i32 mode = read_mode(ptr, modes, 4, &context.arena);
+            if (context.type == PIPELINE && mode >= 0) {
+                context.pipeline.depth_test = mode;
+            }
+            next_line(ptr);
+        } else if (prefix("LIGHTS", ptr)) {
+            skip_whitespaces(ptr);
+            i32 count = read_int(ptr);
+            if (count < 0 || count > MAX_SHADER_LIGHTS) {
+                printf("LIGHTS has to be in [0, %d]\n", MAX_SHADER_LIGHTS);
+                exit(1);
+            }
+            if (context.type == PIPELINE) {
+                context.pipeline.specialization.light_count = count;
+            }
+            next_line(ptr);
+        } else if (prefix("LIGHT", ptr)) {
+            flush_ctx(&context, scene);
+            skip_whitespaces(ptr);
+            const char* types[] = {"point", "spot"};
+            i32 type = read_mode(ptr, types, 2, &context.arena);
+            context.type = LIGHT;
+            context.light = Light{};
+            context.light.type = type == LIGHT_SPOT? LIGHT_SPOT : LIGHT_POINT;
+            context.light.color = glm::vec3(1.0f);
+            context.light.direction = glm::vec3(0.0f, 0.0f, -1.0f);
+            context.light.range = 10.0f;
+            context.light.cos_inner = cosf(glm::radians(20.0f));
+            context.light.cos_outer = cosf(glm::radians(30.0f));
+            next_line(ptr);
+        } else if (prefix("COLOR", ptr)) {
+            if (context.type == LIGHT) {
+                context.light.color = read_vec3(ptr);
+            }
+            next_line(ptr);
+        } else if (prefix("RANGE", ptr)) {
+            skip_whitespaces(ptr);
+            if (context.type == LIGHT) {
+                context.light.range = read_float(ptr);
+            }
+            next_line(ptr);
+        } else if (prefix("DIRECTION", ptr)) {
+            if (context.type == LIGHT) {
+                context.light.direction = glm::normalize(read_vec3(ptr));
+            }
+            next_line(ptr);
+        } else if (prefix("CONE", ptr)) {
+            // Inner and outer angle in degrees
+            skip_whitespaces(ptr);
+            if (context.type == LIGHT) {
+                float inner = read_float(ptr);
+                skip_whitespaces(ptr);
+                float outer = read_float(ptr);
+                context.light.cos_inner = cosf(glm::radians(inner));
+                context.light.cos_outer = cosf(glm::radians(outer));
+            }
+            next_line(ptr);
+        } else if (prefix("BRDF", ptr)) {
+            skip_whitespaces(ptr);
+            const char* modes[] = {"ggx", "lambert"};
+            i32 mode = read_mode(ptr, modes, 2, &context.arena);
+            if (context.type == PIPELINE && mode >= 0) {
+                context.pipeline.specialization.brdf = mode;
+            }
+            next_line(ptr);
+        } else if (prefix("CULL", ptr)) {
+            skip_whitespaces(ptr);
+            const char* modes[] = {"back", "front", "none"};
+            i32 mode = read_mode(ptr, modes, 3, &context.arena);
+            if (context.type == PIPELINE && mode >= 0) {
+                context.pipeline.cull = mode;
+            }
+            next_line(ptr);
+        } else if (prefix("USE_PIPELINE", ptr)) {
+            if (context.type != MATERIAL) {
+                printf("USE_PIPELINE has to be used in material context\n");
+                exit(1);
+            }
+            skip_whitespaces(ptr);
+            char* name = read_ident(ptr, &context.arena);
+            i32 pipeline = find_name(context.pipeline_names, scene->library.pipeline_count, name);
+            if (pipeline < 0) {
+                printf("Unknown pipeline: %s\n", name);
+                exit(1);
+            }
+            context.material.pipeline = pipeline;
+            next_line(ptr);
+        } else if (prefix("ROUGHNESS", ptr)) {
+            skip_whitespaces(ptr);
+            if (context.type == MATERIAL) {
+                context.material.roughness = read_float(ptr);
+            }
+            next_line(ptr);
+        } else if (prefix("SMOOTHNESS", ptr)) {
+            skip_whitespaces(ptr);
+            if (context.type == MATERIAL) {
+                context.material.smoothness = read_float(ptr);
+            }
+            next_line(ptr);
+        } else if (prefix("SPECULAR", ptr)) {
+            if (context.type == MATERIAL) {
+                context.material.specular = read_vec3(ptr);
+            }
+            next_line(ptr);
+        } else if (prefix("DIFFUSE", ptr)) {
+            if (context.type == MATERIAL) {
+                context.material.diffuse = read_vec3(ptr);
             }
             next_line(ptr);
         } else if (prefix("SKELETON", ptr)) {
@@ -317,6 +669,17 @@ void source_file(const char* file, Scene* scene)
             assert(context.skeleton_count < MAX_SKELETONS);
             context.skeleton_names[context.skeleton_count] = name;
             next_line(ptr);
+        } else if (prefix("BONE_INFLUENCES", ptr)) {
+            skip_whitespaces(ptr);
+            i32 count = read_int(ptr);
+            if (count < 1 || count > MAX_BONE_INFLUENCES) {
+                printf("BONE_INFLUENCES has to be in [1, %d]\n", MAX_BONE_INFLUENCES);
+                exit(1);
+            }
+            if (context.type == PIPELINE) {
+                context.pipeline.specialization.bone_influences = count;
+            }
+            next_line(ptr);
         } else if (prefix("BONE", ptr)) {
             skip_whitespaces(ptr);
             if (context.type != SKELETON) {
@@ -357,5 +720,11 @@ void source_file(const char* file, Scene* scene)
         }
     }
     flush_ctx(&context, scene);
+    if (scene->library.pipeline_count == 0) {
+        push_pipeline_desc(scene, default_pipeline_desc());
+    }
+    if (scene->library.material_count == 0) {
+        push_material_desc(scene, default_material_desc());
+    }
     dispose(&context.arena);
 }
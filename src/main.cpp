@@ -10,6 +10,9 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include <glm/mat4x4.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
@@ -17,30 +20,122 @@
 #include "include/assets.h"
 #include "include/arena.h"
 #include "include/scene.h"
+#include "include/spatial.h"
 #include "include/loading.h"
 #include "include/camera.h"
 #include "include/vulkan_renderer.h"
+#include "include/jobs.h"
+#include "include/game_math.h"
 
 const u32 width = 1280;
 const u32 height = 720;
 
+// Bones of the static test pose
+#define POSE_BONE_COUNT 2
+#define CAMERA_NEAR 0.1f
+#define CAMERA_FAR 1000.0f
+// Towards the sun, the first light of pbr.frag
+#define SUN_DIRECTION glm::vec3(1.0f, 1.0f, 2.0f)
+// Area the benchmark lights are scattered over, centered on the origin
+#define BENCH_LIGHT_AREA 60.0f
+
 GLFWwindow *window;
 float last_mouse_pos_x;
 float last_mouse_pos_y;
 
-bool frame_buffer_resized = false;
+bool gpu_driven_enabled = true;
+bool depth_prepass_enabled = true;
+bool measure_overdraw = false;
+bool taa_on = true;
+bool dynamic_resolution_on = true;
+bool capture_trace = false;
+// Frames left until the trace is written
+u32 trace_frames = 0;
 
 glm::mat4 proj;
 
 Scene scene;
+// Lights from this index on were added by --bench-lights and orbit
+// around their position
+u32 bench_light_first = UINT_MAX;
+
+// Scratch of the simulation, shared with its jobs
+struct FrameData
+{
+    glm::mat4 proj_view;
+    glm::mat4 transforms[ACTOR_COUNT];
+    u32 visible[ACTOR_COUNT];
+    u32 visible_count;
+    // of one shadow cascade
+    u32 casters[ACTOR_COUNT];
+    // Pose of the last snapshot, prev_pose_valid is false before the first
+    Bone prev_pose[POSE_BONE_COUNT];
+    bool prev_pose_valid;
+};
+
+FrameData frame;
+
+struct DrawItem
+{
+    glm::mat4 transform;
+    glm::mat4 prev_mvp;
+    Model* model;
+    u32 material;
+};
+
+// Everything the render thread needs for a frame. Not touched by the
+// simulation once published
+struct Snapshot
+{
+    glm::vec3 camera_pos;
+    glm::mat4 view;
+    glm::mat4 proj;
+    i32 framebuffer_width;
+    i32 framebuffer_height;
+
+    DrawItem draws[ACTOR_COUNT];
+    u32 draw_count;
+    Bone bones[POSE_BONE_COUNT];
+    Bone prev_bones[POSE_BONE_COUNT];
+    Light lights[MAX_SCENE_LIGHTS];
+    u32 light_count;
+};
+
+struct LightJob
+{
+    Snapshot* snapshot;
+    float time;
+};
+
+// The simulation builds the snapshot of frame N + 1 while the render
+// thread records and submits frame N
+struct FramePipeline
+{
+    Snapshot snapshots[2];
+
+    std::mutex lock;
+    std::condition_variable cond;
+    // Snapshots published by the simulation
+    u64 produced;
+    // Snapshots the render thread is done reading, their slot can be reused
+    u64 released;
+    // Frames the render thread submitted
+    u64 rendered;
+    bool quit;
+
+    // Of the last rendered frame
+    RenderStats stats;
+};
+
+FramePipeline frame_pipeline;
+std::thread render_thread;
 
 
 void resize_callback(GLFWwindow *window, i32 width, i32 height) 
 {
-    frame_buffer_resized = true;
     proj = glm::perspective(glm::radians(45.0f), 
                             (float) width / (float) height, 
-                            0.1f, 1000.0f);
+                            CAMERA_NEAR, CAMERA_FAR);
     proj[1][1] *= -1;
 }
 
@@ -56,6 +151,116 @@ void mouse_callback(GLFWwindow* window, double pos_x, double pos_y)
     camera.process_mouse_input(x_offset, y_offset);
 }
 
+void key_callback(GLFWwindow* window, i32 key, i32 scancode, i32 action, i32 mods)
+{
+    if (key == GLFW_KEY_G && action == GLFW_PRESS) {
+        gpu_driven_enabled = !gpu_driven_enabled;
+        set_gpu_driven(gpu_driven_enabled);
+    }
+    if (key == GLFW_KEY_T && action == GLFW_PRESS) {
+        capture_trace = true;
+    }
+    if (key == GLFW_KEY_P && action == GLFW_PRESS) {
+        depth_prepass_enabled = !depth_prepass_enabled;
+        set_depth_prepass(depth_prepass_enabled);
+    }
+    if (key == GLFW_KEY_O && action == GLFW_PRESS) {
+        measure_overdraw = !measure_overdraw;
+        set_overdraw_measurement(measure_overdraw);
+    }
+    if (key == GLFW_KEY_J && action == GLFW_PRESS) {
+        taa_on = !taa_on;
+        set_taa(taa_on);
+    }
+    if (key == GLFW_KEY_R && action == GLFW_PRESS) {
+        dynamic_resolution_on = !dynamic_resolution_on;
+        set_dynamic_resolution(dynamic_resolution_on);
+    }
+}
+
+void transform_job(void* data, u32 first, u32 last)
+{
+    FrameData* frame = (FrameData*) data;
+    for (u32 i = first; i < last; ++i) {
+        frame->transforms[i] = get_actor_transform(scene.actors + i);
+    }
+}
+
+void queue_job(void* data, u32 first, u32 last)
+{
+    Snapshot* snapshot = (Snapshot*) data;
+    for (u32 i = first; i < last; ++i) {
+        DrawItem* draw = snapshot->draws + i;
+        if (draw->model->flags & MODEL_FLAG_SKINNED) {
+            draw_rigged(&draw->transform, &draw->prev_mvp, draw->model, draw->material, 
+                        snapshot->bones, snapshot->prev_bones, POSE_BONE_COUNT);
+        } else {
+            draw_object(&draw->transform, &draw->prev_mvp, draw->model, draw->material);
+        }
+    }
+}
+
+void prev_mvp_job(void* data, u32 first, u32 last)
+{
+    FrameData* frame = (FrameData*) data;
+    for (u32 i = first; i < last; ++i) {
+        scene.actors[i].prev_mvp = frame->proj_view * frame->transforms[i];
+    }
+}
+
+void light_job(void* data, u32 first, u32 last)
+{
+    LightJob* job = (LightJob*) data;
+    for (u32 i = first; i < last; ++i) {
+        Light light = scene.lights[i];
+        if (i >= bench_light_first) {
+            // Phase and radius vary per light so they don't move in lockstep
+            float phase = job->time * (0.5f + (i % 7) * 0.1f) + (float) i;
+            float radius = 1.0f + (i % 5);
+            light.position.x += cosf(phase) * radius;
+            light.position.y += sinf(phase) * radius;
+        }
+        job->snapshot->lights[i] = light;
+    }
+}
+
+// xorshift, the benchmark has to place the same lights every run
+u32 next_random(u32* state)
+{
+    u32 x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+float random_float(u32* state, float low, float high)
+{
+    return low + (high - low) * (next_random(state) & 0xffffff) / (float) 0xffffff;
+}
+
+void add_bench_lights(Scene* scene, u32 count)
+{
+    bench_light_first = scene->light_count;
+    u32 state = 0x9e3779b9;
+    for (u32 i = 0; i < count; ++i) {
+        Light light{};
+        light.type = i % 4 == 0? LIGHT_SPOT : LIGHT_POINT;
+        light.position = glm::vec3(random_float(&state, -0.5f, 0.5f) * BENCH_LIGHT_AREA,
+                                   random_float(&state, -0.5f, 0.5f) * BENCH_LIGHT_AREA,
+                                   random_float(&state, 0.5f, 4.0f));
+        light.color = glm::vec3(random_float(&state, 0.1f, 1.0f),
+                                random_float(&state, 0.1f, 1.0f),
+                                random_float(&state, 0.1f, 1.0f));
+        light.range = random_float(&state, 1.5f, 4.0f);
+        light.direction = glm::vec3(0.0f, 0.0f, -1.0f);
+        light.cos_inner = cosf(glm::radians(25.0f));
+        light.cos_outer = cosf(glm::radians(35.0f));
+        push_light(scene, light);
+    }
+}
+
 void init_window() 
 {
     glfwInit();
@@ -66,6 +271,119 @@ void init_window()
 
     glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
     glfwSetCursorPosCallback(window, mouse_callback);
+    glfwSetKeyCallback(window, key_callback);
+}
+
+// Waits until the slot of the next snapshot is no longer read
+Snapshot* acquire_snapshot(FramePipeline* pipeline)
+{
+    std::unique_lock<std::mutex> lock(pipeline->lock);
+    pipeline->cond.wait(lock, [&] { return pipeline->produced - pipeline->released < 2; });
+    return pipeline->snapshots + pipeline->produced % 2;
+}
+
+void publish_snapshot(FramePipeline* pipeline)
+{
+    {
+        std::lock_guard<std::mutex> guard(pipeline->lock);
+        pipeline->produced++;
+    }
+    pipeline->cond.notify_all();
+}
+
+// Waits until every published frame is submitted
+void wait_render_idle(FramePipeline* pipeline)
+{
+    std::unique_lock<std::mutex> lock(pipeline->lock);
+    pipeline->cond.wait(lock, [&] { return pipeline->rendered == pipeline->produced; });
+}
+
+RenderView get_render_view(glm::vec3 camera_pos, glm::mat4 view, glm::mat4 proj)
+{
+    RenderView render_view;
+    render_view.camera_pos = camera_pos;
+    render_view.view = view;
+    render_view.proj = proj;
+    render_view.near_plane = CAMERA_NEAR;
+    render_view.far_plane = CAMERA_FAR;
+    render_view.sun_direction = glm::normalize(SUN_DIRECTION);
+    return render_view;
+}
+
+void render_main()
+{
+    attach_thread("render");
+    FramePipeline* pipeline = &frame_pipeline;
+    while (true) {
+        Snapshot* snapshot;
+        {
+            std::unique_lock<std::mutex> lock(pipeline->lock);
+            pipeline->cond.wait(lock, [&] { 
+                return pipeline->rendered < pipeline->produced || pipeline->quit; 
+            });
+            if (pipeline->quit) {
+                break;
+            }
+            snapshot = pipeline->snapshots + pipeline->rendered % 2;
+        }
+
+        set_framebuffer_size(snapshot->framebuffer_width, snapshot->framebuffer_height);
+        RenderView view = get_render_view(snapshot->camera_pos, snapshot->view, snapshot->proj);
+        start_frame(&view);
+        draw_lights(snapshot->lights, snapshot->light_count);
+        parallel_for("fill queue", snapshot->draw_count, 64, queue_job, snapshot);
+
+        // The queue holds copies of everything, the simulation can have the slot
+        {
+            std::lock_guard<std::mutex> guard(pipeline->lock);
+            pipeline->released++;
+        }
+        pipeline->cond.notify_all();
+
+        end_frame(window);
+
+        {
+            std::lock_guard<std::mutex> guard(pipeline->lock);
+            pipeline->rendered++;
+            pipeline->stats = get_render_stats();
+        }
+        pipeline->cond.notify_all();
+    }
+}
+
+void start_render_thread()
+{
+    frame_pipeline.produced = 0;
+    frame_pipeline.released = 0;
+    frame_pipeline.rendered = 0;
+    frame_pipeline.quit = false;
+    render_thread = std::thread(render_main);
+}
+
+void stop_render_thread()
+{
+    {
+        std::lock_guard<std::mutex> guard(frame_pipeline.lock);
+        frame_pipeline.quit = true;
+    }
+    frame_pipeline.cond.notify_all();
+    render_thread.join();
+}
+
+// Every actor is drawn at most once per frame
+RenderLimits get_render_limits(Scene* scene)
+{
+    RenderLimits limits{};
+    limits.max_instances = scene->actor_count;
+    limits.max_lights = scene->light_count;
+    for (u32 i = 0; i < scene->actor_count; ++i) {
+        Actor* actor = scene->actors + i;
+        limits.max_materials = max(limits.max_materials, actor->material + 1);
+        if (actor->model->flags & MODEL_FLAG_SKINNED) {
+            limits.max_bones += POSE_BONE_COUNT;
+        }
+    }
+    return limits;
 }
 
 void init_allocators()
@@ -78,37 +396,46 @@ void init_allocators()
     init_arena(&asset_arena, &pool);
 }
 
-glm::mat4 get_actor_transform(Actor* actor)
+i32 main(i32 argc, char** argv) 
 {
-    glm::mat4 res;
-    res = glm::mat4(1.0);
-    res = glm::translate(res, glm::vec3(actor->x, actor->y, actor->z));
-    res = glm::rotate(res, glm::radians(actor->rot_x), glm::vec3(1.0f, 0.0f, 0.0f));
-    res = glm::rotate(res, glm::radians(actor->rot_y), glm::vec3(0.0f, 1.0f, 0.0f));
-    res = glm::rotate(res, glm::radians(actor->rot_z), glm::vec3(0.0f, 0.0f, 1.0f));
-    res = glm::scale(res, glm::vec3(actor->scale_x, actor->scale_y, actor->scale_z));
-    return res;
-}
+    if (argc > 1 && strcmp(argv[1], "--bench-spatial") == 0) {
+        bench_spatial();
+        return 0;
+    }
+    u32 bench_lights = 0;
+    if (argc > 2 && strcmp(argv[1], "--bench-lights") == 0) {
+        bench_lights = (u32) atoi(argv[2]);
+    }
 
-i32 main() 
-{
     init_allocators();
+    init_jobs(0);
     init_window();
     init_scene(&scene);
     camera.init();
     source_file("assets/scene.end", &scene);
+    if (bench_lights > 0) {
+        add_bench_lights(&scene, clamp(bench_lights, 0, MAX_SCENE_LIGHTS - scene.light_count));
+        printf("Light benchmark: %u lights\n", scene.light_count);
+    }
+    build_grid(&scene);
 
-    init_vulkan(window);
-    init_materials();
+    init_vulkan(window, get_render_limits(&scene), &scene.library);
+    init_materials(&scene.library);
+    start_render_thread();
 
     proj = glm::perspective(glm::radians(45.0f), 
                             (float) width / (float) height, 
-                            0.1f, 1000.0f);
+                            CAMERA_NEAR, CAMERA_FAR);
     proj[1][1] *= -1;
 
     // current_frame = 0;
     float time_last_frame = glfwGetTime();
     float delta = 0;
+    float time_last_stats = time_last_frame;
+    // Frame times since the last stats
+    float frame_time_sum = 0.0f;
+    float frame_time_max = 0.0f;
+    u32 frame_time_count = 0;
 
     while (!glfwWindowShouldClose(window)) {
         if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
@@ -118,36 +445,152 @@ i32 main()
         float current_time = glfwGetTime();
         delta = current_time - time_last_frame;
         time_last_frame = current_time;
+        frame_time_sum += delta;
+        frame_time_max = fmaxf(frame_time_max, delta);
+        frame_time_count++;
 
         camera.process_key_input(window, delta);
 
         glm::mat4 view = glm::lookAt(camera.pos, camera.pos + camera.front, glm::vec3(0.0, 0.0, 1.0));
         glm::mat4 proj_view = proj * view;
 
-        start_frame(camera.pos, proj_view);
+        // Drain the pipeline, then trace this and the next frame, so the
+        // simulation of one frame shows up next to the rendering of the other
+        if (capture_trace && trace_frames == 0) {
+            wait_render_idle(&frame_pipeline);
+            begin_trace_frame(true);
+            capture_trace = false;
+            trace_frames = 2;
+        }
+
+        u64 trace_start = trace_begin();
+        Snapshot* snapshot = acquire_snapshot(&frame_pipeline);
+        trace_end("wait for snapshot", trace_start);
 
-        Bone bones[2] = {
-            glm::mat4(1.0f),
-            glm::rotate(glm::mat4(1.0f), glm::radians(45.0f), glm::vec3(1.0f, 0.0f, 0.0f))
-        };
+        frame.proj_view = proj_view;
+        parallel_for("transforms", scene.actor_count, 64, transform_job, &frame);
 
+        // The grid is not thread safe, refit and query it in one go
+        trace_start = trace_begin();
         for (u32 i = 0; i < scene.actor_count; ++i) {
-            Actor actor = scene.actors[i];
-            glm::mat4 transform = get_actor_transform(&actor);
-            if (actor.model->flags & MODEL_FLAG_SKINNED) {
-                draw_rigged(&transform, &actor.prev_mvp, actor.model, actor.material, bones, 2);
-            } else {
-                draw_object(&transform, &actor.prev_mvp, actor.model, actor.material);
+            update_grid(&scene, i, frame.transforms + i);
+        }
+        Frustum frustum = frustum_from_matrix(proj_view);
+        frame.visible_count = grid_query_frustum(&scene.grid, &frustum, frame.visible, ACTOR_COUNT);
+        // Actors out of view still cast shadows into it, the renderer only
+        // draws them into the cascades they touch
+        RenderView render_view = get_render_view(camera.pos, view, proj);
+        Frustum shadow_frustums[SHADOW_CASCADES];
+        get_shadow_frustums(&render_view, shadow_frustums);
+        bool listed[ACTOR_COUNT] = {};
+        for (u32 i = 0; i < frame.visible_count; ++i) {
+            listed[frame.visible[i]] = true;
+        }
+        for (u32 i = 0; i < SHADOW_CASCADES; ++i) {
+            u32 count = grid_query_frustum(&scene.grid, shadow_frustums + i, 
+                                           frame.casters, ACTOR_COUNT);
+            for (u32 j = 0; j < count; ++j) {
+                if (!listed[frame.casters[j]]) {
+                    listed[frame.casters[j]] = true;
+                    frame.visible[frame.visible_count++] = frame.casters[j];
+                }
             }
-            scene.actors[i].prev_mvp = proj_view * transform;
         }
+        trace_end("cull", trace_start);
 
-        end_frame(window);
+        trace_start = trace_begin();
+        snapshot->camera_pos = camera.pos;
+        snapshot->view = view;
+        snapshot->proj = proj;
+        glfwGetFramebufferSize(window, &snapshot->framebuffer_width, &snapshot->framebuffer_height);
+        // Static test pose, there is no animation data to sample yet
+        snapshot->bones[0] = glm::mat4(1.0f);
+        snapshot->bones[1] = glm::rotate(glm::mat4(1.0f), 
+                                         glm::radians(45.0f), 
+                                         glm::vec3(1.0f, 0.0f, 0.0f));
+        if (!frame.prev_pose_valid) {
+            memcpy(frame.prev_pose, snapshot->bones, sizeof(frame.prev_pose));
+            frame.prev_pose_valid = true;
+        }
+        memcpy(snapshot->prev_bones, frame.prev_pose, sizeof(frame.prev_pose));
+        memcpy(frame.prev_pose, snapshot->bones, sizeof(frame.prev_pose));
+        snapshot->draw_count = frame.visible_count;
+        for (u32 i = 0; i < frame.visible_count; ++i) {
+            Actor* actor = scene.actors + frame.visible[i];
+            DrawItem* draw = snapshot->draws + i;
+            draw->transform = frame.transforms[frame.visible[i]];
+            draw->prev_mvp = actor->prev_mvp;
+            draw->model = actor->model;
+            draw->material = actor->material;
+        }
+        trace_end("snapshot", trace_start);
+
+        LightJob light_data;
+        light_data.snapshot = snapshot;
+        light_data.time = current_time;
+        snapshot->light_count = scene.light_count;
+        parallel_for("lights", scene.light_count, 256, light_job, &light_data);
+
+        parallel_for("prev mvp", scene.actor_count, 256, prev_mvp_job, &frame);
+        publish_snapshot(&frame_pipeline);
+
+        if (trace_frames > 0) {
+            trace_frames--;
+            if (trace_frames == 0) {
+                wait_render_idle(&frame_pipeline);
+                write_trace("trace.json");
+                begin_trace_frame(false);
+                printf("Wrote trace.json\n");
+            }
+        }
+
+        if (current_time - time_last_stats > 1.0f) {
+            time_last_stats = current_time;
+            RenderStats stats;
+            {
+                std::lock_guard<std::mutex> guard(frame_pipeline.lock);
+                stats = frame_pipeline.stats;
+            }
+            char title[512];
+            i32 length = snprintf(title, sizeof(title), 
+                                  "Vulkan | %.2f ms | draws %u | instances %u | "
+                                  "prepass draws %u | pipeline binds %u | buffer binds %u | "
+                                  "set binds %u | record %.3f ms on %u threads", 
+                                  delta * 1000.0f, stats.draws, stats.instances, 
+                                  stats.prepass_draws, stats.pipeline_binds, 
+                                  stats.buffer_binds, stats.descriptor_binds,
+                                  stats.record_ms, stats.record_threads);
+            for (u32 i = 0; i < SHADOW_CASCADES; ++i) {
+                length += snprintf(title + length, sizeof(title) - length, 
+                                   " | cascade %u: %u draws %.3f ms", i, 
+                                   stats.shadow_draws[i], stats.shadow_ms[i]);
+            }
+            if (stats.gpu_ms > 0.0f) {
+                length += snprintf(title + length, sizeof(title) - length, 
+                                   " | gpu %.2f ms at %.0f%%", 
+                                   stats.gpu_ms, stats.render_scale * 100.0f);
+            }
+            if (stats.overdraw > 0.0f) {
+                snprintf(title + length, sizeof(title) - length, 
+                         " | overdraw %.2f", stats.overdraw);
+            }
+            glfwSetWindowTitle(window, title);
+            if (bench_lights > 0) {
+                printf("%u lights | avg %.2f ms | max %.2f ms\n", scene.light_count,
+                       frame_time_sum / frame_time_count * 1000.0f, frame_time_max * 1000.0f);
+            }
+            frame_time_sum = 0.0f;
+            frame_time_max = 0.0f;
+            frame_time_count = 0;
+        }
 
         // current_frame = (current_frame + 1) % max_frames_in_flight;
         glfwPollEvents();
     }
+    stop_render_thread();
     glfwDestroyWindow(window);
     glfwTerminate();
     cleanup_vulkan();
+    dispose_grid(&scene.grid);
+    shutdown_jobs();
 }
@@ -1,2 +1,220 @@
 #include "include/render_queue.h"
 
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+
+u64 make_sort_key(u32 type, u32 pipeline, u32 model, u32 material, float depth)
+{
+    assert(pipeline < (1 << 4));
+    assert(model < (1 << 16));
+    assert(material < (1 << 12));
+    assert(depth >= 0);
+
+    // Positive floats keep their order when compared as integers
+    u32 depth_bits;
+    memcpy(&depth_bits, &depth, sizeof(u32));
+
+    if (type == QUEUE_TRANSPARENT) {
+        u64 state = ((u64) pipeline << SORT_KEY_PIPELINE_SHIFT) |
+            ((u64) model << SORT_KEY_MODEL_SHIFT) |
+            ((u64) material << SORT_KEY_MATERIAL_SHIFT);
+        return ((u64) ~depth_bits << 32) | (state >> 32);
+    }
+
+    return ((u64) pipeline << SORT_KEY_PIPELINE_SHIFT) |
+        ((u64) model << SORT_KEY_MODEL_SHIFT) |
+        ((u64) material << SORT_KEY_MATERIAL_SHIFT) |
+        depth_bits;
+}
+
+void radix_sort(u64* keys, u32* values, u64* tmp_keys, u32* tmp_values, u32 count)
+{
+    u32 histograms[8][256];
+    memset(histograms, 0, sizeof(histograms));
+    for (u32 i = 0; i < count; ++i) {
+        u64 key = keys[i];
+        for (u32 pass = 0; pass < 8; ++pass) {
+            histograms[pass][(key >> (pass * 8)) & 0xff]++;
+        }
+    }
+
+    u64* src_keys = keys;
+    u32* src_values = values;
+    u64* dst_keys = tmp_keys;
+    u32* dst_values = tmp_values;
+    for (u32 pass = 0; pass < 8; ++pass) {
+        u32* histogram = histograms[pass];
+        u32 shift = pass * 8;
+
+        // All keys share this byte, nothing to do. Happens a lot since
+        // pipeline and material only use a few bits
+        if (count == 0 || histogram[(src_keys[0] >> shift) & 0xff] == count)
+            continue;
+
+        u32 offset = 0;
+        for (u32 i = 0; i < 256; ++i) {
+            u32 bucket = histogram[i];
+            histogram[i] = offset;
+            offset += bucket;
+        }
+        for (u32 i = 0; i < count; ++i) {
+            u32 dst = histogram[(src_keys[i] >> shift) & 0xff]++;
+            dst_keys[dst] = src_keys[i];
+            dst_values[dst] = src_values[i];
+        }
+
+        u64* swap_keys = src_keys;
+        u32* swap_values = src_values;
+        src_keys = dst_keys;
+        src_values = dst_values;
+        dst_keys = swap_keys;
+        dst_values = swap_values;
+    }
+
+    if (src_keys != keys) {
+        memcpy(keys, src_keys, sizeof(u64) * count);
+        memcpy(values, src_values, sizeof(u32) * count);
+    }
+}
+
+bool same_model(Message* message, Batch* batch)
+{
+    return message->pipeline == batch->pipeline &&
+        message->index_offset == batch->index_offset &&
+        message->vertex_offset == batch->vertex_offset;
+}
+
+// Keeps everything pushed from the queue arena 8 byte aligned
+void* push_array(Arena* arena, u32 size)
+{
+    return push_size(arena, (size + 7) & ~7);
+}
+
+void init_queue(RenderQueue* queue, MemoryPool* pool)
+{
+    *queue = {};
+    for (u32 i = 0; i < MAX_WORKERS; ++i) {
+        init_arena(queue->arenas + i, pool);
+    }
+}
+
+void reset_queue(RenderQueue* queue)
+{
+    for (u32 i = 0; i < MAX_WORKERS; ++i) {
+        clear(queue->arenas + i);
+        for (u32 type = 0; type < QUEUE_COUNT; ++type) {
+            queue->lists[i][type] = {};
+        }
+    }
+    queue->messages = NULL;
+    queue->message_count = 0;
+    queue->batches = NULL;
+    queue->batch_count = 0;
+    queue->depth_order = NULL;
+    queue->depth_order_count = 0;
+}
+
+Message* push_message(RenderQueue* queue, u32 type)
+{
+    assert(type < QUEUE_COUNT);
+    u32 worker = get_worker_index();
+    MessageList* list = &queue->lists[worker][type];
+    if (!list->last || list->last->count == MESSAGE_CHUNK_SIZE) {
+        MessageChunk* chunk = (MessageChunk*) push_array(queue->arenas + worker, 
+                                                         sizeof(MessageChunk));
+        chunk->count = 0;
+        chunk->next = NULL;
+        if (list->last) {
+            list->last->next = chunk;
+        } else {
+            list->first = chunk;
+        }
+        list->last = chunk;
+    }
+
+    list->count++;
+    return list->last->messages + list->last->count++;
+}
+
+void build_batches(RenderQueue* queue)
+{
+    u32 count = 0;
+    for (u32 i = 0; i < MAX_WORKERS; ++i) {
+        for (u32 type = 0; type < QUEUE_COUNT; ++type) {
+            count += queue->lists[i][type].count;
+        }
+    }
+
+    Arena* arena = queue->arenas + get_worker_index();
+    u64* keys = (u64*) push_array(arena, sizeof(u64) * count);
+    u64* tmp_keys = (u64*) push_array(arena, sizeof(u64) * count);
+    u32* order = (u32*) push_array(arena, sizeof(u32) * count);
+    u32* tmp_order = (u32*) push_array(arena, sizeof(u32) * count);
+    Message* merged = (Message*) push_array(arena, sizeof(Message) * count);
+    queue->messages = (Message*) push_array(arena, sizeof(Message) * count);
+    queue->batches = (Batch*) push_array(arena, sizeof(Batch) * count);
+    queue->message_count = count;
+    queue->batch_count = 0;
+
+    u32 first = 0;
+    for (u32 type = 0; type < QUEUE_COUNT; ++type) {
+        u32 message_count = 0;
+        for (u32 worker = 0; worker < MAX_WORKERS; ++worker) {
+            MessageList* list = &queue->lists[worker][type];
+            for (MessageChunk* chunk = list->first; chunk; chunk = chunk->next) {
+                memcpy(merged + first + message_count, 
+                       chunk->messages, 
+                       sizeof(Message) * chunk->count);
+                message_count += chunk->count;
+            }
+        }
+
+        // Queues are sorted on their own, so they keep their order after merging
+        for (u32 i = 0; i < message_count; ++i) {
+            keys[i] = merged[first + i].sort_key;
+            order[i] = first + i;
+        }
+        radix_sort(keys, order, tmp_keys, tmp_order, message_count);
+
+        queue->queue_messages[type] = first;
+        queue->queue_batches[type] = queue->batch_count;
+        Batch* batch = NULL;
+        for (u32 i = first; i < first + message_count; ++i) {
+            Message* message = queue->messages + i;
+            *message = merged[order[i - first]];
+            if (!batch || !same_model(message, batch)) {
+                batch = queue->batches + queue->batch_count++;
+                batch->pipeline = message->pipeline;
+                batch->vertex_offset = message->vertex_offset;
+                batch->index_offset = message->index_offset;
+                batch->index_count = message->index_count;
+                batch->first_instance = i;
+                batch->instance_count = 0;
+            }
+            batch->instance_count++;
+        }
+
+        first += message_count;
+    }
+    queue->queue_messages[QUEUE_COUNT] = first;
+    queue->queue_batches[QUEUE_COUNT] = queue->batch_count;
+
+    // Batches span several materials, so their nearest instance isn't
+    // necessarily the first one. The depth is in the low bits of the key
+    u32 opaque_first = queue->queue_batches[QUEUE_OPAQUE];
+    u32 opaque_count = queue->queue_batches[QUEUE_OPAQUE + 1] - opaque_first;
+    queue->depth_order = (u32*) push_array(arena, sizeof(u32) * opaque_count);
+    queue->depth_order_count = opaque_count;
+    for (u32 i = 0; i < opaque_count; ++i) {
+        Batch* batch = queue->batches + opaque_first + i;
+        u32 nearest = UINT32_MAX;
+        for (u32 j = 0; j < batch->instance_count; ++j) {
+            u32 depth_bits = (u32) queue->messages[batch->first_instance + j].sort_key;
+            nearest = depth_bits < nearest? depth_bits : nearest;
+        }
+        keys[i] = nearest;
+        queue->depth_order[i] = opaque_first + i;
+    }
+    radix_sort(keys, queue->depth_order, tmp_keys, tmp_order, opaque_count);
+}
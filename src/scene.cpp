@@ -1,11 +1,18 @@
 #include <assert.h>
+#include <float.h>
+#include <string.h>
 
 #include "include/scene.h"
 #include "include/arena.h"
 
+#include <glm/gtc/matrix_transform.hpp>
+
 void init_scene(Scene* scene)
 {
     scene->actor_count = 0;
+    scene->light_count = 0;
+    scene->library.pipeline_count = 0;
+    scene->library.material_count = 0;
 }
 
 void push_actor(Scene* scene, Actor actor)
@@ -14,3 +21,109 @@ void push_actor(Scene* scene, Actor actor)
     scene->actors[scene->actor_count] = actor;
     scene->actor_count++;
 }
+
+void push_light(Scene* scene, Light light)
+{
+    assert(scene->light_count < MAX_SCENE_LIGHTS);
+    scene->lights[scene->light_count] = light;
+    scene->light_count++;
+}
+
+u32 push_pipeline_desc(Scene* scene, PipelineDesc desc)
+{
+    MaterialLibrary* library = &scene->library;
+    assert(library->pipeline_count < MAX_PIPELINE_DESCS);
+    library->pipelines[library->pipeline_count] = desc;
+    return library->pipeline_count++;
+}
+
+u32 push_material_desc(Scene* scene, MaterialDesc desc)
+{
+    MaterialLibrary* library = &scene->library;
+    assert(library->material_count < MAX_MATERIAL_DESCS);
+    library->materials[library->material_count] = desc;
+    return library->material_count++;
+}
+
+// Matches the defaults in the shaders
+ShaderSpecialization default_specialization()
+{
+    ShaderSpecialization specialization;
+    specialization.light_count = MAX_SHADER_LIGHTS;
+    specialization.bone_influences = MAX_BONE_INFLUENCES;
+    specialization.brdf = BRDF_GGX;
+    return specialization;
+}
+
+// The pbr pipeline, used when a scene doesn't describe any
+PipelineDesc default_pipeline_desc()
+{
+    PipelineDesc desc{};
+    desc.specialization = default_specialization();
+    strcpy(desc.vertex[VERTEX_LAYOUT_STATIC], "shader/pbr.vert");
+    strcpy(desc.vertex[VERTEX_LAYOUT_SKINNED], "shader/skinned.vert");
+    strcpy(desc.fragment, "shader/pbr.frag");
+    desc.blend = BLEND_OPAQUE;
+    desc.depth_test = DEPTH_TEST_LESS;
+    desc.depth_write = true;
+    desc.cull = CULL_BACK;
+    return desc;
+}
+
+MaterialDesc default_material_desc()
+{
+    MaterialDesc desc{};
+    desc.pipeline = 0;
+    desc.roughness = 1.0;
+    desc.smoothness = 0.05;
+    desc.specular = glm::vec3(0.01, 0.01, 0.01);
+    desc.diffuse = glm::vec3(0.5, 0.5, 0.5);
+    return desc;
+}
+
+glm::mat4 get_actor_transform(Actor* actor)
+{
+    glm::mat4 res;
+    res = glm::mat4(1.0);
+    res = glm::translate(res, glm::vec3(actor->x, actor->y, actor->z));
+    res = glm::rotate(res, glm::radians(actor->rot_x), glm::vec3(1.0f, 0.0f, 0.0f));
+    res = glm::rotate(res, glm::radians(actor->rot_y), glm::vec3(0.0f, 1.0f, 0.0f));
+    res = glm::rotate(res, glm::radians(actor->rot_z), glm::vec3(0.0f, 0.0f, 1.0f));
+    res = glm::scale(res, glm::vec3(actor->scale_x, actor->scale_y, actor->scale_z));
+    return res;
+}
+
+Bounds get_actor_bounds(Actor* actor, glm::mat4* transform)
+{
+    return transform_bounds(actor->model->bounds, transform);
+}
+
+void build_grid(Scene* scene)
+{
+    Bounds bounds[ACTOR_COUNT];
+    glm::vec2 min = glm::vec2(FLT_MAX);
+    glm::vec2 max = glm::vec2(-FLT_MAX);
+    for (u32 i = 0; i < scene->actor_count; ++i) {
+        glm::mat4 transform = get_actor_transform(scene->actors + i);
+        bounds[i] = get_actor_bounds(scene->actors + i, &transform);
+        min = glm::min(min, glm::vec2(bounds[i].min));
+        max = glm::max(max, glm::vec2(bounds[i].max));
+    }
+    if (scene->actor_count == 0) {
+        min = glm::vec2(0);
+        max = glm::vec2(0);
+    }
+
+    // Leave some room for pieces to move before they end up in overflow
+    min -= SCENE_CELL_SIZE;
+    max += SCENE_CELL_SIZE;
+    init_grid(&scene->grid, min, max, SCENE_CELL_SIZE, ACTOR_COUNT);
+    for (u32 i = 0; i < scene->actor_count; ++i) {
+        grid_insert(&scene->grid, i, bounds[i]);
+    }
+}
+
+void update_grid(Scene* scene, u32 actor, glm::mat4* transform)
+{
+    grid_update(&scene->grid, actor, get_actor_bounds(scene->actors + actor, transform));
+}
@@ -0,0 +1,105 @@
+#include "include/shader_cache.h"
+#include "include/utils.h"
+#include "include/jobs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define make_dir(path) _mkdir(path)
+#else
+#define make_dir(path) mkdir(path, 0755)
+#endif
+
+u64 hash_bytes(u64 hash, const void* data, u32 size)
+{
+    // FNV-1a
+    const u8* bytes = (const u8*) data;
+    for (u32 i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+bool file_exists(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    fclose(file);
+    return true;
+}
+
+char* load_shader(const char* source, const char* defines, i32* len)
+{
+    i32 source_len;
+    char* code = read_file(source, &source_len, NULL);
+    if (!code) {
+        return NULL;
+    }
+    // The name goes in as well, the stage depends on its extension
+    u64 hash = 14695981039346656037ull;
+    hash = hash_bytes(hash, source, strlen(source) + 1);
+    hash = hash_bytes(hash, defines, strlen(defines) + 1);
+    hash = hash_bytes(hash, code, source_len);
+    free(code);
+
+    char cache_file[128];
+    snprintf(cache_file, sizeof(cache_file), SHADER_CACHE_DIR "%016llx.spv",
+             (unsigned long long) hash);
+    char cache_path[1024];
+    snprintf(cache_path, sizeof(cache_path), PATH_PREFIX "%s", cache_file);
+
+    if (!file_exists(cache_path)) {
+        make_dir(PATH_PREFIX SHADER_CACHE_DIR);
+
+        char command[2048];
+        i32 size = snprintf(command, sizeof(command), "glslc");
+        const char* define = defines;
+        while (*define) {
+            if (*define == ' ') {
+                define++;
+                continue;
+            }
+            i32 define_len = strcspn(define, " ");
+            size += snprintf(command + size, sizeof(command) - size, " -D%.*s",
+                             define_len, define);
+            define += define_len;
+        }
+        // Every worker compiles into its own file, the same shader may be
+        // compiled by several of them at once
+        char tmp_path[1024];
+        snprintf(tmp_path, sizeof(tmp_path), "%s.%u.tmp", cache_path, get_worker_index());
+        snprintf(command + size, sizeof(command) - size, " \"" PATH_PREFIX "%s\" -o \"%s\"",
+                 source, tmp_path);
+
+        printf("Compiling shader: %s %s\n", source, defines);
+        if (system(command) != 0) {
+            printf("Failed to compile shader: %s\n", source);
+            remove(tmp_path);
+            return NULL;
+        }
+        if (rename(tmp_path, cache_path) != 0) {
+            // Another worker was faster
+            remove(tmp_path);
+        }
+    }
+
+    return read_file(cache_file, len, NULL);
+}
+
+u64 get_shader_time(const char* source)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), PATH_PREFIX "%s", source);
+    struct stat info;
+    if (stat(path, &info) != 0) {
+        return 0;
+    }
+    return (u64) info.st_mtime;
+}
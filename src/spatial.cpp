@@ -0,0 +1,578 @@
+#include "include/spatial.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <float.h>
+#include <chrono>
+
+#include <glm/geometric.hpp>
+#include <glm/matrix.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#define OVERFLOW_CELL(grid) ((grid)->dim_x * (grid)->dim_y)
+
+void init_grid(SpatialGrid* grid, glm::vec2 min, glm::vec2 max, float cell_size, u32 capacity)
+{
+    grid->origin = min;
+    grid->cell_size = cell_size;
+    grid->dim_x = (u32) ceilf((max.x - min.x) / cell_size);
+    grid->dim_y = (u32) ceilf((max.y - min.y) / cell_size);
+    if (grid->dim_x == 0)
+        grid->dim_x = 1;
+    if (grid->dim_y == 0)
+        grid->dim_y = 1;
+
+    grid->max_extent = 0;
+    grid->min_z = FLT_MAX;
+    grid->max_z = -FLT_MAX;
+
+    u32 cell_count = grid->dim_x * grid->dim_y + 1;
+    grid->cells = (i32*) malloc(sizeof(i32) * cell_count);
+    for (u32 i = 0; i < cell_count; ++i) {
+        grid->cells[i] = -1;
+    }
+
+    grid->entries = (SpatialEntry*) malloc(sizeof(SpatialEntry) * capacity);
+    for (u32 i = 0; i < capacity; ++i) {
+        grid->entries[i] = {};
+        grid->entries[i].cell = -1;
+    }
+    grid->capacity = capacity;
+    grid->stamp = 0;
+}
+
+void dispose_grid(SpatialGrid* grid)
+{
+    free(grid->cells);
+    free(grid->entries);
+    grid->cells = NULL;
+    grid->entries = NULL;
+    grid->capacity = 0;
+}
+
+i32 get_cell(SpatialGrid* grid, Bounds* bounds)
+{
+    glm::vec3 center = (bounds->min + bounds->max) * 0.5f;
+    float x = floorf((center.x - grid->origin.x) / grid->cell_size);
+    float y = floorf((center.y - grid->origin.y) / grid->cell_size);
+    if (x < 0 || y < 0 || x >= grid->dim_x || y >= grid->dim_y) {
+        return OVERFLOW_CELL(grid);
+    }
+    return (i32) y * grid->dim_x + (i32) x;
+}
+
+void link_entry(SpatialGrid* grid, u32 id, i32 cell)
+{
+    SpatialEntry* entry = grid->entries + id;
+    entry->cell = cell;
+    entry->prev = -1;
+    entry->next = grid->cells[cell];
+    if (entry->next >= 0) {
+        grid->entries[entry->next].prev = id;
+    }
+    grid->cells[cell] = id;
+}
+
+void unlink_entry(SpatialGrid* grid, u32 id)
+{
+    SpatialEntry* entry = grid->entries + id;
+    if (entry->prev >= 0) {
+        grid->entries[entry->prev].next = entry->next;
+    } else {
+        grid->cells[entry->cell] = entry->next;
+    }
+    if (entry->next >= 0) {
+        grid->entries[entry->next].prev = entry->prev;
+    }
+    entry->cell = -1;
+}
+
+// The grid never shrinks these, so queries stay conservative after refits
+void grow_extents(SpatialGrid* grid, Bounds* bounds)
+{
+    glm::vec3 half = (bounds->max - bounds->min) * 0.5f;
+    grid->max_extent = fmaxf(grid->max_extent, fmaxf(half.x, half.y));
+    grid->min_z = fminf(grid->min_z, bounds->min.z);
+    grid->max_z = fmaxf(grid->max_z, bounds->max.z);
+}
+
+void grid_insert(SpatialGrid* grid, u32 id, Bounds bounds)
+{
+    assert(id < grid->capacity);
+    assert(grid->entries[id].cell < 0);
+    grid->entries[id].bounds = bounds;
+    grow_extents(grid, &bounds);
+    link_entry(grid, id, get_cell(grid, &bounds));
+}
+
+void grid_remove(SpatialGrid* grid, u32 id)
+{
+    assert(id < grid->capacity);
+    assert(grid->entries[id].cell >= 0);
+    unlink_entry(grid, id);
+}
+
+void grid_update(SpatialGrid* grid, u32 id, Bounds bounds)
+{
+    assert(id < grid->capacity);
+    SpatialEntry* entry = grid->entries + id;
+    assert(entry->cell >= 0);
+    entry->bounds = bounds;
+    grow_extents(grid, &bounds);
+    i32 cell = get_cell(grid, &bounds);
+    if (cell != entry->cell) {
+        unlink_entry(grid, id);
+        link_entry(grid, id, cell);
+    }
+}
+
+// Cell range that can contain entries overlapping [min, max].
+// Returns false if no cell of the grid can.
+bool get_cell_range(SpatialGrid* grid, glm::vec2 min, glm::vec2 max, i32* range)
+{
+    float e = grid->max_extent;
+    float x0 = floorf((min.x - e - grid->origin.x) / grid->cell_size);
+    float y0 = floorf((min.y - e - grid->origin.y) / grid->cell_size);
+    float x1 = floorf((max.x + e - grid->origin.x) / grid->cell_size);
+    float y1 = floorf((max.y + e - grid->origin.y) / grid->cell_size);
+    if (x1 < 0 || y1 < 0 || x0 >= grid->dim_x || y0 >= grid->dim_y) {
+        return false;
+    }
+    range[0] = x0 < 0? 0 : (i32) x0;
+    range[1] = y0 < 0? 0 : (i32) y0;
+    range[2] = x1 >= grid->dim_x? grid->dim_x - 1 : (i32) x1;
+    range[3] = y1 >= grid->dim_y? grid->dim_y - 1 : (i32) y1;
+    return true;
+}
+
+// Loose bounds of a cell, i.e. the volume its entries can occupy
+Bounds get_cell_bounds(SpatialGrid* grid, i32 x, i32 y)
+{
+    float e = grid->max_extent;
+    Bounds bounds;
+    bounds.min.x = grid->origin.x + x * grid->cell_size - e;
+    bounds.min.y = grid->origin.y + y * grid->cell_size - e;
+    bounds.min.z = grid->min_z;
+    bounds.max.x = grid->origin.x + (x + 1) * grid->cell_size + e;
+    bounds.max.y = grid->origin.y + (y + 1) * grid->cell_size + e;
+    bounds.max.z = grid->max_z;
+    return bounds;
+}
+
+u32 gather_frustum(SpatialGrid* grid, i32 id, Frustum* frustum, u32* result, u32 count, u32 max_results)
+{
+    while (id >= 0 && count < max_results) {
+        SpatialEntry* entry = grid->entries + id;
+        if (frustum_intersects(frustum, &entry->bounds)) {
+            result[count++] = id;
+        }
+        id = entry->next;
+    }
+    return count;
+}
+
+u32 grid_query_frustum(SpatialGrid* grid, Frustum* frustum, u32* result, u32 max_results)
+{
+    u32 count = 0;
+    i32 range[4];
+    glm::vec2 min = glm::vec2(frustum->bounds.min);
+    glm::vec2 max = glm::vec2(frustum->bounds.max);
+    if (get_cell_range(grid, min, max, range)) {
+        for (i32 y = range[1]; y <= range[3]; ++y) {
+            for (i32 x = range[0]; x <= range[2]; ++x) {
+                i32 head = grid->cells[y * grid->dim_x + x];
+                if (head < 0)
+                    continue;
+                Bounds cell_bounds = get_cell_bounds(grid, x, y);
+                if (!frustum_intersects(frustum, &cell_bounds))
+                    continue;
+                count = gather_frustum(grid, head, frustum, result, count, max_results);
+            }
+        }
+    }
+    return gather_frustum(grid, grid->cells[OVERFLOW_CELL(grid)], frustum,
+                          result, count, max_results);
+}
+
+u32 gather_radius(SpatialGrid* grid,
+                  i32 id,
+                  glm::vec3 center,
+                  float radius,
+                  u32* result,
+                  u32 count,
+                  u32 max_results)
+{
+    while (id >= 0 && count < max_results) {
+        SpatialEntry* entry = grid->entries + id;
+        if (sphere_intersects(&entry->bounds, center, radius)) {
+            result[count++] = id;
+        }
+        id = entry->next;
+    }
+    return count;
+}
+
+u32 grid_query_radius(SpatialGrid* grid,
+                      glm::vec3 center,
+                      float radius,
+                      u32* result,
+                      u32 max_results)
+{
+    u32 count = 0;
+    i32 range[4];
+    glm::vec2 min = glm::vec2(center) - radius;
+    glm::vec2 max = glm::vec2(center) + radius;
+    if (get_cell_range(grid, min, max, range)) {
+        for (i32 y = range[1]; y <= range[3]; ++y) {
+            for (i32 x = range[0]; x <= range[2]; ++x) {
+                i32 head = grid->cells[y * grid->dim_x + x];
+                count = gather_radius(grid, head, center, radius, result, count, max_results);
+            }
+        }
+    }
+    return gather_radius(grid, grid->cells[OVERFLOW_CELL(grid)], center, radius,
+                         result, count, max_results);
+}
+
+void raycast_cell(SpatialGrid* grid,
+                  i32 id,
+                  glm::vec3 origin,
+                  glm::vec3 inv_dir,
+                  i32* best,
+                  float* best_t)
+{
+    while (id >= 0) {
+        SpatialEntry* entry = grid->entries + id;
+        float t;
+        if (entry->stamp != grid->stamp &&
+            ray_intersects(&entry->bounds, origin, inv_dir, *best_t, &t)) {
+            *best = id;
+            *best_t = t;
+        }
+        entry->stamp = grid->stamp;
+        id = entry->next;
+    }
+}
+
+i32 grid_raycast(SpatialGrid* grid, glm::vec3 origin, glm::vec3 dir, float max_t, float* t)
+{
+    grid->stamp++;
+    glm::vec3 inv_dir = 1.0f / dir;
+    i32 best = -1;
+    float best_t = max_t;
+    raycast_cell(grid, grid->cells[OVERFLOW_CELL(grid)], origin, inv_dir, &best, &best_t);
+
+    // Clip the ray against the grid, widened by the loose extent
+    float e = grid->max_extent;
+    float size = grid->cell_size;
+    glm::vec3 lo = glm::vec3(grid->origin - e, grid->min_z);
+    glm::vec3 hi = glm::vec3(grid->origin + glm::vec2(grid->dim_x, grid->dim_y) * size + e,
+                             grid->max_z);
+    float t0 = 0;
+    float t1 = max_t;
+    for (u32 axis = 0; axis < 3; ++axis) {
+        if (dir[axis] == 0) {
+            if (origin[axis] < lo[axis] || origin[axis] > hi[axis]) {
+                t1 = -1;
+            }
+            continue;
+        }
+        float ta = (lo[axis] - origin[axis]) * inv_dir[axis];
+        float tb = (hi[axis] - origin[axis]) * inv_dir[axis];
+        t0 = fmaxf(t0, fminf(ta, tb));
+        t1 = fminf(t1, fmaxf(ta, tb));
+    }
+
+    if (t0 <= t1) {
+        // Amanatides & Woo over the (virtual, unbounded) cells along the ray.
+        // An entry hit at t has its center at most ring cells away from the
+        // cell containing the ray at t, so we can stop once a cell is entered
+        // after the best hit.
+        glm::vec3 start = origin + dir * t0;
+        i32 cx = (i32) floorf((start.x - grid->origin.x) / size);
+        i32 cy = (i32) floorf((start.y - grid->origin.y) / size);
+        i32 step_x = dir.x > 0? 1 : -1;
+        i32 step_y = dir.y > 0? 1 : -1;
+        float next_x = FLT_MAX;
+        float next_y = FLT_MAX;
+        float delta_x = FLT_MAX;
+        float delta_y = FLT_MAX;
+        if (dir.x != 0) {
+            float boundary = grid->origin.x + (cx + (step_x > 0)) * size;
+            next_x = (boundary - origin.x) * inv_dir.x;
+            delta_x = size * fabsf(inv_dir.x);
+        }
+        if (dir.y != 0) {
+            float boundary = grid->origin.y + (cy + (step_y > 0)) * size;
+            next_y = (boundary - origin.y) * inv_dir.y;
+            delta_y = size * fabsf(inv_dir.y);
+        }
+
+        i32 ring = (i32) ceilf(e / size);
+        float t_enter = t0;
+        while (t_enter <= t1 && t_enter <= best_t) {
+            for (i32 y = cy - ring; y <= cy + ring; ++y) {
+                if (y < 0 || y >= (i32) grid->dim_y)
+                    continue;
+                for (i32 x = cx - ring; x <= cx + ring; ++x) {
+                    if (x < 0 || x >= (i32) grid->dim_x)
+                        continue;
+                    raycast_cell(grid, grid->cells[y * grid->dim_x + x],
+                                 origin, inv_dir, &best, &best_t);
+                }
+            }
+            if (next_x < next_y) {
+                t_enter = next_x;
+                next_x += delta_x;
+                cx += step_x;
+            } else {
+                t_enter = next_y;
+                next_y += delta_y;
+                cy += step_y;
+            }
+        }
+    }
+
+    if (best >= 0) {
+        *t = best_t;
+    }
+    return best;
+}
+
+Frustum frustum_from_matrix(glm::mat4 proj_view)
+{
+    // Gribb & Hartmann, depth range is [0, 1] (GLM_FORCE_DEPTH_ZERO_TO_ONE)
+    glm::vec4 rows[4];
+    for (u32 i = 0; i < 4; ++i) {
+        rows[i] = glm::vec4(proj_view[0][i], proj_view[1][i], proj_view[2][i], proj_view[3][i]);
+    }
+    Frustum frustum;
+    frustum.planes[0] = rows[3] + rows[0];
+    frustum.planes[1] = rows[3] - rows[0];
+    frustum.planes[2] = rows[3] + rows[1];
+    frustum.planes[3] = rows[3] - rows[1];
+    frustum.planes[4] = rows[2];
+    frustum.planes[5] = rows[3] - rows[2];
+    for (u32 i = 0; i < 6; ++i) {
+        frustum.planes[i] /= glm::length(glm::vec3(frustum.planes[i]));
+    }
+
+    glm::mat4 inv = glm::inverse(proj_view);
+    frustum.bounds.min = glm::vec3(FLT_MAX);
+    frustum.bounds.max = glm::vec3(-FLT_MAX);
+    for (u32 i = 0; i < 8; ++i) {
+        glm::vec4 corner = glm::vec4(i & 1? 1 : -1, i & 2? 1 : -1, i & 4? 1 : 0, 1);
+        corner = inv * corner;
+        glm::vec3 p = glm::vec3(corner) / corner.w;
+        frustum.bounds.min = glm::min(frustum.bounds.min, p);
+        frustum.bounds.max = glm::max(frustum.bounds.max, p);
+    }
+    return frustum;
+}
+
+Bounds transform_bounds(Bounds bounds, glm::mat4* transform)
+{
+    // Arvo: project the half extents onto the transformed axes
+    glm::mat4 m = *transform;
+    glm::vec3 center = (bounds.min + bounds.max) * 0.5f;
+    glm::vec3 half = (bounds.max - bounds.min) * 0.5f;
+    glm::vec3 new_center = glm::vec3(m * glm::vec4(center, 1.0f));
+    glm::vec3 new_half;
+    for (u32 i = 0; i < 3; ++i) {
+        new_half[i] = fabsf(m[0][i]) * half.x + fabsf(m[1][i]) * half.y + fabsf(m[2][i]) * half.z;
+    }
+    Bounds result;
+    result.min = new_center - new_half;
+    result.max = new_center + new_half;
+    return result;
+}
+
+bool frustum_intersects(Frustum* frustum, Bounds* bounds)
+{
+    for (u32 i = 0; i < 6; ++i) {
+        glm::vec4 plane = frustum->planes[i];
+        glm::vec3 p;
+        p.x = plane.x > 0? bounds->max.x : bounds->min.x;
+        p.y = plane.y > 0? bounds->max.y : bounds->min.y;
+        p.z = plane.z > 0? bounds->max.z : bounds->min.z;
+        if (glm::dot(glm::vec3(plane), p) + plane.w < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool sphere_intersects(Bounds* bounds, glm::vec3 center, float radius)
+{
+    glm::vec3 closest = glm::clamp(center, bounds->min, bounds->max);
+    glm::vec3 d = closest - center;
+    return glm::dot(d, d) <= radius * radius;
+}
+
+bool ray_intersects(Bounds* bounds, glm::vec3 origin, glm::vec3 inv_dir, float max_t, float* t)
+{
+    float t_near = 0;
+    float t_far = max_t;
+    for (u32 axis = 0; axis < 3; ++axis) {
+        // A ray parallel to the slab would compute 0 * inf = NaN on its planes
+        if (isinf(inv_dir[axis])) {
+            if (origin[axis] < bounds->min[axis] || origin[axis] > bounds->max[axis]) {
+                return false;
+            }
+            continue;
+        }
+        float ta = (bounds->min[axis] - origin[axis]) * inv_dir[axis];
+        float tb = (bounds->max[axis] - origin[axis]) * inv_dir[axis];
+        t_near = fmaxf(t_near, fminf(ta, tb));
+        t_far = fminf(t_far, fmaxf(ta, tb));
+    }
+    if (t_near > t_far) {
+        return false;
+    }
+    *t = t_near;
+    return true;
+}
+
+
+// Benchmark
+
+#define BENCH_QUERIES 100
+#define BENCH_CELL_SIZE 4.0f
+
+typedef std::chrono::high_resolution_clock BenchClock;
+
+double elapsed_ms(BenchClock::time_point start)
+{
+    std::chrono::duration<double, std::milli> d = BenchClock::now() - start;
+    return d.count();
+}
+
+float random_float(float lo, float hi)
+{
+    return lo + (hi - lo) * ((float) rand() / (float) RAND_MAX);
+}
+
+void bench_spatial()
+{
+    u32 sizes[] = { 1000, 10000, 100000, 1000000 };
+    printf("%10s | %21s | %21s | %21s | %10s\n",
+           "actors", "frustum grid/brute", "radius grid/brute", "ray grid/brute", "refit");
+
+    for (u32 s = 0; s < 4; ++s) {
+        u32 n = sizes[s];
+        srand(n);
+
+        // Density stays constant, roughly one piece every 16 square units
+        float side = sqrtf((float) n) * 4.0f;
+        Bounds* bounds = (Bounds*) malloc(sizeof(Bounds) * n);
+        for (u32 i = 0; i < n; ++i) {
+            glm::vec3 center = glm::vec3(random_float(0, side), random_float(0, side), 1);
+            glm::vec3 half = glm::vec3(random_float(0.25f, 1.0f));
+            bounds[i].min = center - half;
+            bounds[i].max = center + half;
+        }
+        u32* result = (u32*) malloc(sizeof(u32) * n);
+
+        SpatialGrid grid;
+        init_grid(&grid, glm::vec2(0), glm::vec2(side), BENCH_CELL_SIZE, n);
+        for (u32 i = 0; i < n; ++i) {
+            grid_insert(&grid, i, bounds[i]);
+        }
+
+        // Strategy camera looking down onto the middle of the board
+        glm::vec3 target = glm::vec3(side / 2, side / 2, 0);
+        glm::mat4 proj = glm::perspective(glm::radians(45.0f), 16.0f / 9.0f, 0.1f, 200.0f);
+        glm::mat4 view = glm::lookAt(target + glm::vec3(0, -40, 60), target, glm::vec3(0, 0, 1));
+        Frustum frustum = frustum_from_matrix(proj * view);
+
+        BenchClock::time_point start = BenchClock::now();
+        u32 grid_hits = grid_query_frustum(&grid, &frustum, result, n);
+        double frustum_grid = elapsed_ms(start);
+        start = BenchClock::now();
+        u32 brute_hits = 0;
+        for (u32 i = 0; i < n; ++i) {
+            if (frustum_intersects(&frustum, bounds + i))
+                result[brute_hits++] = i;
+        }
+        double frustum_brute = elapsed_ms(start);
+        if (grid_hits != brute_hits) {
+            printf("Frustum query mismatch: %u vs %u\n", grid_hits, brute_hits);
+        }
+
+        glm::vec3 points[BENCH_QUERIES];
+        glm::vec3 dirs[BENCH_QUERIES];
+        for (u32 i = 0; i < BENCH_QUERIES; ++i) {
+            points[i] = glm::vec3(random_float(0, side), random_float(0, side), 1);
+            glm::vec3 eye = points[i] + glm::vec3(random_float(-30, 30), random_float(-30, 30), 40);
+            dirs[i] = glm::normalize(points[i] - eye);
+            points[i] = eye;
+        }
+
+        start = BenchClock::now();
+        grid_hits = 0;
+        for (u32 i = 0; i < BENCH_QUERIES; ++i) {
+            glm::vec3 center = points[i] + dirs[i] * 40.0f;
+            grid_hits += grid_query_radius(&grid, center, 10, result, n);
+        }
+        double radius_grid = elapsed_ms(start);
+        start = BenchClock::now();
+        brute_hits = 0;
+        for (u32 i = 0; i < BENCH_QUERIES; ++i) {
+            glm::vec3 center = points[i] + dirs[i] * 40.0f;
+            for (u32 j = 0; j < n; ++j) {
+                brute_hits += sphere_intersects(bounds + j, center, 10);
+            }
+        }
+        double radius_brute = elapsed_ms(start);
+        if (grid_hits != brute_hits) {
+            printf("Radius query mismatch: %u vs %u\n", grid_hits, brute_hits);
+        }
+
+        start = BenchClock::now();
+        u32 grid_rays = 0;
+        for (u32 i = 0; i < BENCH_QUERIES; ++i) {
+            float t;
+            grid_rays += grid_raycast(&grid, points[i], dirs[i], 1000, &t) >= 0;
+        }
+        double ray_grid = elapsed_ms(start);
+        start = BenchClock::now();
+        u32 brute_rays = 0;
+        for (u32 i = 0; i < BENCH_QUERIES; ++i) {
+            glm::vec3 inv_dir = 1.0f / dirs[i];
+            float best_t = 1000;
+            i32 best = -1;
+            for (u32 j = 0; j < n; ++j) {
+                float t;
+                if (ray_intersects(bounds + j, points[i], inv_dir, best_t, &t)) {
+                    best = j;
+                    best_t = t;
+                }
+            }
+            brute_rays += best >= 0;
+        }
+        double ray_brute = elapsed_ms(start);
+        if (grid_rays != brute_rays) {
+            printf("Raycast mismatch: %u vs %u\n", grid_rays, brute_rays);
+        }
+
+        // Every tenth piece moves one step
+        start = BenchClock::now();
+        for (u32 i = 0; i < n; i += 10) {
+            glm::vec3 step = glm::vec3(random_float(-2, 2), random_float(-2, 2), 0);
+            bounds[i].min += step;
+            bounds[i].max += step;
+            grid_update(&grid, i, bounds[i]);
+        }
+        double refit = elapsed_ms(start);
+
+        printf("%10u | %8.3f / %8.3f ms | %8.3f / %8.3f ms | %8.3f / %8.3f ms | %7.3f ms\n",
+               n, frustum_grid, frustum_brute, radius_grid, radius_brute,
+               ray_grid, ray_brute, refit);
+
+        dispose_grid(&grid);
+        free(result);
+        free(bounds);
+    }
+}
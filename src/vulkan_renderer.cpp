@@ -8,6 +8,10 @@
 #include "include/loading.h"
 #include "include/game_math.h"
 #include "include/render_queue.h"
+#include "include/spatial.h"
+#include "include/jobs.h"
+#include "include/gpu_memory.h"
+#include "include/shader_cache.h"
 
 #include <math.h>
 #include <limits.h>
@@ -16,15 +20,86 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <vector>
+#include <atomic>
 
 #define QUEUE_FAMILY_GRAPHICS 1 << 0
 #define QUEUE_FAMILY_PRESENT 1 << 1
 
 #define UNIFORM_TYPES 4
-#define UNIFORM_BUF_GLOBAL 1
-#define UNIFORM_BUF_MATERIAL 5
-#define UNIFORM_BUF_OBJECT 10
-#define UNIFORM_BUF_BONE 20
+// Per mapped allocation, more dirty regions get merged into one
+#define MAX_FLUSH_RANGES 8
+// Mappable coherent memory is guaranteed for buffers, flushes are only
+// needed if this drops HOST_COHERENT
+#define UNIFORM_MEMORY_PROPERTIES \
+    (VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)
+
+// Room in each stream partition besides the global uniform, instances and
+// bones
+#define STREAM_TRANSIENT_SIZE (4 * 1024 * 1024)
+
+// Staging memory of an upload batch is allocated in chunks of this size
+#define STAGING_CHUNK_SIZE (16 * 1024 * 1024)
+#define MAX_STAGING_CHUNKS 8
+#define MAX_UPLOAD_BATCHES 4
+
+// Seconds between checking the shader sources for changes
+#define SHADER_POLL_INTERVAL 0.5
+
+#define PIPELINE_CACHE_FILE "pipeline_cache.bin"
+#define PIPELINE_CACHE_MAGIC 0x50434348
+
+// Has to match local_size_x in cull.comp
+#define CULL_GROUP_SIZE 64
+
+// Lights are binned into clusters: screen tiles, each split into slices
+// of exponentially growing view depth
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+#define CLUSTER_COUNT (CLUSTER_X * CLUSTER_Y * CLUSTER_Z)
+// Further lights touching a cluster are dropped
+#define MAX_CLUSTER_LIGHTS 127
+// A count followed by the light indices
+#define CLUSTER_STRIDE (MAX_CLUSTER_LIGHTS + 1)
+// Has to match local_size_x in cluster.comp
+#define CLUSTER_GROUP_SIZE 64
+
+// The cascades split the first SHADOW_DISTANCE of the view, blending
+// logarithmic and uniform split depths by SHADOW_SPLIT_LAMBDA
+#define SHADOW_MAP_SIZE 2048
+#define SHADOW_DISTANCE 80.0f
+#define SHADOW_SPLIT_LAMBDA 0.75f
+// Casters this far towards the sun from a cascade still land in its map
+#define SHADOW_CASTER_DISTANCE 50.0f
+#define SHADOW_VERTEX_SHADER "shader/shadow.vert"
+// An instance is uploaded once per message, for the view and every
+// cascade it is drawn into. cull.comp copies the visible ones of the view
+// once more behind them
+#define INSTANCE_COPIES (2 + SHADOW_CASCADES)
+#define CULL_SHADER "shader/cull.comp"
+#define CLUSTER_SHADER "shader/cluster.comp"
+
+#define FULLSCREEN_VERTEX_SHADER "shader/fullscreen.vert"
+#define TAA_SHADER "shader/taa.frag"
+// Length of the jitter sequence
+#define TAA_SAMPLES 16
+// Of the current frame in the resolve, the rest comes from the history
+#define TAA_CURRENT_WEIGHT 0.1f
+
+// Dynamic resolution keeps the gpu time of the shadow and main passes
+// near the target by scaling the render area of the main pass between the
+// min scale and 1
+#define TARGET_FRAME_MS 16.6f
+// The controller aims a bit below the target, the measured time lags two
+// frames behind
+#define FRAME_BUDGET 0.9f
+#define RENDER_SCALE_MIN 0.5f
+// Share of the correction applied per frame
+#define RENDER_SCALE_RATE 0.1f
+
+#define MAX_RECORD_THREADS 8
+// Fewer batches than this per chunk get recorded inline
+#define RECORD_BATCHES_PER_THREAD 64
 
 const i32 max_frames_in_flight = 2;
 
@@ -44,31 +119,82 @@ const bool enable_validation_layers = false;
 #endif
 
 
+// std140, has to match the shaders
 struct GlobalUniform
 {
     glm::mat4 proj_view;
     glm::vec3 camera_pos;
-    glm::vec2 screen_size;
-    i32 jitter_index;
+    alignas(8) glm::vec2 screen_size;
+    // subpixel offset of proj_view in ndc, see TAA_SAMPLES
+    glm::vec2 jitter;
+    alignas(16) glm::mat4 view;
+    glm::mat4 inv_proj;
+    // x => near, y => far, z and w => scale and bias from log(depth) to slice
+    glm::vec4 cluster_depth;
+    // xyz => clusters per axis, w => CLUSTER_STRIDE
+    glm::uvec4 cluster_grid;
+    // world => shadow map of each cascade
+    glm::mat4 shadow_matrices[SHADOW_CASCADES];
+    // view depth where each cascade ends, room for up to 4
+    glm::vec4 cascade_splits;
+    // xyz => towards the sun
+    glm::vec4 sun_direction;
 };
 
+// std430 array element, has to match pbr.frag and cluster.comp
+struct LightData
+{
+    // xyz => position, w => range
+    glm::vec4 position;
+    // rgb => color, w => LightType
+    glm::vec4 color;
+    // xyz => direction, w => cos of the outer cone
+    glm::vec4 direction;
+    // x => cos of the inner cone
+    glm::vec4 params;
+};
+
+// std140 array element, has to match pbr.frag
 struct MaterialUniform
 {
     float roughness;
     float smoothness;
-    glm::vec3 specular;
-    glm::vec3 diffuse;
+    alignas(16) glm::vec3 specular;
+    alignas(16) glm::vec3 diffuse;
 };
 
-struct ObjectUniform
+// std430 array element, has to match the vertex shaders and cull.comp
+struct InstanceData
 {
     glm::mat4 model;
     glm::mat4 prev_mvp;
+    // world space bounding sphere. xyz => center, w => radius
+    glm::vec4 bounds;
+    u32 material;
+    u32 bone_offset;
+    u32 index_count;
+    u32 first_index;
+    i32 vertex_offset;
+    u32 pipeline;
+    // Pose of the last frame, for the velocity of skinned vertices
+    u32 prev_bone_offset;
+    // gpu driven: draw command of the batch, see upload_instances
+    u32 command;
 };
 
-struct PushConstants
+struct TaaConstants
 {
-    u32 bone_offset;
+    float current_weight;
+    // VkBool32, discards the history
+    u32 reset;
+    // render_extent / swap_chain_extent
+    glm::vec2 render_scale;
+};
+
+struct CullConstants
+{
+    glm::vec4 planes[6];
+    u32 instance_count;
 };
 
 struct QueueFamilyIndices
@@ -76,6 +202,8 @@ struct QueueFamilyIndices
     u32 flags;
     u32 graphics;
     u32 present;
+    // A transfer only family if there is one, graphics otherwise
+    u32 transfer;
 };
 
 struct SwapChainSupportDetails 
@@ -100,64 +228,343 @@ VkDevice device;
 VkPhysicalDevice physical_device;
 VkQueue graphics_queue;
 VkQueue present_queue;
+VkQueue transfer_queue;
 VkRenderPass render_pass;
 VkCommandPool command_pool;
 std::vector<VkCommandBuffer> command_buffers;
+// The taa pass writes the swap chain image. It is submitted as a batch of
+// its own, only it waits for the image to be acquired
+std::vector<VkCommandBuffer> taa_command_buffers;
 std::vector<VkSemaphore> image_available_semaphores;
 std::vector<VkSemaphore> render_finished_semaphores;
 std::vector<VkFence> in_flight_fences;
 u8 frame_buffer_resized;
+// Set through set_framebuffer_size, the window may belong to another thread
+i32 framebuffer_width;
+i32 framebuffer_height;
 VkDescriptorPool descriptor_pool;
 u32 current_frame;
 VkImage depth_image;
-VkDeviceMemory depth_image_memory;
+GpuAllocation depth_image_memory;
 VkImageView depth_image_view;
 VkImage texture_image;
-VkDeviceMemory texture_image_memory;
+GpuAllocation texture_image_memory;
 VkImageView texture_image_view;
 VkSampler texture_sampler;
 
-// 0 => global, 1 => material, 2 => object
-u32 dynamic_align[3];
+// Byte offsets of this frames regions in the stream buffer, bound as
+// dynamic offsets
+u32 global_offset;
+u32 instance_offset;
+u32 bone_offset;
+u32 light_offset;
+// Draw command of every batch of the view, copied into the indirect buffer
+u32 command_offset;
 u32 bone_stride;
 u32 non_coherent_atom_size;
-u32 object_offset;
-u32 bone_offset;
-u32 material_offset;
-
-u32 uniform_object_alloc;
-u32 uniform_bone_alloc;
+u32 uniform_alignment;
+u32 storage_alignment;
+
+// All per frame data goes through one persistently mapped buffer, split
+// into a partition per frame in flight. A partition is reused once the
+// fence of its frame signaled
+VkBuffer stream_buffer;
+GpuAllocation stream_buffer_memory;
+u8* stream_mapped;
+u32 stream_partition_size;
+std::atomic<u32> stream_head;
+u32 stream_end;
+
+// Bumped from the jobs filling the render queue
+std::atomic<u32> uniform_instance_alloc;
+std::atomic<u32> uniform_bone_alloc;
+std::atomic<u32> light_alloc;
+
+// Dirty regions of a mapped allocation, sorted and merged as they are
+// added. Nothing is tracked for coherent memory
+struct FlushRanges
+{
+    VkDeviceMemory memory;
+    // of the allocation in memory, added to every range
+    VkDeviceSize offset;
+    bool coherent;
+    VkDeviceSize begin[MAX_FLUSH_RANGES];
+    VkDeviceSize end[MAX_FLUSH_RANGES];
+    u32 count;
+};
 
-u32 range_count = 0;
-VkMappedMemoryRange ranges[UNIFORM_BUF_OBJECT + UNIFORM_BUF_MATERIAL + 2];
+FlushRanges stream_flush;
+FlushRanges material_flush;
+RenderLimits limits;
 VkDescriptorSet descriptor_sets[max_frames_in_flight * UNIFORM_TYPES];
 VkDescriptorSetLayout descriptor_set_layouts[UNIFORM_TYPES];
-std::vector<VkBuffer> uniform_buffers;
-std::vector<VkDeviceMemory> uniform_buffers_memory;
-std::vector<void*> uniform_buffers_mapped;
 
 // render targets
 VkImage render_images[max_frames_in_flight];
 VkImageView render_image_views[max_frames_in_flight];
-VkDeviceMemory render_image_memory[max_frames_in_flight];
+GpuAllocation render_image_memory[max_frames_in_flight];
 VkFormat render_image_format = VK_FORMAT_R8G8B8A8_UNORM;
 VkFramebuffer framebuffers[max_frames_in_flight];
 
+// depth prepass
+// Subpass 0 only writes the depth of everything opaque, nearest batches
+// first. Subpass 1 shades with an EQUAL test, so pbr.frag runs once per
+// pixel. Without the prepass subpass 0 stays empty and subpass 1 tests LESS
+#define SUBPASS_DEPTH 0
+#define SUBPASS_COLOR 1
+// Static meshes are drawn from a position only copy of their vertices
+#define DEPTH_VERTEX_SHADER "shader/depth.vert"
+// What a pipeline is created and bound for
+enum DrawPass
+{
+    // depth prepass, static meshes read the position stream
+    DRAW_DEPTH,
+    DRAW_COLOR,
+    // a shadow cascade, static meshes read the position stream
+    DRAW_SHADOW,
+};
+bool depth_prepass = true;
+// Toggled from the main thread, applied in start_frame
+std::atomic<bool> depth_prepass_requested{true};
+VkBuffer position_buffer;
+GpuAllocation position_buffer_memory;
+
+// overdraw measurement
+// Counts the fragment shader invocations of the color subpass per frame in
+// flight. Read back once the fence of the frame passed
+bool overdraw_supported;
+std::atomic<bool> overdraw_enabled;
+VkQueryPool overdraw_queries;
+bool overdraw_written[max_frames_in_flight];
+// Invocations per pixel of the last frame that finished, 0 => not measured
+float overdraw;
+
+// shadows
+// The sun renders one layer of shadow_image per cascade before the main
+// pass, from the shadow queues. pbr.frag picks the cascade by view depth
+VkFormat shadow_format;
+VkImage shadow_image;
+GpuAllocation shadow_image_memory;
+VkImageView shadow_layer_views[SHADOW_CASCADES];
+VkImageView shadow_array_view;
+VkSampler shadow_sampler;
+VkRenderPass shadow_render_pass;
+VkFramebuffer shadow_framebuffers[SHADOW_CASCADES];
+Frustum shadow_frustums[SHADOW_CASCADES];
+// Timestamps before and after each cascade per frame in flight, read back
+// once the fence of the frame passed
+bool timing_supported;
+float timestamp_period;
+VkQueryPool shadow_queries;
+bool shadow_timing_written[max_frames_in_flight];
+float shadow_ms[SHADOW_CASCADES];
+
+// dynamic resolution
+// Timestamps before the shadow pass and after the main pass of every frame
+// in flight. 0 ms => not measured yet
+VkQueryPool frame_queries;
+bool frame_timing_written[max_frames_in_flight];
+float gpu_frame_ms;
+// Toggled from the main thread. Off => renders at the full size
+std::atomic<bool> dynamic_resolution{true};
+float render_scale = 1.0f;
+// The color and depth pass render into this corner of the render images,
+// the taa resolve upscales it to swap_chain_extent
+VkExtent2D render_extent;
+
+// temporal anti aliasing
+// The color pass renders with a subpixel jitter that changes every frame
+// and writes the screen space motion of every pixel into the velocity
+// image. The resolve pass blends the reprojected history into the current
+// frame, clamped to the colors around the pixel, and writes the result
+// into history_images[current_frame], the history of the next frame, and
+// into the swap chain image
+VkFormat velocity_format = VK_FORMAT_R16G16_SFLOAT;
+VkImage velocity_images[max_frames_in_flight];
+VkImageView velocity_image_views[max_frames_in_flight];
+GpuAllocation velocity_image_memory[max_frames_in_flight];
+VkImage history_images[max_frames_in_flight];
+VkImageView history_image_views[max_frames_in_flight];
+GpuAllocation history_image_memory[max_frames_in_flight];
+VkRenderPass taa_render_pass;
+// History of the frame in flight and swap chain image, indexed by
+// current_frame * swap chain image count + image_index
+std::vector<VkFramebuffer> taa_framebuffers;
+VkDescriptorSetLayout taa_set_layout;
+VkDescriptorSet taa_descriptor_sets[max_frames_in_flight];
+VkPipelineLayout taa_pipeline_layout;
+VkPipeline taa_pipeline;
+u64 taa_source_time;
+// Toggled from the main thread. Off => the resolve copies the frame
+std::atomic<bool> taa_enabled{true};
+// Latched in start_frame, the jitter and the resolve have to agree
+bool frame_taa;
+// false => the next resolve discards the history. Reset by resizes
+bool history_valid;
+u32 jitter_index;
+glm::vec2 jitter;
+
 // pipelines
-// 0 => static objects, 1 => skinned objects
-#define PIPELINE_COUNT 2
-VkPipelineLayout pipeline_layouts[PIPELINE_COUNT];
-VkPipeline graphics_pipelines[PIPELINE_COUNT];
-VkBuffer vertex_buffer[PIPELINE_COUNT];
-VkDeviceMemory vertex_buffer_memory[PIPELINE_COUNT];
-VkBuffer index_buffer[PIPELINE_COUNT];
-VkDeviceMemory index_buffer_memory[PIPELINE_COUNT];
+// Every pipeline description is compiled once per vertex layout it supports.
+// Permutations with the same state share their pipeline, see PipelineKey
+#define MAX_PIPELINES (MAX_PIPELINE_DESCS * VERTEX_LAYOUT_COUNT)
+
+// Everything a graphics pipeline is created from. Zeroed before it is
+// filled, so it can be hashed and compared bytewise
+struct PipelineKey
+{
+    char vertex[SHADER_PATH_SIZE];
+    char fragment[SHADER_PATH_SIZE];
+    char defines[SHADER_DEFINES_SIZE];
+    ShaderSpecialization specialization;
+    u32 layout;
+    u8 blend;
+    u8 depth_test;
+    u8 depth_write;
+    u8 cull;
+};
+
+// Indexed by VertexLayout, static objects don't bind the bone set
+VkPipelineLayout pipeline_layouts[VERTEX_LAYOUT_COUNT];
+VkPipeline graphics_pipelines[MAX_PIPELINES];
+// Depth only version of the pipeline for the prepass, VK_NULL_HANDLE if
+// the pipeline doesn't take part in it, see uses_prepass
+VkPipeline depth_pipelines[MAX_PIPELINES];
+// Drawn into the shadow cascades, VK_NULL_HANDLE if the pipeline doesn't
+// cast shadows, see casts_shadows
+VkPipeline shadow_pipelines[MAX_PIPELINES];
+PipelineKey pipeline_keys[MAX_PIPELINES];
+// Newest source the pipeline was compiled from, newer sources get it reloaded
+u64 pipeline_source_times[MAX_PIPELINES];
+double last_shader_poll;
+u32 pipeline_count;
+// [material][layout] => pipeline, -1 => the material has no shader for the layout
+i32 material_pipelines[MAX_MATERIAL_DESCS][VERTEX_LAYOUT_COUNT];
+u32 material_count;
+
+// Shared by all pipeline creation, kept on disk between launches
+struct PipelineCacheHeader
+{
+    u32 magic;
+    u32 vendor_id;
+    u32 device_id;
+    u32 driver_version;
+    u8 uuid[VK_UUID_SIZE];
+    u64 data_size;
+    // pipeline creation time of the launch that started without a cache
+    float cold_ms;
+};
+VkPipelineCache pipeline_cache;
+float pipeline_cold_ms;
+VkBuffer vertex_buffer[VERTEX_LAYOUT_COUNT];
+GpuAllocation vertex_buffer_memory[VERTEX_LAYOUT_COUNT];
+VkBuffer index_buffer[VERTEX_LAYOUT_COUNT];
+GpuAllocation index_buffer_memory[VERTEX_LAYOUT_COUNT];
 
 RenderQueue render_queue;
+// Written in draw order, uploaded in batch order once the queue is built
+InstanceData* frame_instances;
+
+// Materials don't change per frame, both frames in flight share this buffer
+VkBuffer material_buffer;
+GpuAllocation material_buffer_memory;
+void* material_buffer_mapped;
+
+// gpu driven rendering
+// The cpu writes one indirect draw per opaque batch. cull.comp counts the
+// visible instances into it and compacts them behind the messages, so a
+// batch stays one instanced draw. The other queues are drawn from the cpu.
+// Falls back to drawing the render queue from the cpu if the device lacks
+// multiDrawIndirect.
+bool gpu_driven_supported;
+// Toggled from the main thread while the render thread records
+std::atomic<bool> gpu_driven;
+// Latched in start_frame, filling the queue and recording have to agree
+bool frame_gpu_driven;
+VkDescriptorSetLayout cull_set_layout;
+VkDescriptorSet cull_descriptor_sets[max_frames_in_flight];
+VkPipelineLayout cull_pipeline_layout;
+VkPipeline cull_pipeline;
+u64 cull_source_time;
+VkBuffer indirect_buffers[max_frames_in_flight];
+GpuAllocation indirect_buffers_memory[max_frames_in_flight];
+Frustum frustum;
+
+// clustered lighting
+// cluster.comp writes the lights touching each cluster, pbr.frag only
+// shades with the lights of its cluster
+VkDescriptorSetLayout cluster_set_layout;
+VkDescriptorSet cluster_descriptor_sets[max_frames_in_flight];
+VkPipelineLayout cluster_pipeline_layout;
+VkPipeline cluster_pipeline;
+u64 cluster_source_time;
+VkBuffer cluster_buffers[max_frames_in_flight];
+GpuAllocation cluster_buffers_memory[max_frames_in_flight];
+
+// uploads
+// Copies are batched into one command buffer on the transfer queue, which
+// signals upload_timeline once they are done. A second command buffer on the
+// graphics queue waits for that on the gpu and makes the results visible to
+// rendering (acquiring them if the transfer queue is another family). Staging
+// chunks are freed once the timeline passed their batch
+struct StagingChunk
+{
+    VkBuffer buffer;
+    GpuAllocation memory;
+    VkDeviceSize size;
+    VkDeviceSize used;
+};
+
+struct UploadBatch
+{
+    VkCommandBuffer transfer_buffer;
+    VkCommandBuffer graphics_buffer;
+    StagingChunk chunks[MAX_STAGING_CHUNKS];
+    u32 chunk_count;
+    bool open;
+    // Signaled by the graphics side of the batch, 0 => not in flight
+    u64 value;
+};
+
+VkCommandPool transfer_pool;
+VkSemaphore upload_timeline;
+u64 upload_value;
+UploadBatch upload_batches[MAX_UPLOAD_BATCHES];
+u32 upload_batch;
+
+// Bound state while recording, used to skip redundant binds
+struct BindState
+{
+    i32 pipeline;
+    i32 vertex_buffer;
+    i32 index_buffer;
+    // sets [0, sets_bound) are valid. All pipeline layouts share their
+    // set layouts, so these stay bound across pipeline switches
+    u32 sets_bound;
+};
+
+// Records draws into one command buffer. There is one per recorded chunk,
+// inline recording uses the first one
+struct Recorder
+{
+    VkCommandBuffer buffer;
+    // DrawPass, picks the version of the pipelines that gets bound
+    u32 pass;
+    BindState bind_state;
+    RenderStats stats;
+};
 
-// taa stuff...
-glm::mat4 proj_view;
-i32 jitter_index = 0;
+// multi threaded recording
+// The batches are split into up to one chunk per job worker. Each chunk is
+// recorded by a job into a secondary command buffer from its own pool, one
+// pool per chunk and frame in flight
+u32 record_thread_count;
+VkCommandPool record_pools[max_frames_in_flight * MAX_RECORD_THREADS];
+VkCommandBuffer record_buffers[max_frames_in_flight * MAX_RECORD_THREADS];
+Recorder recorders[MAX_RECORD_THREADS];
+
+RenderStats render_stats;
+glm::vec3 camera_position;
 
 
 bool is_complete(QueueFamilyIndices* self) 
@@ -201,7 +608,7 @@ void create_instance()
     app_info.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
     app_info.pEngineName = "No Engine";
     app_info.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-    app_info.apiVersion = VK_API_VERSION_1_0;
+    app_info.apiVersion = VK_API_VERSION_1_2;
     VkInstanceCreateInfo create_info{};
     create_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
     create_info.pApplicationInfo = &app_info;
@@ -305,9 +712,51 @@ QueueFamilyIndices find_queue_families(VkPhysicalDevice device)
             break;
         }
     }
+
+    // Transfer only families are dma engines, which copy alongside rendering
+    queue_indices.transfer = queue_indices.graphics;
+    for (u32 i = 0; i < count; ++i) {
+        VkQueueFlags flags = families[i].queueFlags;
+        if (flags & VK_QUEUE_TRANSFER_BIT && 
+            !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+            queue_indices.transfer = i;
+            break;
+        }
+    }
     return queue_indices;
 }
 
+// Uploads are tracked with timeline semaphores, which every 1.2 device has
+bool check_timeline_support(VkPhysicalDevice device)
+{
+    VkPhysicalDeviceProperties properties{};
+    vkGetPhysicalDeviceProperties(device, &properties);
+    if (properties.apiVersion < VK_API_VERSION_1_2) {
+        return false;
+    }
+    VkPhysicalDeviceVulkan12Features features12{};
+    features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    VkPhysicalDeviceFeatures2 features{};
+    features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features.pNext = &features12;
+    vkGetPhysicalDeviceFeatures2(device, &features);
+    return features12.timelineSemaphore;
+}
+
+// Compute writes to the indirect buffer are core in 1.2, drawing several
+// commands per call and their first instance are optional features
+bool check_gpu_driven_support(VkPhysicalDevice device)
+{
+    VkPhysicalDeviceProperties properties{};
+    vkGetPhysicalDeviceProperties(device, &properties);
+    if (properties.apiVersion < VK_API_VERSION_1_2) {
+        return false;
+    }
+    VkPhysicalDeviceFeatures features{};
+    vkGetPhysicalDeviceFeatures(device, &features);
+    return features.multiDrawIndirect && features.drawIndirectFirstInstance;
+}
+
 bool is_device_suitable(VkPhysicalDevice device) 
 {
     queue_indices = find_queue_families(device);
@@ -319,7 +768,7 @@ bool is_device_suitable(VkPhysicalDevice device)
             return false;
         }
     }
-    return is_complete(&queue_indices) && extensions_support;
+    return is_complete(&queue_indices) && extensions_support && check_timeline_support(device);
 }
 
 void pick_physical_device(VkPhysicalDevice* device) 
@@ -346,13 +795,16 @@ void pick_physical_device(VkPhysicalDevice* device)
 
 void create_logical_device() 
 {
-    VkDeviceQueueCreateInfo queue_create_infos[2];
-    u32 queue_families[2];
+    VkDeviceQueueCreateInfo queue_create_infos[3];
+    u32 queue_families[3];
     queue_families[0] = queue_indices.graphics;
-    queue_families[1] = queue_indices.present;
-    u32 queue_fam_count = 2;
-    if (queue_indices.graphics == queue_indices.present) {
-        queue_fam_count = 1;
+    u32 queue_fam_count = 1;
+    if (queue_indices.present != queue_indices.graphics) {
+        queue_families[queue_fam_count++] = queue_indices.present;
+    }
+    if (queue_indices.transfer != queue_indices.graphics && 
+        queue_indices.transfer != queue_indices.present) {
+        queue_families[queue_fam_count++] = queue_indices.transfer;
     }
     float queue_proiority = 1.0f;
     for (u32 i = 0; i < queue_fam_count; ++i) {
@@ -364,10 +816,28 @@ void create_logical_device()
         queue_create_info.pQueuePriorities = &queue_proiority;
         queue_create_infos[i] = queue_create_info;
     }
+    gpu_driven_supported = check_gpu_driven_support(physical_device);
+    gpu_driven = gpu_driven_supported;
+    VkPhysicalDeviceFeatures supported_features{};
+    vkGetPhysicalDeviceFeatures(physical_device, &supported_features);
+    overdraw_supported = supported_features.pipelineStatisticsQuery;
+    VkPhysicalDeviceProperties properties{};
+    vkGetPhysicalDeviceProperties(physical_device, &properties);
+    timing_supported = properties.limits.timestampComputeAndGraphics;
+    timestamp_period = properties.limits.timestampPeriod;
     VkPhysicalDeviceFeatures device_features{};
     device_features.samplerAnisotropy = VK_TRUE;
+    device_features.pipelineStatisticsQuery = overdraw_supported;
+    VkPhysicalDeviceVulkan12Features features12{};
+    features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    features12.timelineSemaphore = VK_TRUE;
     VkDeviceCreateInfo create_info{};
     create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    create_info.pNext = &features12;
+    if (gpu_driven_supported) {
+        device_features.multiDrawIndirect = VK_TRUE;
+        device_features.drawIndirectFirstInstance = VK_TRUE;
+    }
     create_info.queueCreateInfoCount = queue_fam_count;
     create_info.pQueueCreateInfos = queue_create_infos;
     create_info.pEnabledFeatures = &device_features;
@@ -386,6 +856,7 @@ void create_logical_device()
     }
     vkGetDeviceQueue(device, queue_indices.graphics, 0, &graphics_queue);
     vkGetDeviceQueue(device, queue_indices.present, 0, &present_queue);
+    vkGetDeviceQueue(device, queue_indices.transfer, 0, &transfer_queue);
     return;
 }
 
@@ -418,9 +889,7 @@ VkExtent2D choose_swap_extent(const VkSurfaceCapabilitiesKHR* capabilities, GLFW
     if (capabilities->currentExtent.width != UINT_MAX) {
         return capabilities->currentExtent;
     } else {
-        i32 width, height;
-        glfwGetFramebufferSize(window, &width, &height);
-        VkExtent2D actual_extent = {(u32) width, (u32) height};
+        VkExtent2D actual_extent = {(u32) framebuffer_width, (u32) framebuffer_height};
         actual_extent.width = clamp(actual_extent.width, 
                                     capabilities->minImageExtent.width,
                                     capabilities->maxImageExtent.width);
@@ -454,7 +923,8 @@ void create_swap_chain(GLFWwindow* window)
     create_info.imageColorSpace = surface_format.colorSpace;
     create_info.imageExtent = extent;
     create_info.imageArrayLayers = 1;
-    create_info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    // Written by the taa resolve
+    create_info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
     u32 queue_family_indices[] = { queue_indices.graphics, queue_indices.present };
     if (queue_indices.present != queue_indices.graphics) {
         create_info.imageSharingMode = VK_SHARING_MODE_CONCURRENT;
@@ -482,18 +952,24 @@ void create_swap_chain(GLFWwindow* window)
     swap_chain_extent = extent;
 }
 
-VkImageView create_image_view(VkImage image, VkFormat format, VkImageAspectFlags aspect_flags) 
+// View of the layers [first_layer, first_layer + layer_count)
+VkImageView create_layer_view(VkImage image, 
+                              VkFormat format, 
+                              VkImageAspectFlags aspect_flags,
+                              VkImageViewType type,
+                              u32 first_layer,
+                              u32 layer_count)
 {
     VkImageViewCreateInfo view_info{};
     view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
     view_info.image = image;
-    view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    view_info.viewType = type;
     view_info.format = format;
     view_info.subresourceRange.aspectMask = aspect_flags;
     view_info.subresourceRange.baseMipLevel = 0;
     view_info.subresourceRange.levelCount = 1;
-    view_info.subresourceRange.baseArrayLayer = 0;
-    view_info.subresourceRange.layerCount = 1;
+    view_info.subresourceRange.baseArrayLayer = first_layer;
+    view_info.subresourceRange.layerCount = layer_count;
     VkImageView image_view;
     if (vkCreateImageView(device, &view_info, NULL, &image_view) != VK_SUCCESS) {
         printf("Failed to create texture image view\n");
@@ -502,30 +978,22 @@ VkImageView create_image_view(VkImage image, VkFormat format, VkImageAspectFlags
     return image_view;
 }
 
-  
-u32 find_memory_type(u32 type_filter, VkMemoryPropertyFlags properties) 
+VkImageView create_image_view(VkImage image, VkFormat format, VkImageAspectFlags aspect_flags) 
 {
-    VkPhysicalDeviceMemoryProperties mem_properties;
-    vkGetPhysicalDeviceMemoryProperties(physical_device, &mem_properties);
-    for (u32 i = 0; i < mem_properties.memoryTypeCount; i++) {
-        if (type_filter & (1 << i) &&
-            (mem_properties.memoryTypes[i].propertyFlags & properties) == properties) {
-            return i;
-        }
-    }
-    printf("Failed to find suitable memory type\n");
-    exit(1);
+    return create_layer_view(image, format, aspect_flags, VK_IMAGE_VIEW_TYPE_2D, 0, 1);
 }
 
+
 void create_image(u32 width, 
                   u32 height, 
+                  u32 layers,
                   VkSampleCountFlagBits num_samples,
                   VkFormat format, 
                   VkImageTiling tiling,
                   VkImageUsageFlags usage,
                   VkMemoryPropertyFlags properties,
                   VkImage* image,
-                  VkDeviceMemory* image_memory) 
+                  GpuAllocation* image_memory) 
 {
     VkImageCreateInfo image_info{};
     image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
@@ -534,7 +1002,7 @@ void create_image(u32 width,
     image_info.extent.height = height;
     image_info.extent.depth = 1;
     image_info.mipLevels = 1;
-    image_info.arrayLayers = 1;
+    image_info.arrayLayers = layers;
     image_info.format = format;
     image_info.tiling = tiling;
     image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
@@ -548,27 +1016,34 @@ void create_image(u32 width,
     }
     VkMemoryRequirements mem_requirements;
     vkGetImageMemoryRequirements(device, *image, &mem_requirements);
-    VkMemoryAllocateInfo alloc_info{};
-    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    alloc_info.allocationSize = mem_requirements.size;
-    alloc_info.memoryTypeIndex = find_memory_type(mem_requirements.memoryTypeBits, properties);
-    if (vkAllocateMemory(device, &alloc_info, NULL, image_memory) != VK_SUCCESS) {
-        printf("Failed to allocate image memory\n");
-        exit(3);
-    }
-    vkBindImageMemory(device, *image, *image_memory, 0);
+    *image_memory = gpu_alloc(&mem_requirements, properties, tiling == VK_IMAGE_TILING_LINEAR);
+    vkBindImageMemory(device, *image, image_memory->memory, image_memory->offset);
 }
 
 void create_render_images()
 {
     for (u32 i = 0; i < max_frames_in_flight; ++i) {
-        create_image(swap_chain_extent.width, swap_chain_extent.height,
+        create_image(swap_chain_extent.width, swap_chain_extent.height, 1,
                      VK_SAMPLE_COUNT_1_BIT, render_image_format,
-                     VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | 
-                     VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                     VK_IMAGE_TILING_OPTIMAL, 
+                     VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
                      render_images + i, render_image_memory + i);
+        create_image(swap_chain_extent.width, swap_chain_extent.height, 1,
+                     VK_SAMPLE_COUNT_1_BIT, velocity_format,
+                     VK_IMAGE_TILING_OPTIMAL, 
+                     VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                     velocity_images + i, velocity_image_memory + i);
+        create_image(swap_chain_extent.width, swap_chain_extent.height, 1,
+                     VK_SAMPLE_COUNT_1_BIT, render_image_format,
+                     VK_IMAGE_TILING_OPTIMAL, 
+                     VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT |
+                     VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                     history_images + i, history_image_memory + i);
     }
+    history_valid = false;
 }
 
 void create_image_views() 
@@ -581,6 +1056,10 @@ void create_image_views()
     for (u32 i = 0; i < max_frames_in_flight; ++i) {
         render_image_views[i] = create_image_view(render_images[i],
                                         render_image_format, VK_IMAGE_ASPECT_COLOR_BIT);
+        velocity_image_views[i] = create_image_view(velocity_images[i],
+                                        velocity_format, VK_IMAGE_ASPECT_COLOR_BIT);
+        history_image_views[i] = create_image_view(history_images[i],
+                                        render_image_format, VK_IMAGE_ASPECT_COLOR_BIT);
     }
 }
 
@@ -614,101 +1093,390 @@ void create_descriptor_set_layouts()
 {
     VkDescriptorSetLayoutBinding global_binding{};
     global_binding.binding = 0;
-    global_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    global_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     global_binding.descriptorCount = 1;
     global_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
     global_binding.pImmutableSamplers = NULL;
 
-    VkDescriptorSetLayoutBinding sampler_binding{};
-    sampler_binding.binding = 1;
-    sampler_binding.descriptorCount = 1;
-    sampler_binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    sampler_binding.pImmutableSamplers = NULL;
-    sampler_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+    VkDescriptorSetLayoutBinding light_binding{};
+    light_binding.binding = 2;
+    light_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+    light_binding.descriptorCount = 1;
+    light_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+    light_binding.pImmutableSamplers = NULL;
+
+    VkDescriptorSetLayoutBinding cluster_binding{};
+    cluster_binding.binding = 3;
+    cluster_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    cluster_binding.descriptorCount = 1;
+    cluster_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+    cluster_binding.pImmutableSamplers = NULL;
+
+    VkDescriptorSetLayoutBinding shadow_binding{};
+    shadow_binding.binding = 4;
+    shadow_binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    shadow_binding.descriptorCount = 1;
+    shadow_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+    shadow_binding.pImmutableSamplers = NULL;
 
     VkDescriptorSetLayoutBinding material_binding{};
     material_binding.binding = 0;
-    material_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    material_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
     material_binding.descriptorCount = 1;
     material_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
     material_binding.pImmutableSamplers = NULL;
 
-    VkDescriptorSetLayoutBinding object_binding{};
-    object_binding.binding = 0;
-    object_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
-    object_binding.descriptorCount = 1;
-    object_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
-    object_binding.pImmutableSamplers = NULL;
+    VkDescriptorSetLayoutBinding instance_binding{};
+    instance_binding.binding = 0;
+    instance_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+    instance_binding.descriptorCount = 1;
+    instance_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+    instance_binding.pImmutableSamplers = NULL;
 
     VkDescriptorSetLayoutBinding bone_binding{};
     bone_binding.binding = 0;
-    bone_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    bone_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
     bone_binding.descriptorCount = 1;
     bone_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
     bone_binding.pImmutableSamplers = NULL;
 
     VkDescriptorSetLayoutBinding bindings[] = {
         global_binding,
-        sampler_binding,
+        light_binding,
+        cluster_binding,
+        shadow_binding,
         material_binding,
-        object_binding,
+        instance_binding,
         bone_binding
     };
 
-    create_layout(bindings, 2, descriptor_set_layouts);
-    create_layout(bindings + 2, 1, descriptor_set_layouts + 1);
-    create_layout(bindings + 3, 1, descriptor_set_layouts + 2);
-    create_layout(bindings + 4, 1, descriptor_set_layouts + 3);
+    // Binding 1 is unused since the taa resolve got its own pass
+    create_layout(bindings, 4, descriptor_set_layouts);
+    create_layout(bindings + 4, 1, descriptor_set_layouts + 1);
+    create_layout(bindings + 5, 1, descriptor_set_layouts + 2);
+    create_layout(bindings + 6, 1, descriptor_set_layouts + 3);
+
+    // 0 => instances, 1 => draw commands
+    VkDescriptorSetLayoutBinding cull_bindings[2];
+    for (u32 i = 0; i < 2; ++i) {
+        cull_bindings[i] = VkDescriptorSetLayoutBinding{};
+        cull_bindings[i].binding = i;
+        cull_bindings[i].descriptorType = i == 0? 
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        cull_bindings[i].descriptorCount = 1;
+        cull_bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        cull_bindings[i].pImmutableSamplers = NULL;
+    }
+    create_layout(cull_bindings, 2, &cull_set_layout);
+
+    // 0 => global uniform, 1 => lights, 2 => cluster lists
+    VkDescriptorType cluster_types[] = {
+        VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+    };
+    VkDescriptorSetLayoutBinding cluster_bindings[3];
+    for (u32 i = 0; i < 3; ++i) {
+        cluster_bindings[i] = VkDescriptorSetLayoutBinding{};
+        cluster_bindings[i].binding = i;
+        cluster_bindings[i].descriptorType = cluster_types[i];
+        cluster_bindings[i].descriptorCount = 1;
+        cluster_bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        cluster_bindings[i].pImmutableSamplers = NULL;
+    }
+    create_layout(cluster_bindings, 3, &cluster_set_layout);
+
+    // 0 => color, 1 => velocity, 2 => history
+    VkDescriptorSetLayoutBinding taa_bindings[3];
+    for (u32 i = 0; i < 3; ++i) {
+        taa_bindings[i] = VkDescriptorSetLayoutBinding{};
+        taa_bindings[i].binding = i;
+        taa_bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        taa_bindings[i].descriptorCount = 1;
+        taa_bindings[i].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+        taa_bindings[i].pImmutableSamplers = NULL;
+    }
+    create_layout(taa_bindings, 3, &taa_set_layout);
+}
+
+// Drivers check their own header too, but only after the data got handed
+// over. Ours rejects caches of other devices and drivers up front
+void create_pipeline_cache()
+{
+    VkPhysicalDeviceProperties properties{};
+    vkGetPhysicalDeviceProperties(physical_device, &properties);
+
+    char path_buffer[1024];
+    strcpy(path_buffer, PATH_PREFIX);
+    strcat(path_buffer, PIPELINE_CACHE_FILE);
+    u8* data = NULL;
+    PipelineCacheHeader header{};
+    FILE* file = fopen(path_buffer, "rb");
+    if (file) {
+        bool valid = fread(&header, sizeof(header), 1, file) == 1 &&
+            header.magic == PIPELINE_CACHE_MAGIC &&
+            header.vendor_id == properties.vendorID &&
+            header.device_id == properties.deviceID &&
+            header.driver_version == properties.driverVersion &&
+            memcmp(header.uuid, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+        if (valid) {
+            data = (u8*) malloc(header.data_size);
+            if (fread(data, header.data_size, 1, file) != 1) {
+                free(data);
+                data = NULL;
+            }
+        }
+        if (!data) {
+            printf("Ignoring pipeline cache of another device or driver\n");
+        }
+        fclose(file);
+    }
+
+    VkPipelineCacheCreateInfo cache_info{};
+    cache_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    cache_info.initialDataSize = data? header.data_size : 0;
+    cache_info.pInitialData = data;
+    if (vkCreatePipelineCache(device, &cache_info, NULL, &pipeline_cache) != VK_SUCCESS) {
+        printf("Failed to create pipeline cache\n");
+        exit(1);
+    }
+    // 0 => measured by this launch
+    pipeline_cold_ms = data? header.cold_ms : 0;
+    free(data);
+}
+
+void save_pipeline_cache()
+{
+    VkPhysicalDeviceProperties properties{};
+    vkGetPhysicalDeviceProperties(physical_device, &properties);
+    size_t size = 0;
+    vkGetPipelineCacheData(device, pipeline_cache, &size, NULL);
+    u8* data = (u8*) malloc(size);
+    vkGetPipelineCacheData(device, pipeline_cache, &size, data);
+
+    PipelineCacheHeader header{};
+    header.magic = PIPELINE_CACHE_MAGIC;
+    header.vendor_id = properties.vendorID;
+    header.device_id = properties.deviceID;
+    header.driver_version = properties.driverVersion;
+    memcpy(header.uuid, properties.pipelineCacheUUID, VK_UUID_SIZE);
+    header.data_size = size;
+    header.cold_ms = pipeline_cold_ms;
+
+    char path_buffer[1024];
+    strcpy(path_buffer, PATH_PREFIX);
+    strcat(path_buffer, PIPELINE_CACHE_FILE);
+    FILE* file = fopen(path_buffer, "wb");
+    if (!file) {
+        printf("Failed to write pipeline cache: %s\n", path_buffer);
+        free(data);
+        return;
+    }
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(data, size, 1, file);
+    fclose(file);
+    free(data);
+}
+
+u64 hash_pipeline_key(PipelineKey* key)
+{
+    // FNV-1a
+    u64 hash = 14695981039346656037ull;
+    u8* bytes = (u8*) key;
+    for (u32 i = 0; i < sizeof(PipelineKey); ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+void create_pipeline_layouts()
+{
+    // Skinned objects additionally bind the bones in set 3
+    u32 set_counts[VERTEX_LAYOUT_COUNT] = {3, 4};
+    // The cascade shadow.vert draws into
+    VkPushConstantRange push_constants{};
+    push_constants.offset = 0;
+    push_constants.size = sizeof(u32);
+    push_constants.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    for (u32 i = 0; i < VERTEX_LAYOUT_COUNT; ++i) {
+        VkPipelineLayoutCreateInfo pipeline_layout_info{};
+        pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipeline_layout_info.setLayoutCount = set_counts[i];
+        pipeline_layout_info.pSetLayouts = descriptor_set_layouts;
+        pipeline_layout_info.pushConstantRangeCount = 1;
+        pipeline_layout_info.pPushConstantRanges = &push_constants;
+        if (vkCreatePipelineLayout(device, &pipeline_layout_info, NULL,
+                                   pipeline_layouts + i) != VK_SUCCESS) {
+            printf("Failed to create pipeline layout\n");
+            exit(1);
+        }
+    }
+}
+
+// Opaque pipelines that write depth get a shadow version
+bool casts_shadows(PipelineKey* key)
+{
+    return key->blend == BLEND_OPAQUE && key->depth_write && key->depth_test != DEPTH_TEST_OFF;
+}
+
+// Shadow casters get a depth only version for the prepass, afterwards they
+// only shade the fragments that won it
+bool uses_prepass(PipelineKey* key)
+{
+    return depth_prepass && casts_shadows(key);
+}
+
+// Static meshes go through DEPTH_VERTEX_SHADER in the prepass, so it has to
+// transform positions exactly like their vertex shader
+const char* get_depth_vertex_shader(PipelineKey* key)
+{
+    return key->layout == VERTEX_LAYOUT_STATIC? DEPTH_VERTEX_SHADER : key->vertex;
+}
+
+u64 get_pipeline_source_time(PipelineKey* key)
+{
+    u64 vertex_time = get_shader_time(key->vertex);
+    u64 fragment_time = get_shader_time(key->fragment);
+    u64 time = vertex_time > fragment_time? vertex_time : fragment_time;
+    if (uses_prepass(key)) {
+        u64 depth_time = get_shader_time(get_depth_vertex_shader(key));
+        time = depth_time > time? depth_time : time;
+    }
+    if (casts_shadows(key)) {
+        u64 shadow_time = get_shader_time(SHADOW_VERTEX_SHADER);
+        time = shadow_time > time? shadow_time : time;
+    }
+    return time;
 }
 
-void create_graphics_pipeline(const char* vert_file,
-                              const char* frag_file,
-                              VkVertexInputAttributeDescription* attr_desc,
-                              u32 attr_count,
-                              VkVertexInputBindingDescription* bind_desc,
-                              u32 set_layout_count,
-                              VkPipelineLayout* layout,
-                              VkPipeline* pipeline)
+// Runs on job workers. Shader modules aren't shared between pipelines,
+// the pipeline cache synchronizes itself. Returns false if a shader
+// doesn't compile. Only DRAW_COLOR has a fragment shader
+bool create_graphics_pipeline(PipelineKey* key, u32 pass, VkPipeline* pipeline)
 {
     VkShaderModule vert_shader;
-    VkShaderModule frag_shader;
+    VkShaderModule frag_shader = VK_NULL_HANDLE;
     i32 len;
-    char* buffer = read_file(vert_file, &len, NULL);
+    bool depth_only = pass != DRAW_COLOR;
+    const char* vertex_source = key->vertex;
+    char defines[SHADER_DEFINES_SIZE + 16];
+    strcpy(defines, key->defines);
+    if (pass == DRAW_DEPTH) {
+        vertex_source = get_depth_vertex_shader(key);
+    } else if (pass == DRAW_SHADOW) {
+        vertex_source = SHADOW_VERTEX_SHADER;
+        if (key->layout == VERTEX_LAYOUT_SKINNED) {
+            strcat(defines, " SKINNED");
+        }
+    }
+    char* buffer = load_shader(vertex_source, defines, &len);
     if (!buffer)
-        exit(1);
+        return false;
     create_shader_module(buffer, len, &vert_shader);
     free(buffer);
-    buffer = read_file(frag_file, &len, NULL);
-    if (!buffer)
-        exit(1);
+    if (!depth_only) {
+        buffer = load_shader(key->fragment, key->defines, &len);
+        if (!buffer) {
+            vkDestroyShaderModule(device, vert_shader, NULL);
+            return false;
+        }
+        create_shader_module(buffer, len, &frag_shader);
+        free(buffer);
+    }
+
+    // Constants a stage doesn't declare are ignored
+    const u32 constant_count = sizeof(ShaderSpecialization) / sizeof(u32);
+    VkSpecializationMapEntry map_entries[constant_count];
+    for (u32 i = 0; i < constant_count; ++i) {
+        map_entries[i].constantID = i;
+        map_entries[i].offset = sizeof(u32) * i;
+        map_entries[i].size = sizeof(u32);
+    }
+    VkSpecializationInfo specialization_info{};
+    specialization_info.mapEntryCount = constant_count;
+    specialization_info.pMapEntries = map_entries;
+    specialization_info.dataSize = sizeof(ShaderSpecialization);
+    specialization_info.pData = &key->specialization;
 
-    create_shader_module(buffer, len, &frag_shader);
-    free(buffer);
     VkPipelineShaderStageCreateInfo vert_create_info{};
     vert_create_info.sType =
         VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
     vert_create_info.stage = VK_SHADER_STAGE_VERTEX_BIT;
     vert_create_info.module = vert_shader;
     vert_create_info.pName = "main";
+    vert_create_info.pSpecializationInfo = &specialization_info;
     VkPipelineShaderStageCreateInfo frag_create_info{};
     frag_create_info.sType =
         VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
     frag_create_info.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
     frag_create_info.module = frag_shader;
     frag_create_info.pName = "main";
+    frag_create_info.pSpecializationInfo = &specialization_info;
     VkPipelineShaderStageCreateInfo shader_stages[] = {
         vert_create_info,
         frag_create_info
     };
 
+    VkVertexInputBindingDescription bind_desc{};
+    bind_desc.binding = 0;
+    bind_desc.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+    VkVertexInputAttributeDescription attr_desc[4];
+    u32 attr_count;
+    if (key->layout == VERTEX_LAYOUT_SKINNED) {
+        bind_desc.stride = sizeof(RiggedVertex);
+        attr_count = 4;
+        attr_desc[0].binding = 0;
+        attr_desc[0].location = 0;
+        attr_desc[0].format = VK_FORMAT_R32G32B32_SFLOAT;
+        attr_desc[0].offset = offsetof(RiggedVertex, x);
+        attr_desc[1].binding = 0;
+        attr_desc[1].location = 1;
+        attr_desc[1].format = VK_FORMAT_R32G32B32_SFLOAT;
+        attr_desc[1].offset = offsetof(RiggedVertex, nx);
+        attr_desc[2].binding = 0;
+        attr_desc[2].location = 2;
+        attr_desc[2].format = VK_FORMAT_R32G32B32_SINT;
+        attr_desc[2].offset = offsetof(RiggedVertex, bones);
+        attr_desc[3].binding = 0;
+        attr_desc[3].location = 3;
+        attr_desc[3].format = VK_FORMAT_R32G32B32_SFLOAT;
+        attr_desc[3].offset = offsetof(RiggedVertex, weights);
+    } else if (depth_only) {
+        // position_buffer
+        bind_desc.stride = sizeof(float) * 3;
+        attr_count = 1;
+        attr_desc[0].binding = 0;
+        attr_desc[0].location = 0;
+        attr_desc[0].format = VK_FORMAT_R32G32B32_SFLOAT;
+        attr_desc[0].offset = 0;
+    } else {
+        bind_desc.stride = sizeof(Vertex);
+        attr_count = 2;
+        attr_desc[0].binding = 0;
+        attr_desc[0].location = 0;
+        attr_desc[0].format = VK_FORMAT_R32G32B32_SFLOAT;
+        attr_desc[0].offset = offsetof(Vertex, x);
+        attr_desc[1].binding = 0;
+        attr_desc[1].location = 1;
+        attr_desc[1].format = VK_FORMAT_R32G32B32_SFLOAT;
+        attr_desc[1].offset = offsetof(Vertex, nx);
+    }
+
+    // Set per command buffer, so pipelines survive swap chain resizes
+    VkDynamicState dynamic_states[] = {
+        VK_DYNAMIC_STATE_VIEWPORT,
+        VK_DYNAMIC_STATE_SCISSOR,
+    };
     VkPipelineDynamicStateCreateInfo dynamic_state{};
     dynamic_state.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-    dynamic_state.dynamicStateCount = 0;
+    dynamic_state.dynamicStateCount = 2;
+    dynamic_state.pDynamicStates = dynamic_states;
     VkPipelineVertexInputStateCreateInfo vertex_input_info{};
     vertex_input_info.sType =
         VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
     vertex_input_info.vertexBindingDescriptionCount = 1;
-    vertex_input_info.pVertexBindingDescriptions = bind_desc;
+    vertex_input_info.pVertexBindingDescriptions = &bind_desc;
     vertex_input_info.vertexAttributeDescriptionCount = attr_count;
     vertex_input_info.pVertexAttributeDescriptions = attr_desc;
     VkPipelineInputAssemblyStateCreateInfo input_assembly{};
@@ -716,24 +1484,17 @@ void create_graphics_pipeline(const char* vert_file,
         VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
     input_assembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
     input_assembly.primitiveRestartEnable = VK_FALSE;
-    VkViewport viewport{};
-    viewport.x = 0.0f;
-    viewport.y = 0.0f;
-    viewport.width = (float) swap_chain_extent.width;
-    viewport.height = (float) swap_chain_extent.height;
-    viewport.minDepth = 0.0f;
-    viewport.maxDepth = 1.0f;
-    VkRect2D scissors{};
-    scissors.offset = {0, 0};
-    scissors.extent = swap_chain_extent;
     VkPipelineViewportStateCreateInfo viewport_state{};
     viewport_state.sType =
         VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
     viewport_state.viewportCount = 1;
     viewport_state.scissorCount = 1;
-    viewport_state.pViewports = &viewport;
-    viewport_state.pScissors = &scissors;
 
+    VkCullModeFlags cull_modes[] = {
+        VK_CULL_MODE_BACK_BIT,
+        VK_CULL_MODE_FRONT_BIT,
+        VK_CULL_MODE_NONE,
+    };
     VkPipelineRasterizationStateCreateInfo rasterizer{};
     rasterizer.sType =
         VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
@@ -741,9 +1502,15 @@ void create_graphics_pipeline(const char* vert_file,
     rasterizer.rasterizerDiscardEnable = VK_FALSE;
     rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
     rasterizer.lineWidth = 1.0f;
-    rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
+    rasterizer.cullMode = cull_modes[key->cull];
     rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
     rasterizer.depthBiasEnable = VK_FALSE;
+    if (pass == DRAW_SHADOW) {
+        // Keeps lit surfaces from shadowing themselves
+        rasterizer.depthBiasEnable = VK_TRUE;
+        rasterizer.depthBiasConstantFactor = 1.25f;
+        rasterizer.depthBiasSlopeFactor = 1.75f;
+    }
     VkPipelineMultisampleStateCreateInfo multisampling{};
     multisampling.sType =
         VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
@@ -753,43 +1520,55 @@ void create_graphics_pipeline(const char* vert_file,
     color_blend_attachment.colorWriteMask =
         VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
         VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-    color_blend_attachment.blendEnable = false;
+    color_blend_attachment.blendEnable = key->blend != BLEND_OPAQUE;
+    color_blend_attachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+    color_blend_attachment.dstColorBlendFactor = key->blend == BLEND_ADDITIVE?
+        VK_BLEND_FACTOR_ONE : VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    color_blend_attachment.colorBlendOp = VK_BLEND_OP_ADD;
+    color_blend_attachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+    color_blend_attachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+    color_blend_attachment.alphaBlendOp = VK_BLEND_OP_ADD;
+    // Blended surfaces keep the motion of what is behind them
+    VkPipelineColorBlendAttachmentState velocity_blend_attachment{};
+    velocity_blend_attachment.colorWriteMask = key->blend == BLEND_OPAQUE?
+        VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT : 0;
+    velocity_blend_attachment.blendEnable = VK_FALSE;
+    VkPipelineColorBlendAttachmentState blend_attachments[] = {
+        color_blend_attachment,
+        velocity_blend_attachment,
+    };
     VkPipelineColorBlendStateCreateInfo color_blending{};
     color_blending.sType =
         VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
     color_blending.logicOpEnable = VK_FALSE;
-    color_blending.attachmentCount = 1;
-    color_blending.pAttachments = &color_blend_attachment;
-    VkPipelineLayoutCreateInfo pipeline_layout_info{};
-    pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipeline_layout_info.setLayoutCount = set_layout_count;
-    pipeline_layout_info.pSetLayouts = descriptor_set_layouts;
-
-    VkPushConstantRange push_constants{};
-    push_constants.offset = 0;
-    push_constants.size = sizeof(PushConstants);
-    push_constants.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-    pipeline_layout_info.pPushConstantRanges = &push_constants;
-    pipeline_layout_info.pushConstantRangeCount = 1;
-
-    if (vkCreatePipelineLayout(device, &pipeline_layout_info, NULL,
-                               layout) != VK_SUCCESS) {
-        printf("Failed to create pipeline layout\n");
-        exit(1);
-    }
+    color_blending.attachmentCount = depth_only? 0 : 2;
+    color_blending.pAttachments = blend_attachments;
+    VkCompareOp compare_ops[] = {
+        VK_COMPARE_OP_LESS,
+        VK_COMPARE_OP_LESS_OR_EQUAL,
+        VK_COMPARE_OP_EQUAL,
+        VK_COMPARE_OP_ALWAYS,
+    };
     VkPipelineDepthStencilStateCreateInfo depth_stencil{};
     depth_stencil.sType = 
         VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-    depth_stencil.depthTestEnable = VK_TRUE;
-    depth_stencil.depthWriteEnable = VK_TRUE;
-    depth_stencil.depthCompareOp = VK_COMPARE_OP_LESS;
+    depth_stencil.depthTestEnable = key->depth_test != DEPTH_TEST_OFF;
+    depth_stencil.depthWriteEnable = key->depth_write;
+    depth_stencil.depthCompareOp = compare_ops[key->depth_test];
+    if (pass == DRAW_COLOR && uses_prepass(key)) {
+        // The prepass wrote the nearest depth already
+        depth_stencil.depthWriteEnable = VK_FALSE;
+        depth_stencil.depthCompareOp = VK_COMPARE_OP_EQUAL;
+    } else if (pass == DRAW_SHADOW) {
+        depth_stencil.depthCompareOp = VK_COMPARE_OP_LESS;
+    }
     depth_stencil.depthBoundsTestEnable = VK_FALSE;
     depth_stencil.minDepthBounds = 0.0f;
     depth_stencil.maxDepthBounds = 1.0f;
     depth_stencil.stencilTestEnable = VK_FALSE;
     VkGraphicsPipelineCreateInfo pipeline_info{};
     pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    pipeline_info.stageCount = 2;
+    pipeline_info.stageCount = depth_only? 1 : 2;
     pipeline_info.pStages = shader_stages;
     pipeline_info.pVertexInputState = &vertex_input_info;
     pipeline_info.pInputAssemblyState = &input_assembly;
@@ -799,198 +1578,709 @@ void create_graphics_pipeline(const char* vert_file,
     pipeline_info.pDepthStencilState = &depth_stencil;
     pipeline_info.pColorBlendState = &color_blending;
     pipeline_info.pDynamicState = &dynamic_state;
-    pipeline_info.layout = *layout;
+    pipeline_info.layout = pipeline_layouts[key->layout];
     pipeline_info.renderPass = render_pass;
-    pipeline_info.subpass = 0;
+    pipeline_info.subpass = depth_only? SUBPASS_DEPTH : SUBPASS_COLOR;
+    if (pass == DRAW_SHADOW) {
+        pipeline_info.renderPass = shadow_render_pass;
+        pipeline_info.subpass = 0;
+    }
     pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
     pipeline_info.basePipelineIndex = -1;
-    if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipeline_info,
+    if (vkCreateGraphicsPipelines(device, pipeline_cache, 1, &pipeline_info,
                                   NULL, pipeline) != VK_SUCCESS) {
         printf("Failed to create graphics pipeline\n");
         exit(1);
     }
     vkDestroyShaderModule(device, vert_shader, NULL);
-    vkDestroyShaderModule(device, frag_shader, NULL);
-}
-
-void create_pipelines() 
-{
-    VkVertexInputBindingDescription static_bind_desc{};
-    static_bind_desc.binding = 0;
-    static_bind_desc.stride = sizeof(Vertex);
-    static_bind_desc.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
-
-    VkVertexInputBindingDescription rigged_bind_desc{};
-    rigged_bind_desc.binding = 0;
-    rigged_bind_desc.stride = sizeof(RiggedVertex);
-    rigged_bind_desc.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
-
-    VkVertexInputAttributeDescription static_attr[2];
-    static_attr[0].binding = 0;
-    static_attr[0].location = 0;
-    static_attr[0].format = VK_FORMAT_R32G32B32_SFLOAT;
-    static_attr[0].offset = offsetof(Vertex, x);
-    static_attr[1].binding = 0;
-    static_attr[1].location = 1;
-    static_attr[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-    static_attr[1].offset = offsetof(Vertex, nx);
-
-    VkVertexInputAttributeDescription rigged_attr[4];
-    rigged_attr[0].binding = 0;
-    rigged_attr[0].location = 0;
-    rigged_attr[0].format = VK_FORMAT_R32G32B32_SFLOAT;
-    rigged_attr[0].offset = offsetof(RiggedVertex, x);
-    rigged_attr[1].binding = 0;
-    rigged_attr[1].location = 1;
-    rigged_attr[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-    rigged_attr[1].offset = offsetof(RiggedVertex, nx);
-    rigged_attr[2].binding = 0;
-    rigged_attr[2].location = 2;
-    rigged_attr[2].format = VK_FORMAT_R32G32B32_SINT;
-    rigged_attr[2].offset = offsetof(RiggedVertex, bones);
-    rigged_attr[3].binding = 0;
-    rigged_attr[3].location = 3;
-    rigged_attr[3].format = VK_FORMAT_R32G32B32_SFLOAT;
-    rigged_attr[3].offset = offsetof(RiggedVertex, weights);
-
-    create_graphics_pipeline("shader/staticv.spv",
-                             "shader/pbr_frag.spv",
-                             static_attr,
-                             2,
-                             &static_bind_desc,
-                             3,
-                             pipeline_layouts,
-                             graphics_pipelines);
-
-    create_graphics_pipeline("shader/skinnedv.spv",
-                             "shader/pbr_frag.spv",
-                             rigged_attr,
-                             4,
-                             &rigged_bind_desc,
-                             4,
-                             pipeline_layouts + 1,
-                             graphics_pipelines + 1);
-}
-
-VkFormat find_supported_format(VkFormat* candidates, 
-                               u32 candidate_count, 
-                               VkImageTiling tiling,
-                               VkFormatFeatureFlags features)
-{
-    for (u32 i = 0; i < candidate_count; ++i) {
-        VkFormat format = candidates[i];
-        VkFormatProperties props;
-        vkGetPhysicalDeviceFormatProperties(physical_device, format, &props);
-        if (tiling == VK_IMAGE_TILING_LINEAR && 
-            (props.linearTilingFeatures & features) == features) {
-            return format;
-        } else if (tiling == VK_IMAGE_TILING_OPTIMAL && 
-            (props.optimalTilingFeatures & features) == features) {
-            return format;
-        }
+    if (frag_shader != VK_NULL_HANDLE) {
+        vkDestroyShaderModule(device, frag_shader, NULL);
     }
-    printf("Failed to find supported format\n");
-    return VK_FORMAT_D32_SFLOAT;
+    return true;
 }
 
-VkFormat find_depth_format() 
+// Destroys the versions that exist
+void destroy_pipeline_versions(VkPipeline pipeline, 
+                               VkPipeline depth_pipeline, 
+                               VkPipeline shadow_pipeline)
 {
-    VkFormat formats[] = {
-        VK_FORMAT_D32_SFLOAT,
-        VK_FORMAT_D32_SFLOAT_S8_UINT,
-        VK_FORMAT_D24_UNORM_S8_UINT
-    };
-    return find_supported_format(formats, 3, 
-                                 VK_IMAGE_TILING_OPTIMAL, 
-                                 VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT);
+    vkDestroyPipeline(device, pipeline, NULL);
+    if (depth_pipeline != VK_NULL_HANDLE) {
+        vkDestroyPipeline(device, depth_pipeline, NULL);
+    }
+    if (shadow_pipeline != VK_NULL_HANDLE) {
+        vkDestroyPipeline(device, shadow_pipeline, NULL);
+    }
 }
 
-void create_render_pass() 
+// All versions of pipeline i, nothing is created unless all of them compile
+bool create_pipeline_versions(u32 i, 
+                              VkPipeline* pipeline, 
+                              VkPipeline* depth_pipeline, 
+                              VkPipeline* shadow_pipeline)
 {
-    VkAttachmentDescription color_attachment{};
-    color_attachment.format = render_image_format;
-    color_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
-    color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-    color_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    color_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    color_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    color_attachment.finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-    VkAttachmentReference color_attachment_ref{};
-    color_attachment_ref.attachment = 0;
-    // QUESTION: Unterschied zu color_attachment.finalLayout?
-    color_attachment_ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-    VkAttachmentDescription depth_attachment{};
-    depth_attachment.format = find_depth_format();
-    depth_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
-    depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    depth_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    depth_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    depth_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    depth_attachment.finalLayout = 
-        VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-    VkAttachmentReference depth_attachment_ref{};
-    depth_attachment_ref.attachment = 1;
-    depth_attachment_ref.layout = 
-        VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-    VkSubpassDescription subpass{};
-    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-    subpass.colorAttachmentCount = 1;
-    subpass.pColorAttachments = &color_attachment_ref;
-    subpass.pDepthStencilAttachment = &depth_attachment_ref;
-    VkAttachmentDescription attachments[] = {
-        color_attachment,
-        depth_attachment,
-    };
-    VkRenderPassCreateInfo render_pass_info{};
-    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-    render_pass_info.attachmentCount = 2;
-    render_pass_info.pAttachments = attachments;
-    render_pass_info.subpassCount = 1;
-    render_pass_info.pSubpasses = &subpass;
-    VkSubpassDependency dependency{};
-    dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-    dependency.dstSubpass = 0;
-    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
-                                VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-    dependency.srcAccessMask = 0;
-    dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
-                                VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-    dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
-                                VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
-    render_pass_info.dependencyCount = 1;
-    render_pass_info.pDependencies = &dependency;
-    if (vkCreateRenderPass(device, &render_pass_info, NULL, &render_pass) !=
-        VK_SUCCESS) {
-        printf("Failed to create render pass!\n");
-        exit(1);
+    PipelineKey* key = pipeline_keys + i;
+    *depth_pipeline = VK_NULL_HANDLE;
+    *shadow_pipeline = VK_NULL_HANDLE;
+    if (!create_graphics_pipeline(key, DRAW_COLOR, pipeline)) {
+        return false;
     }
+    if ((uses_prepass(key) && !create_graphics_pipeline(key, DRAW_DEPTH, depth_pipeline)) ||
+        (casts_shadows(key) && !create_graphics_pipeline(key, DRAW_SHADOW, shadow_pipeline))) {
+        destroy_pipeline_versions(*pipeline, *depth_pipeline, *shadow_pipeline);
+        return false;
+    }
+    return true;
 }
 
-void create_framebuffers() 
+void create_pipeline_job(void* data, u32 first, u32 last)
 {
-    for (u32 i = 0; i < max_frames_in_flight; ++i) {
-        VkImageView attachments[] = {
-            render_image_views[i],
-            depth_image_view
-        };
-        VkFramebufferCreateInfo framebuffer_info{};
-        framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-        framebuffer_info.renderPass = render_pass;
-        framebuffer_info.attachmentCount = 2;
-        framebuffer_info.pAttachments = attachments;
-        framebuffer_info.width = swap_chain_extent.width;
-        framebuffer_info.height = swap_chain_extent.height;
-        framebuffer_info.layers = 1;
-        if (vkCreateFramebuffer(device, &framebuffer_info, NULL, framebuffers + i) != VK_SUCCESS) {
-            printf("Failed to create framebuffer\n");
+    for (u32 i = first; i < last; ++i) {
+        pipeline_source_times[i] = get_pipeline_source_time(pipeline_keys + i);
+        if (!create_pipeline_versions(i, graphics_pipelines + i, depth_pipelines + i, 
+                                      shadow_pipelines + i)) {
             exit(1);
         }
     }
 }
 
-void create_command_pool() 
+void destroy_pipelines()
+{
+    for (u32 i = 0; i < pipeline_count; ++i) {
+        destroy_pipeline_versions(graphics_pipelines[i], depth_pipelines[i], 
+                                  shadow_pipelines[i]);
+    }
+}
+
+// New versions of every pipeline, built before the old ones are replaced
+struct PipelineRebuild
+{
+    VkPipeline pipelines[MAX_PIPELINES];
+    VkPipeline depth_pipelines[MAX_PIPELINES];
+    VkPipeline shadow_pipelines[MAX_PIPELINES];
+    bool created[MAX_PIPELINES];
+};
+
+void rebuild_pipeline_job(void* data, u32 first, u32 last)
+{
+    PipelineRebuild* rebuild = (PipelineRebuild*) data;
+    for (u32 i = first; i < last; ++i) {
+        rebuild->created[i] = create_pipeline_versions(i, rebuild->pipelines + i, 
+                                                       rebuild->depth_pipelines + i,
+                                                       rebuild->shadow_pipelines + i);
+    }
+}
+
+// The depth test of the color pass depends on the prepass, so toggling it
+// recreates every pipeline. If one of them fails to compile, the old ones
+// are kept and the prepass stays as it was
+void apply_depth_prepass()
+{
+    bool requested = depth_prepass_requested;
+    if (depth_prepass == requested) {
+        return;
+    }
+    vkDeviceWaitIdle(device);
+    depth_prepass = requested;
+    PipelineRebuild* rebuild = (PipelineRebuild*) malloc(sizeof(PipelineRebuild));
+    parallel_for("pipelines", pipeline_count, 1, rebuild_pipeline_job, rebuild);
+
+    bool created = true;
+    for (u32 i = 0; i < pipeline_count; ++i) {
+        created = created && rebuild->created[i];
+    }
+    if (created) {
+        destroy_pipelines();
+        for (u32 i = 0; i < pipeline_count; ++i) {
+            graphics_pipelines[i] = rebuild->pipelines[i];
+            depth_pipelines[i] = rebuild->depth_pipelines[i];
+            shadow_pipelines[i] = rebuild->shadow_pipelines[i];
+        }
+        printf("Depth prepass: %s\n", depth_prepass? "on" : "off");
+    } else {
+        for (u32 i = 0; i < pipeline_count; ++i) {
+            if (rebuild->created[i]) {
+                destroy_pipeline_versions(rebuild->pipelines[i], rebuild->depth_pipelines[i],
+                                          rebuild->shadow_pipelines[i]);
+            }
+        }
+        depth_prepass = !requested;
+        depth_prepass_requested = depth_prepass;
+        printf("Depth prepass stays %s, a pipeline failed to compile\n", 
+               depth_prepass? "on" : "off");
+    }
+    free(rebuild);
+}
+
+// Returns the index of the pipeline with this key, adds it if there is none
+u32 add_pipeline(PipelineKey* key, u64* hashes)
+{
+    u64 hash = hash_pipeline_key(key);
+    for (u32 i = 0; i < pipeline_count; ++i) {
+        if (hashes[i] == hash && memcmp(pipeline_keys + i, key, sizeof(PipelineKey)) == 0) {
+            return i;
+        }
+    }
+    assert(pipeline_count < MAX_PIPELINES);
+    pipeline_keys[pipeline_count] = *key;
+    hashes[pipeline_count] = hash;
+    return pipeline_count++;
+}
+
+// Builds the permutations used by the materials and creates them in parallel
+void create_pipelines(MaterialLibrary* library)
+{
+    create_pipeline_layouts();
+
+    u64 hashes[MAX_PIPELINES];
+    pipeline_count = 0;
+    material_count = library->material_count;
+    for (u32 i = 0; i < library->material_count; ++i) {
+        MaterialDesc* material = library->materials + i;
+        assert(material->pipeline < library->pipeline_count);
+        PipelineDesc* desc = library->pipelines + material->pipeline;
+        for (u32 layout = 0; layout < VERTEX_LAYOUT_COUNT; ++layout) {
+            material_pipelines[i][layout] = -1;
+            if (!desc->vertex[layout][0]) {
+                continue;
+            }
+
+            PipelineKey key;
+            memset(&key, 0, sizeof(key));
+            strcpy(key.vertex, desc->vertex[layout]);
+            strcpy(key.fragment, desc->fragment);
+            strcpy(key.defines, desc->defines);
+            key.specialization = desc->specialization;
+            // Only read by skinned.vert, static permutations that just
+            // differ in it share their pipeline
+            if (layout != VERTEX_LAYOUT_SKINNED) {
+                key.specialization.bone_influences = 0;
+            }
+            key.layout = layout;
+            key.blend = desc->blend;
+            key.depth_test = desc->depth_test;
+            key.depth_write = desc->depth_write;
+            key.cull = desc->cull;
+            material_pipelines[i][layout] = add_pipeline(&key, hashes);
+        }
+    }
+
+    parallel_for("pipelines", pipeline_count, 1, create_pipeline_job, NULL);
+    printf("Created %u pipelines for %u materials\n", pipeline_count, material_count);
+}
+
+// One set, push constants of push_size bytes. Returns false if the shader
+// doesn't compile
+bool create_compute_pipeline(const char* source, 
+                             VkDescriptorSetLayout set_layout,
+                             u32 push_size,
+                             VkPipelineLayout* layout,
+                             VkPipeline* pipeline)
+{
+    VkShaderModule shader;
+    i32 len;
+    char* buffer = load_shader(source, "", &len);
+    if (!buffer)
+        return false;
+    create_shader_module(buffer, len, &shader);
+    free(buffer);
+
+    VkPushConstantRange push_constants{};
+    push_constants.offset = 0;
+    push_constants.size = push_size;
+    push_constants.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    VkPipelineLayoutCreateInfo layout_info{};
+    layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    layout_info.setLayoutCount = 1;
+    layout_info.pSetLayouts = &set_layout;
+    layout_info.pushConstantRangeCount = 1;
+    layout_info.pPushConstantRanges = &push_constants;
+    if (vkCreatePipelineLayout(device, &layout_info, NULL, layout) != VK_SUCCESS) {
+        printf("Failed to create compute pipeline layout: %s\n", source);
+        exit(1);
+    }
+
+    VkComputePipelineCreateInfo pipeline_info{};
+    pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipeline_info.stage.module = shader;
+    pipeline_info.stage.pName = "main";
+    pipeline_info.layout = *layout;
+    if (vkCreateComputePipelines(device, pipeline_cache, 1, &pipeline_info,
+                                 NULL, pipeline) != VK_SUCCESS) {
+        printf("Failed to create compute pipeline: %s\n", source);
+        exit(1);
+    }
+    vkDestroyShaderModule(device, shader, NULL);
+    return true;
+}
+
+void create_compute_pipelines()
+{
+    cull_source_time = get_shader_time(CULL_SHADER);
+    cluster_source_time = get_shader_time(CLUSTER_SHADER);
+    if (!create_compute_pipeline(CULL_SHADER, cull_set_layout, sizeof(CullConstants),
+                                 &cull_pipeline_layout, &cull_pipeline) ||
+        !create_compute_pipeline(CLUSTER_SHADER, cluster_set_layout, sizeof(u32),
+                                 &cluster_pipeline_layout, &cluster_pipeline)) {
+        exit(1);
+    }
+}
+
+// One triangle over the whole target, from FULLSCREEN_VERTEX_SHADER. One
+// set, push constants of push_size bytes for the fragment shader. Writes
+// color_count attachments without blending. Returns false if a shader
+// doesn't compile
+bool create_fullscreen_pipeline(const char* fragment,
+                                VkDescriptorSetLayout set_layout,
+                                u32 push_size,
+                                VkRenderPass pass,
+                                u32 color_count,
+                                VkPipelineLayout* layout,
+                                VkPipeline* pipeline)
+{
+    const char* sources[] = {FULLSCREEN_VERTEX_SHADER, fragment};
+    VkShaderStageFlagBits stages[] = {VK_SHADER_STAGE_VERTEX_BIT, VK_SHADER_STAGE_FRAGMENT_BIT};
+    VkShaderModule shaders[2];
+    VkPipelineShaderStageCreateInfo shader_stages[2];
+    for (u32 i = 0; i < 2; ++i) {
+        i32 len;
+        char* buffer = load_shader(sources[i], "", &len);
+        if (!buffer) {
+            if (i > 0) {
+                vkDestroyShaderModule(device, shaders[0], NULL);
+            }
+            return false;
+        }
+        create_shader_module(buffer, len, shaders + i);
+        free(buffer);
+        shader_stages[i] = VkPipelineShaderStageCreateInfo{};
+        shader_stages[i].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        shader_stages[i].stage = stages[i];
+        shader_stages[i].module = shaders[i];
+        shader_stages[i].pName = "main";
+    }
+
+    VkPushConstantRange push_constants{};
+    push_constants.offset = 0;
+    push_constants.size = push_size;
+    push_constants.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+    VkPipelineLayoutCreateInfo layout_info{};
+    layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    layout_info.setLayoutCount = 1;
+    layout_info.pSetLayouts = &set_layout;
+    layout_info.pushConstantRangeCount = 1;
+    layout_info.pPushConstantRanges = &push_constants;
+    if (vkCreatePipelineLayout(device, &layout_info, NULL, layout) != VK_SUCCESS) {
+        printf("Failed to create pipeline layout: %s\n", fragment);
+        exit(1);
+    }
+
+    VkDynamicState dynamic_states[] = {
+        VK_DYNAMIC_STATE_VIEWPORT,
+        VK_DYNAMIC_STATE_SCISSOR,
+    };
+    VkPipelineDynamicStateCreateInfo dynamic_state{};
+    dynamic_state.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamic_state.dynamicStateCount = 2;
+    dynamic_state.pDynamicStates = dynamic_states;
+    VkPipelineVertexInputStateCreateInfo vertex_input_info{};
+    vertex_input_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    VkPipelineInputAssemblyStateCreateInfo input_assembly{};
+    input_assembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    input_assembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    VkPipelineViewportStateCreateInfo viewport_state{};
+    viewport_state.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewport_state.viewportCount = 1;
+    viewport_state.scissorCount = 1;
+    VkPipelineRasterizationStateCreateInfo rasterizer{};
+    rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+    rasterizer.lineWidth = 1.0f;
+    rasterizer.cullMode = VK_CULL_MODE_NONE;
+    rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+    VkPipelineMultisampleStateCreateInfo multisampling{};
+    multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+    VkPipelineColorBlendAttachmentState color_blend_attachments[2]{};
+    assert(color_count <= 2);
+    for (u32 i = 0; i < color_count; ++i) {
+        color_blend_attachments[i].colorWriteMask =
+            VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+            VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+        color_blend_attachments[i].blendEnable = VK_FALSE;
+    }
+    VkPipelineColorBlendStateCreateInfo color_blending{};
+    color_blending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    color_blending.attachmentCount = color_count;
+    color_blending.pAttachments = color_blend_attachments;
+    VkPipelineDepthStencilStateCreateInfo depth_stencil{};
+    depth_stencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    VkGraphicsPipelineCreateInfo pipeline_info{};
+    pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipeline_info.stageCount = 2;
+    pipeline_info.pStages = shader_stages;
+    pipeline_info.pVertexInputState = &vertex_input_info;
+    pipeline_info.pInputAssemblyState = &input_assembly;
+    pipeline_info.pViewportState = &viewport_state;
+    pipeline_info.pRasterizationState = &rasterizer;
+    pipeline_info.pMultisampleState = &multisampling;
+    pipeline_info.pDepthStencilState = &depth_stencil;
+    pipeline_info.pColorBlendState = &color_blending;
+    pipeline_info.pDynamicState = &dynamic_state;
+    pipeline_info.layout = *layout;
+    pipeline_info.renderPass = pass;
+    pipeline_info.subpass = 0;
+    pipeline_info.basePipelineIndex = -1;
+    if (vkCreateGraphicsPipelines(device, pipeline_cache, 1, &pipeline_info,
+                                  NULL, pipeline) != VK_SUCCESS) {
+        printf("Failed to create pipeline: %s\n", fragment);
+        exit(1);
+    }
+    vkDestroyShaderModule(device, shaders[0], NULL);
+    vkDestroyShaderModule(device, shaders[1], NULL);
+    return true;
+}
+
+u64 get_fullscreen_source_time(const char* fragment)
+{
+    u64 vertex_time = get_shader_time(FULLSCREEN_VERTEX_SHADER);
+    u64 fragment_time = get_shader_time(fragment);
+    return vertex_time > fragment_time? vertex_time : fragment_time;
+}
+
+void create_fullscreen_pipelines()
+{
+    taa_source_time = get_fullscreen_source_time(TAA_SHADER);
+    // History and swap chain image
+    if (!create_fullscreen_pipeline(TAA_SHADER, taa_set_layout, sizeof(TaaConstants),
+                                    taa_render_pass, 2, &taa_pipeline_layout, 
+                                    &taa_pipeline)) {
+        exit(1);
+    }
+}
+
+// Like the graphics pipelines, keeps the old version if the new one fails
+// to compile. The pipeline layout is replaced along with the pipeline
+void reload_compute_pipeline(const char* source,
+                             VkDescriptorSetLayout set_layout,
+                             u32 push_size,
+                             u64* source_time,
+                             VkPipelineLayout* layout,
+                             VkPipeline* pipeline,
+                             bool* waited)
+{
+    u64 time = get_shader_time(source);
+    if (time <= *source_time) {
+        return;
+    }
+    *source_time = time;
+
+    if (!*waited) {
+        vkDeviceWaitIdle(device);
+        *waited = true;
+    }
+    VkPipelineLayout new_layout;
+    VkPipeline new_pipeline;
+    if (create_compute_pipeline(source, set_layout, push_size, &new_layout, &new_pipeline)) {
+        vkDestroyPipeline(device, *pipeline, NULL);
+        vkDestroyPipelineLayout(device, *layout, NULL);
+        *layout = new_layout;
+        *pipeline = new_pipeline;
+        printf("Reloaded %s\n", source);
+    }
+}
+
+// Recreates the pipelines whose sources changed since they were compiled.
+// Pipelines that fail to compile keep their old version
+void reload_pipelines()
+{
+    double time = glfwGetTime();
+    if (time - last_shader_poll < SHADER_POLL_INTERVAL) {
+        return;
+    }
+    last_shader_poll = time;
+
+    bool waited = false;
+    for (u32 i = 0; i < pipeline_count; ++i) {
+        u64 source_time = get_pipeline_source_time(pipeline_keys + i);
+        if (source_time <= pipeline_source_times[i]) {
+            continue;
+        }
+        pipeline_source_times[i] = source_time;
+
+        // The old pipeline may be used by a frame in flight
+        if (!waited) {
+            vkDeviceWaitIdle(device);
+            waited = true;
+        }
+        VkPipeline pipeline;
+        VkPipeline depth_pipeline;
+        VkPipeline shadow_pipeline;
+        if (create_pipeline_versions(i, &pipeline, &depth_pipeline, &shadow_pipeline)) {
+            destroy_pipeline_versions(graphics_pipelines[i], depth_pipelines[i], 
+                                      shadow_pipelines[i]);
+            graphics_pipelines[i] = pipeline;
+            depth_pipelines[i] = depth_pipeline;
+            shadow_pipelines[i] = shadow_pipeline;
+            printf("Reloaded pipeline %u\n", i);
+        }
+    }
+
+    reload_compute_pipeline(CULL_SHADER, cull_set_layout, sizeof(CullConstants),
+                            &cull_source_time, &cull_pipeline_layout, &cull_pipeline,
+                            &waited);
+    reload_compute_pipeline(CLUSTER_SHADER, cluster_set_layout, sizeof(u32),
+                            &cluster_source_time, &cluster_pipeline_layout, 
+                            &cluster_pipeline, &waited);
+    u64 taa_time = get_fullscreen_source_time(TAA_SHADER);
+    if (taa_time > taa_source_time) {
+        taa_source_time = taa_time;
+        if (!waited) {
+            vkDeviceWaitIdle(device);
+            waited = true;
+        }
+        VkPipelineLayout layout;
+        VkPipeline pipeline;
+        if (create_fullscreen_pipeline(TAA_SHADER, taa_set_layout, sizeof(TaaConstants),
+                                       taa_render_pass, 2, &layout, &pipeline)) {
+            vkDestroyPipeline(device, taa_pipeline, NULL);
+            vkDestroyPipelineLayout(device, taa_pipeline_layout, NULL);
+            taa_pipeline_layout = layout;
+            taa_pipeline = pipeline;
+            printf("Reloaded %s\n", TAA_SHADER);
+        }
+    }
+}
+
+VkFormat find_supported_format(VkFormat* candidates, 
+                               u32 candidate_count, 
+                               VkImageTiling tiling,
+                               VkFormatFeatureFlags features)
+{
+    for (u32 i = 0; i < candidate_count; ++i) {
+        VkFormat format = candidates[i];
+        VkFormatProperties props;
+        vkGetPhysicalDeviceFormatProperties(physical_device, format, &props);
+        if (tiling == VK_IMAGE_TILING_LINEAR && 
+            (props.linearTilingFeatures & features) == features) {
+            return format;
+        } else if (tiling == VK_IMAGE_TILING_OPTIMAL && 
+            (props.optimalTilingFeatures & features) == features) {
+            return format;
+        }
+    }
+    printf("Failed to find supported format\n");
+    return VK_FORMAT_D32_SFLOAT;
+}
+
+VkFormat find_depth_format() 
+{
+    VkFormat formats[] = {
+        VK_FORMAT_D32_SFLOAT,
+        VK_FORMAT_D32_SFLOAT_S8_UINT,
+        VK_FORMAT_D24_UNORM_S8_UINT
+    };
+    return find_supported_format(formats, 3, 
+                                 VK_IMAGE_TILING_OPTIMAL, 
+                                 VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT);
+}
+
+void create_render_pass() 
+{
+    VkAttachmentDescription color_attachment{};
+    color_attachment.format = render_image_format;
+    color_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    color_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    color_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    color_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    // Read by the taa resolve
+    color_attachment.finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    VkAttachmentReference color_attachment_refs[2]{};
+    color_attachment_refs[0].attachment = 0;
+    // QUESTION: Unterschied zu color_attachment.finalLayout?
+    color_attachment_refs[0].layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    VkAttachmentDescription velocity_attachment = color_attachment;
+    velocity_attachment.format = velocity_format;
+    color_attachment_refs[1].attachment = 2;
+    color_attachment_refs[1].layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    VkAttachmentDescription depth_attachment{};
+    depth_attachment.format = find_depth_format();
+    depth_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depth_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    depth_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depth_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    depth_attachment.finalLayout = 
+        VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    VkAttachmentReference depth_attachment_ref{};
+    depth_attachment_ref.attachment = 1;
+    depth_attachment_ref.layout = 
+        VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    VkSubpassDescription subpasses[2]{};
+    subpasses[SUBPASS_DEPTH].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpasses[SUBPASS_DEPTH].colorAttachmentCount = 0;
+    subpasses[SUBPASS_DEPTH].pDepthStencilAttachment = &depth_attachment_ref;
+    subpasses[SUBPASS_COLOR].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpasses[SUBPASS_COLOR].colorAttachmentCount = 2;
+    subpasses[SUBPASS_COLOR].pColorAttachments = color_attachment_refs;
+    subpasses[SUBPASS_COLOR].pDepthStencilAttachment = &depth_attachment_ref;
+    VkAttachmentDescription attachments[] = {
+        color_attachment,
+        depth_attachment,
+        velocity_attachment,
+    };
+    VkRenderPassCreateInfo render_pass_info{};
+    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    render_pass_info.attachmentCount = 3;
+    render_pass_info.pAttachments = attachments;
+    render_pass_info.subpassCount = 2;
+    render_pass_info.pSubpasses = subpasses;
+    VkSubpassDependency dependencies[3]{};
+    dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+    dependencies[0].dstSubpass = SUBPASS_DEPTH;
+    // The resolve of an earlier frame may still read color and velocity
+    dependencies[0].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                                VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+                                VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    dependencies[0].srcAccessMask = 0;
+    dependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                                VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+    dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                                VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    // The color pass tests against the depth of the prepass
+    dependencies[1].srcSubpass = SUBPASS_DEPTH;
+    dependencies[1].dstSubpass = SUBPASS_COLOR;
+    dependencies[1].srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    dependencies[1].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    dependencies[1].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+    dependencies[1].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                                VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    dependencies[1].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+    // The taa resolve samples color and velocity
+    dependencies[2].srcSubpass = SUBPASS_COLOR;
+    dependencies[2].dstSubpass = VK_SUBPASS_EXTERNAL;
+    dependencies[2].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    dependencies[2].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    dependencies[2].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    dependencies[2].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    render_pass_info.dependencyCount = 3;
+    render_pass_info.pDependencies = dependencies;
+    if (vkCreateRenderPass(device, &render_pass_info, NULL, &render_pass) !=
+        VK_SUCCESS) {
+        printf("Failed to create render pass!\n");
+        exit(1);
+    }
+}
+
+// Writes the history and the swap chain image at once, the swap chain image
+// goes straight to presentation
+void create_taa_render_pass()
+{
+    VkAttachmentDescription attachments[2]{};
+    attachments[0].format = render_image_format;
+    attachments[0].samples = VK_SAMPLE_COUNT_1_BIT;
+    attachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachments[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    attachments[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachments[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    // Read by the resolve of the next frame
+    attachments[0].finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    attachments[1] = attachments[0];
+    attachments[1].format = swap_chain_image_format;
+    attachments[1].finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    VkAttachmentReference color_attachment_refs[2]{};
+    color_attachment_refs[0].attachment = 0;
+    color_attachment_refs[0].layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    color_attachment_refs[1].attachment = 1;
+    color_attachment_refs[1].layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    VkSubpassDescription subpass{};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.colorAttachmentCount = 2;
+    subpass.pColorAttachments = color_attachment_refs;
+    VkSubpassDependency dependencies[2]{};
+    // The history was read by the resolve of the last frame. The swap chain
+    // image is available once the acquire semaphore passes, the submit
+    // waits for it at the color attachment output stage
+    dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+    dependencies[0].dstSubpass = 0;
+    dependencies[0].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | 
+                                VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    dependencies[0].srcAccessMask = 0;
+    dependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    // Presentation waits on a semaphore, only the history needs this
+    dependencies[1].srcSubpass = 0;
+    dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+    dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    dependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    VkRenderPassCreateInfo render_pass_info{};
+    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    render_pass_info.attachmentCount = 2;
+    render_pass_info.pAttachments = attachments;
+    render_pass_info.subpassCount = 1;
+    render_pass_info.pSubpasses = &subpass;
+    render_pass_info.dependencyCount = 2;
+    render_pass_info.pDependencies = dependencies;
+    if (vkCreateRenderPass(device, &render_pass_info, NULL, &taa_render_pass) != VK_SUCCESS) {
+        printf("Failed to create taa render pass\n");
+        exit(1);
+    }
+}
+
+void create_framebuffers() 
+{
+    for (u32 i = 0; i < max_frames_in_flight; ++i) {
+        VkImageView attachments[] = {
+            render_image_views[i],
+            depth_image_view,
+            velocity_image_views[i],
+        };
+        VkFramebufferCreateInfo framebuffer_info{};
+        framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        framebuffer_info.renderPass = render_pass;
+        framebuffer_info.attachmentCount = 3;
+        framebuffer_info.pAttachments = attachments;
+        framebuffer_info.width = swap_chain_extent.width;
+        framebuffer_info.height = swap_chain_extent.height;
+        framebuffer_info.layers = 1;
+        if (vkCreateFramebuffer(device, &framebuffer_info, NULL, framebuffers + i) != VK_SUCCESS) {
+            printf("Failed to create framebuffer\n");
+            exit(1);
+        }
+    }
+
+    u32 image_count = (u32) swap_chain_image_views.size();
+    taa_framebuffers.resize(max_frames_in_flight * image_count);
+    for (u32 i = 0; i < taa_framebuffers.size(); ++i) {
+        VkImageView attachments[] = {
+            history_image_views[i / image_count],
+            swap_chain_image_views[i % image_count],
+        };
+        VkFramebufferCreateInfo framebuffer_info{};
+        framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        framebuffer_info.renderPass = taa_render_pass;
+        framebuffer_info.attachmentCount = 2;
+        framebuffer_info.pAttachments = attachments;
+        framebuffer_info.width = swap_chain_extent.width;
+        framebuffer_info.height = swap_chain_extent.height;
+        framebuffer_info.layers = 1;
+        if (vkCreateFramebuffer(device, &framebuffer_info, NULL, 
+                                &taa_framebuffers[i]) != VK_SUCCESS) {
+            printf("Failed to create taa framebuffer\n");
+            exit(1);
+        }
+    }
+}
+
+void create_command_pool() 
 {
     VkCommandPoolCreateInfo pool_info{};
     pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
@@ -1002,50 +2292,37 @@ void create_command_pool()
     }
 }
 
-VkCommandBuffer begin_single_time_commands()
-{
-    VkCommandBufferAllocateInfo alloc_info{};
-    alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    alloc_info.commandPool = command_pool;
-    alloc_info.commandBufferCount = 1;
-    VkCommandBuffer command_buffer;
-    vkAllocateCommandBuffers(device, &alloc_info, &command_buffer);
-    VkCommandBufferBeginInfo begin_info{};
-    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-    vkBeginCommandBuffer(command_buffer, &begin_info);
-    return command_buffer;
-}
-
-void end_single_time_commands(VkCommandBuffer buffer) 
+void create_record_pools()
 {
-    vkEndCommandBuffer(buffer);
-    VkSubmitInfo submit_info{};
-    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submit_info.commandBufferCount = 1;
-    submit_info.pCommandBuffers = &buffer;
-    vkQueueSubmit(graphics_queue, 1, &submit_info, VK_NULL_HANDLE);
-    vkQueueWaitIdle(graphics_queue);
-    vkFreeCommandBuffers(device, command_pool, 1, &buffer);
-}
+    record_thread_count = clamp(get_worker_count(), 1, MAX_RECORD_THREADS);
+
+    for (u32 i = 0; i < max_frames_in_flight * MAX_RECORD_THREADS; ++i) {
+        VkCommandPoolCreateInfo pool_info{};
+        pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+        pool_info.queueFamilyIndex = queue_indices.graphics;
+        if (vkCreateCommandPool(device, &pool_info, NULL, record_pools + i) != VK_SUCCESS) {
+            printf("Failed to create command pool\n");
+            exit(1);
+        }
 
-void copy_buffer(VkBuffer src_buffer, VkBuffer dst_buffer, VkDeviceSize size) 
-{
-    VkCommandBuffer cmd_buffer = begin_single_time_commands();
-    VkBufferCopy copy_region{};
-    copy_region.srcOffset = 0;
-    copy_region.dstOffset = 0;
-    copy_region.size = size;
-    vkCmdCopyBuffer(cmd_buffer, src_buffer, dst_buffer, 1, &copy_region);
-    end_single_time_commands(cmd_buffer);
+        VkCommandBufferAllocateInfo alloc_info{};
+        alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        alloc_info.commandPool = record_pools[i];
+        alloc_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+        alloc_info.commandBufferCount = 1;
+        if (vkAllocateCommandBuffers(device, &alloc_info, record_buffers + i) != VK_SUCCESS) {
+            printf("Failed to allocate command buffers\n");
+            exit(1);
+        }
+    }
 }
 
 void create_buffer(VkDeviceSize size, 
                   VkBufferUsageFlags usage,
                   VkMemoryPropertyFlags properties, 
                   VkBuffer* buffer,
-                  VkDeviceMemory* buffer_memory) 
+                  GpuAllocation* buffer_memory) 
 {
     VkBufferCreateInfo buffer_info{};
     buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
@@ -1058,66 +2335,368 @@ void create_buffer(VkDeviceSize size,
     }
     VkMemoryRequirements mem_requirements;
     vkGetBufferMemoryRequirements(device, *buffer, &mem_requirements);
-    VkMemoryAllocateInfo alloc_info{};
-    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    alloc_info.allocationSize = mem_requirements.size;
-    alloc_info.memoryTypeIndex = find_memory_type(mem_requirements.memoryTypeBits, properties);
-    if (vkAllocateMemory(device, &alloc_info, NULL, buffer_memory) !=
-        VK_SUCCESS) {
-        printf("Failed to allocate vertex buffer memory\n");
+    *buffer_memory = gpu_alloc(&mem_requirements, properties, true);
+    vkBindBufferMemory(device, *buffer, buffer_memory->memory, buffer_memory->offset);
+}
+
+void create_upload_resources()
+{
+    VkCommandPoolCreateInfo pool_info{};
+    pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    pool_info.queueFamilyIndex = queue_indices.transfer;
+    if (vkCreateCommandPool(device, &pool_info, NULL, &transfer_pool) != VK_SUCCESS) {
+        printf("Failed to create command pool\n");
+        exit(1);
+    }
+
+    for (u32 i = 0; i < MAX_UPLOAD_BATCHES; ++i) {
+        UploadBatch* batch = upload_batches + i;
+        *batch = {};
+        VkCommandBufferAllocateInfo alloc_info{};
+        alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        alloc_info.commandBufferCount = 1;
+        alloc_info.commandPool = transfer_pool;
+        if (vkAllocateCommandBuffers(device, &alloc_info, &batch->transfer_buffer) != VK_SUCCESS) {
+            printf("Failed to allocate command buffers\n");
+            exit(1);
+        }
+        alloc_info.commandPool = command_pool;
+        if (vkAllocateCommandBuffers(device, &alloc_info, &batch->graphics_buffer) != VK_SUCCESS) {
+            printf("Failed to allocate command buffers\n");
+            exit(1);
+        }
+    }
+
+    VkSemaphoreTypeCreateInfo type_info{};
+    type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    type_info.initialValue = 0;
+    VkSemaphoreCreateInfo semaphore_info{};
+    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphore_info.pNext = &type_info;
+    if (vkCreateSemaphore(device, &semaphore_info, NULL, &upload_timeline) != VK_SUCCESS) {
+        printf("Failed to create semaphore\n");
         exit(1);
     }
-    vkBindBufferMemory(device, *buffer, *buffer_memory, 0);
+    upload_value = 0;
+    upload_batch = 0;
 }
 
-void create_vertex_buffer(VkBuffer* buffer, VkDeviceMemory* memory, Arena* arena) 
+void wait_upload(u64 value)
 {
-    VkDeviceSize buffer_size = arena->size;
-    VkBuffer staging_buffer;
-    VkDeviceMemory staging_buffer_memory;
-    create_buffer(buffer_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                  VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                  &staging_buffer, &staging_buffer_memory);
-    u8* data;
-    vkMapMemory(device, staging_buffer_memory, 0, buffer_size, 0, (void**) &data);
-    copy(arena, data);
-    dispose(arena);
-    vkUnmapMemory(device, staging_buffer_memory);
-    create_buffer(buffer_size,
+    VkSemaphoreWaitInfo wait_info{};
+    wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    wait_info.semaphoreCount = 1;
+    wait_info.pSemaphores = &upload_timeline;
+    wait_info.pValues = &value;
+    vkWaitSemaphores(device, &wait_info, UINT64_MAX);
+}
+
+// Frees the staging memory of finished batches, doesn't block
+void retire_uploads()
+{
+    u64 completed = 0;
+    vkGetSemaphoreCounterValue(device, upload_timeline, &completed);
+    for (u32 i = 0; i < MAX_UPLOAD_BATCHES; ++i) {
+        UploadBatch* batch = upload_batches + i;
+        if (batch->open || batch->value == 0 || batch->value > completed) {
+            continue;
+        }
+        for (u32 j = 0; j < batch->chunk_count; ++j) {
+            vkDestroyBuffer(device, batch->chunks[j].buffer, NULL);
+            gpu_free(&batch->chunks[j].memory);
+        }
+        batch->chunk_count = 0;
+        batch->value = 0;
+    }
+}
+
+// Opens a batch if there is none
+UploadBatch* get_upload_batch()
+{
+    UploadBatch* batch = upload_batches + upload_batch;
+    if (batch->open) {
+        return batch;
+    }
+
+    // Its command buffers may still be in use
+    if (batch->value != 0) {
+        wait_upload(batch->value);
+    }
+    retire_uploads();
+
+    VkCommandBufferBeginInfo begin_info{};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkResetCommandBuffer(batch->transfer_buffer, 0);
+    vkResetCommandBuffer(batch->graphics_buffer, 0);
+    vkBeginCommandBuffer(batch->transfer_buffer, &begin_info);
+    vkBeginCommandBuffer(batch->graphics_buffer, &begin_info);
+    batch->open = true;
+    return batch;
+}
+
+// Submits the open batch, the graphics queue waits for it before anything
+// submitted later. Returns the timeline value of the batch, 0 => none open
+u64 submit_uploads()
+{
+    UploadBatch* batch = upload_batches + upload_batch;
+    if (!batch->open) {
+        return 0;
+    }
+    vkEndCommandBuffer(batch->transfer_buffer);
+    vkEndCommandBuffer(batch->graphics_buffer);
+    u64 copied_value = ++upload_value;
+    u64 done_value = ++upload_value;
+
+    VkTimelineSemaphoreSubmitInfo transfer_timeline{};
+    transfer_timeline.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    transfer_timeline.signalSemaphoreValueCount = 1;
+    transfer_timeline.pSignalSemaphoreValues = &copied_value;
+    VkSubmitInfo submit_info{};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.pNext = &transfer_timeline;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &batch->transfer_buffer;
+    submit_info.signalSemaphoreCount = 1;
+    submit_info.pSignalSemaphores = &upload_timeline;
+    if (vkQueueSubmit(transfer_queue, 1, &submit_info, VK_NULL_HANDLE) != VK_SUCCESS) {
+        printf("Failed to submit upload command buffer\n");
+        exit(1);
+    }
+
+    VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    VkTimelineSemaphoreSubmitInfo graphics_timeline{};
+    graphics_timeline.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    graphics_timeline.waitSemaphoreValueCount = 1;
+    graphics_timeline.pWaitSemaphoreValues = &copied_value;
+    graphics_timeline.signalSemaphoreValueCount = 1;
+    graphics_timeline.pSignalSemaphoreValues = &done_value;
+    submit_info.pNext = &graphics_timeline;
+    submit_info.waitSemaphoreCount = 1;
+    submit_info.pWaitSemaphores = &upload_timeline;
+    submit_info.pWaitDstStageMask = &wait_stage;
+    submit_info.pCommandBuffers = &batch->graphics_buffer;
+    if (vkQueueSubmit(graphics_queue, 1, &submit_info, VK_NULL_HANDLE) != VK_SUCCESS) {
+        printf("Failed to submit upload command buffer\n");
+        exit(1);
+    }
+
+    batch->open = false;
+    batch->value = done_value;
+    upload_batch = (upload_batch + 1) % MAX_UPLOAD_BATCHES;
+    return done_value;
+}
+
+// Returns the staging memory to write size bytes to, offset is in buffer
+u8* reserve_staging(UploadBatch** batch, VkDeviceSize size, VkBuffer* buffer, VkDeviceSize* offset)
+{
+    UploadBatch* current = get_upload_batch();
+    StagingChunk* chunk = current->chunk_count > 0? 
+        current->chunks + current->chunk_count - 1 : NULL;
+    // Copies want 16 byte alignment at most, for block compressed formats
+    VkDeviceSize begin = chunk? (chunk->used + 15) & ~(VkDeviceSize) 15 : 0;
+    if (!chunk || begin + size > chunk->size) {
+        if (current->chunk_count == MAX_STAGING_CHUNKS) {
+            submit_uploads();
+            current = get_upload_batch();
+        }
+        chunk = current->chunks + current->chunk_count++;
+        chunk->size = size > STAGING_CHUNK_SIZE? size : STAGING_CHUNK_SIZE;
+        chunk->used = 0;
+        create_buffer(chunk->size,
+                      VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                      &chunk->buffer,
+                      &chunk->memory);
+        begin = 0;
+    }
+    chunk->used = begin + size;
+
+    *batch = current;
+    *buffer = chunk->buffer;
+    *offset = begin;
+    return chunk->memory.mapped + begin;
+}
+
+// Returns the memory to write the contents to before the batch gets
+// submitted. dst_stage and dst_access are the first use of the buffer
+u8* upload_buffer(VkBuffer dst, 
+                  VkDeviceSize size, 
+                  VkPipelineStageFlags dst_stage, 
+                  VkAccessFlags dst_access)
+{
+    UploadBatch* batch;
+    VkBuffer staging;
+    VkDeviceSize staging_offset;
+    u8* data = reserve_staging(&batch, size, &staging, &staging_offset);
+
+    VkBufferCopy copy_region{};
+    copy_region.srcOffset = staging_offset;
+    copy_region.dstOffset = 0;
+    copy_region.size = size;
+    vkCmdCopyBuffer(batch->transfer_buffer, staging, dst, 1, &copy_region);
+
+    VkBufferMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = dst_access;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = dst;
+    barrier.offset = 0;
+    barrier.size = size;
+    if (queue_indices.transfer != queue_indices.graphics) {
+        // Released here, acquired by the graphics side
+        barrier.srcQueueFamilyIndex = queue_indices.transfer;
+        barrier.dstQueueFamilyIndex = queue_indices.graphics;
+        barrier.dstAccessMask = 0;
+        vkCmdPipelineBarrier(batch->transfer_buffer, 
+                             VK_PIPELINE_STAGE_TRANSFER_BIT, 
+                             VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 
+                             0, 0, NULL, 1, &barrier, 0, NULL);
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = dst_access;
+    }
+    vkCmdPipelineBarrier(batch->graphics_buffer, 
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 
+                         dst_stage, 
+                         0, 0, NULL, 1, &barrier, 0, NULL);
+    return data;
+}
+
+// Leaves the image in SHADER_READ_ONLY_OPTIMAL for the fragment shader
+u8* upload_image(VkImage dst, u32 width, u32 height, VkDeviceSize size)
+{
+    UploadBatch* batch;
+    VkBuffer staging;
+    VkDeviceSize staging_offset;
+    u8* data = reserve_staging(&batch, size, &staging, &staging_offset);
+
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = dst;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseMipLevel = 0;
+    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = 1;
+    vkCmdPipelineBarrier(batch->transfer_buffer, 
+                         VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 
+                         0, 0, NULL, 0, NULL, 1, &barrier);
+
+    VkBufferImageCopy region{};
+    region.bufferOffset = staging_offset;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = 1;
+    region.imageOffset = {0, 0, 0};
+    region.imageExtent = { width, height, 1 };
+    vkCmdCopyBufferToImage(batch->transfer_buffer, staging, dst,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+    // The layout transition is part of the ownership transfer, both sides
+    // have to do the same one
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    if (queue_indices.transfer != queue_indices.graphics) {
+        barrier.srcQueueFamilyIndex = queue_indices.transfer;
+        barrier.dstQueueFamilyIndex = queue_indices.graphics;
+        barrier.dstAccessMask = 0;
+        vkCmdPipelineBarrier(batch->transfer_buffer, 
+                             VK_PIPELINE_STAGE_TRANSFER_BIT, 
+                             VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 
+                             0, 0, NULL, 0, NULL, 1, &barrier);
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    }
+    vkCmdPipelineBarrier(batch->graphics_buffer, 
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 
+                         0, 0, NULL, 0, NULL, 1, &barrier);
+    return data;
+}
+
+void destroy_upload_resources()
+{
+    for (u32 i = 0; i < MAX_UPLOAD_BATCHES; ++i) {
+        UploadBatch* batch = upload_batches + i;
+        for (u32 j = 0; j < batch->chunk_count; ++j) {
+            vkDestroyBuffer(device, batch->chunks[j].buffer, NULL);
+            gpu_free(&batch->chunks[j].memory);
+        }
+        batch->chunk_count = 0;
+    }
+    vkDestroySemaphore(device, upload_timeline, NULL);
+    vkDestroyCommandPool(device, transfer_pool, NULL);
+}
+
+void create_vertex_buffer(VkBuffer* buffer, GpuAllocation* memory, Arena* arena) 
+{
+    create_buffer(arena->size,
                   VK_BUFFER_USAGE_TRANSFER_DST_BIT |
                   VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
                   VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer, memory);
-    copy_buffer(staging_buffer, *buffer, buffer_size);
-    vkDestroyBuffer(device, staging_buffer, NULL);
-    vkFreeMemory(device, staging_buffer_memory, NULL);
-}
-
-void create_index_buffer(VkBuffer* buffer, VkDeviceMemory* memory, Arena* arena) 
-{
-    VkDeviceSize buffer_size = arena->size;
-    VkBuffer staging_buffer;
-    VkDeviceMemory staging_buffer_memory;
-    create_buffer(buffer_size, 
-                  VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                  VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                  &staging_buffer, &staging_buffer_memory);
-    u8* data;
-    vkMapMemory(device, staging_buffer_memory, 0, buffer_size, 0, (void**) &data);
+    u8* data = upload_buffer(*buffer, arena->size, 
+                             VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 
+                             VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
     copy(arena, data);
     dispose(arena);
-    vkUnmapMemory(device, staging_buffer_memory);
-    create_buffer(buffer_size,
+}
+
+void create_index_buffer(VkBuffer* buffer, GpuAllocation* memory, Arena* arena) 
+{
+    create_buffer(arena->size,
             VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer, memory);
-    copy_buffer(staging_buffer, *buffer, buffer_size);
-    vkDestroyBuffer(device, staging_buffer, NULL);
-    vkFreeMemory(device, staging_buffer_memory, NULL);
+    u8* data = upload_buffer(*buffer, arena->size, 
+                             VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 
+                             VK_ACCESS_INDEX_READ_BIT);
+    copy(arena, data);
+    dispose(arena);
+}
+
+// Positions of the static vertices for the depth prepass, has to be
+// created before the arena is handed to create_vertex_buffer
+void create_position_buffer(VkBuffer* buffer, GpuAllocation* memory, Arena* arena)
+{
+    u32 vertex_count = arena->size / sizeof(Vertex);
+    Vertex* vertices = (Vertex*) malloc(arena->size);
+    copy(arena, vertices);
+
+    u32 size = sizeof(float) * 3 * vertex_count;
+    create_buffer(size,
+                  VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                  VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer, memory);
+    float* data = (float*) upload_buffer(*buffer, size, 
+                                         VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 
+                                         VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
+    for (u32 i = 0; i < vertex_count; ++i) {
+        data[i * 3 + 0] = vertices[i].x;
+        data[i * 3 + 1] = vertices[i].y;
+        data[i * 3 + 2] = vertices[i].z;
+    }
+    free(vertices);
 }
 
 void upload_mesh_data()
 {
+    create_position_buffer(&position_buffer, &position_buffer_memory, vertex_arena);
     create_vertex_buffer(vertex_buffer, vertex_buffer_memory, vertex_arena);
     create_vertex_buffer(vertex_buffer + 1, vertex_buffer_memory + 1, vertex_arena + 1);
     create_index_buffer(index_buffer, index_buffer_memory, index_arena);
@@ -1132,65 +2711,223 @@ u32 get_align(u32 size, u32 min_align)
     return size;
 }
 
+void init_flush_ranges(FlushRanges* ranges, 
+                       GpuAllocation* allocation, 
+                       VkMemoryPropertyFlags properties)
+{
+    ranges->memory = allocation->memory;
+    ranges->offset = allocation->offset;
+    ranges->coherent = properties & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    ranges->count = 0;
+}
+
+// The region gets widened to nonCoherentAtomSize and merged with every
+// region it overlaps or touches
+void mark_dirty(FlushRanges* ranges, VkDeviceSize offset, VkDeviceSize size)
+{
+    if (ranges->coherent || size == 0) {
+        return;
+    }
+
+    offset += ranges->offset;
+    VkDeviceSize begin = offset / non_coherent_atom_size * non_coherent_atom_size;
+    VkDeviceSize end = get_align(offset + size, non_coherent_atom_size);
+
+    u32 first = 0;
+    while (first < ranges->count && ranges->end[first] < begin) {
+        first++;
+    }
+    u32 last = first;
+    while (last < ranges->count && ranges->begin[last] <= end) {
+        begin = ranges->begin[last] < begin? ranges->begin[last] : begin;
+        end = ranges->end[last] > end? ranges->end[last] : end;
+        last++;
+    }
+
+    if (first == last && ranges->count == MAX_FLUSH_RANGES) {
+        // Out of slots, flush more than needed instead
+        if (ranges->begin[0] < begin) {
+            begin = ranges->begin[0];
+        }
+        if (ranges->end[ranges->count - 1] > end) {
+            end = ranges->end[ranges->count - 1];
+        }
+        first = 0;
+        last = ranges->count;
+    }
+
+    // Replace [first, last) with the merged region
+    u32 removed = last - first;
+    if (removed == 0) {
+        for (u32 i = ranges->count; i > first; --i) {
+            ranges->begin[i] = ranges->begin[i - 1];
+            ranges->end[i] = ranges->end[i - 1];
+        }
+        ranges->count++;
+    } else {
+        for (u32 i = last; i < ranges->count; ++i) {
+            ranges->begin[i - removed + 1] = ranges->begin[i];
+            ranges->end[i - removed + 1] = ranges->end[i];
+        }
+        ranges->count -= removed - 1;
+    }
+    ranges->begin[first] = begin;
+    ranges->end[first] = end;
+}
+
+void flush_ranges(FlushRanges* ranges)
+{
+    if (ranges->count == 0) {
+        return;
+    }
+
+    VkMappedMemoryRange mapped_ranges[MAX_FLUSH_RANGES];
+    for (u32 i = 0; i < ranges->count; ++i) {
+        mapped_ranges[i] = VkMappedMemoryRange{};
+        mapped_ranges[i].sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+        mapped_ranges[i].memory = ranges->memory;
+        mapped_ranges[i].offset = ranges->begin[i];
+        mapped_ranges[i].size = ranges->end[i] - ranges->begin[i];
+    }
+    vkFlushMappedMemoryRanges(device, ranges->count, mapped_ranges);
+    ranges->count = 0;
+}
+
 void create_uniform_buffer() 
 {
     VkPhysicalDeviceProperties properties{};
     vkGetPhysicalDeviceProperties(physical_device, &properties);
-    u32 min_align = properties.limits.minUniformBufferOffsetAlignment;
     non_coherent_atom_size = properties.limits.nonCoherentAtomSize;
-
-    u32 size;
-    size = sizeof(GlobalUniform);
-    dynamic_align[0] = get_align(size, min_align);
-    size = sizeof(MaterialUniform);
-    dynamic_align[1] = get_align(size, min_align);
-    size = sizeof(ObjectUniform);
-    dynamic_align[2] = get_align(size, min_align);
+    uniform_alignment = properties.limits.minUniformBufferOffsetAlignment;
+    storage_alignment = properties.limits.minStorageBufferOffsetAlignment;
     bone_stride = sizeof(Bone);
 
-    material_offset = dynamic_align[0];
-    object_offset = material_offset + dynamic_align[1] * UNIFORM_BUF_MATERIAL;
-    bone_offset = object_offset + dynamic_align[2] * UNIFORM_BUF_OBJECT;
-    VkDeviceSize buffer_size = bone_offset + bone_stride * UNIFORM_BUF_BONE;
-    uniform_buffers.resize(max_frames_in_flight);
-    uniform_buffers_memory.resize(max_frames_in_flight);
-    uniform_buffers_mapped.resize(max_frames_in_flight);
+    // Fixed regions of every frame + slack for aligning each of them
+    u32 fixed_size = sizeof(GlobalUniform) + 
+        sizeof(InstanceData) * limits.max_instances * INSTANCE_COPIES + 
+        bone_stride * limits.max_bones +
+        sizeof(LightData) * limits.max_lights +
+        sizeof(VkDrawIndexedIndirectCommand) * limits.max_instances;
+    u32 slack = 5 * max(uniform_alignment, storage_alignment);
+    // Partitions start on an atom, so flushing one never touches the other
+    stream_partition_size = get_align(fixed_size + slack + STREAM_TRANSIENT_SIZE,
+                                      max(non_coherent_atom_size, 
+                                          max(uniform_alignment, storage_alignment)));
+    VkDeviceSize buffer_size = (VkDeviceSize) stream_partition_size * max_frames_in_flight;
+    create_buffer(buffer_size,
+                  VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                  VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
+                  VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                  UNIFORM_MEMORY_PROPERTIES,
+                  &stream_buffer,
+                  &stream_buffer_memory);
+    init_flush_ranges(&stream_flush, &stream_buffer_memory, UNIFORM_MEMORY_PROPERTIES);
+    stream_mapped = stream_buffer_memory.mapped;
+    frame_instances = (InstanceData*) malloc(sizeof(InstanceData) * limits.max_instances);
+
+    VkDeviceSize material_size = get_align(sizeof(MaterialUniform) * limits.max_materials,
+                                           non_coherent_atom_size);
+    create_buffer(material_size,
+                  VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                  UNIFORM_MEMORY_PROPERTIES,
+                  &material_buffer,
+                  &material_buffer_memory);
+    init_flush_ranges(&material_flush, &material_buffer_memory, UNIFORM_MEMORY_PROPERTIES);
+    material_buffer_mapped = material_buffer_memory.mapped;
+}
+
+void create_indirect_buffers()
+{
+    // A batch holds at least one instance
+    VkDeviceSize command_size = sizeof(VkDrawIndexedIndirectCommand) * limits.max_instances;
     for (u32 i = 0; i < max_frames_in_flight; ++i) {
-        create_buffer(buffer_size, 
-                      VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
-                      &uniform_buffers[i],
-                      &uniform_buffers_memory[i]);
-        vkMapMemory(device, 
-                    uniform_buffers_memory[i], 
-                    0, 
-                    buffer_size, 
-                    0, 
-                    &uniform_buffers_mapped[i]);
+        create_buffer(command_size,
+                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                      VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                      indirect_buffers + i,
+                      indirect_buffers_memory + i);
+    }
+}
+
+void create_cluster_buffers()
+{
+    for (u32 i = 0; i < max_frames_in_flight; ++i) {
+        create_buffer(sizeof(u32) * CLUSTER_STRIDE * CLUSTER_COUNT,
+                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                      cluster_buffers + i,
+                      cluster_buffers_memory + i);
+    }
+}
+
+void create_overdraw_queries()
+{
+    if (!overdraw_supported) {
+        return;
+    }
+    VkQueryPoolCreateInfo query_info{};
+    query_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    query_info.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+    query_info.queryCount = max_frames_in_flight;
+    query_info.pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+    if (vkCreateQueryPool(device, &query_info, NULL, &overdraw_queries) != VK_SUCCESS) {
+        printf("Failed to create overdraw query pool\n");
+        exit(1);
+    }
+}
+
+void create_timestamp_queries()
+{
+    if (!timing_supported) {
+        return;
+    }
+    VkQueryPoolCreateInfo query_info{};
+    query_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    query_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    query_info.queryCount = max_frames_in_flight * SHADOW_CASCADES * 2;
+    if (vkCreateQueryPool(device, &query_info, NULL, &shadow_queries) != VK_SUCCESS) {
+        printf("Failed to create shadow query pool\n");
+        exit(1);
+    }
+    query_info.queryCount = max_frames_in_flight * 2;
+    if (vkCreateQueryPool(device, &query_info, NULL, &frame_queries) != VK_SUCCESS) {
+        printf("Failed to create frame query pool\n");
+        exit(1);
     }
 }
 
 void create_descriptor_pool() 
 {
     VkDescriptorPoolSize pool_size{};
-    pool_size.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    pool_size.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    // global uniform of the draws and the cluster pass
     pool_size.descriptorCount = (u32) max_frames_in_flight * 2;
+    VkDescriptorPoolSize pool_size_storage{};
+    pool_size_storage.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    // materials, clusters + draw commands and counts of the cull pass +
+    // clusters of the cluster pass
+    pool_size_storage.descriptorCount = (u32) max_frames_in_flight * 5;
     VkDescriptorPoolSize pool_size_dynamic{};
-    pool_size_dynamic.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
-    pool_size_dynamic.descriptorCount = (u32) max_frames_in_flight * 2;
+    pool_size_dynamic.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+    // instances, bones, lights + the instances of the cull pass + the
+    // lights of the cluster pass
+    pool_size_dynamic.descriptorCount = (u32) max_frames_in_flight * 5;
     VkDescriptorPoolSize pool_size_sampler{};
     pool_size_sampler.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    pool_size_sampler.descriptorCount = (u32) max_frames_in_flight;
+    // shadow map + color, velocity and history of the taa resolve
+    pool_size_sampler.descriptorCount = (u32) max_frames_in_flight * 4;
     VkDescriptorPoolSize sizes[] = {
         pool_size,
+        pool_size_storage,
         pool_size_dynamic,
         pool_size_sampler,
     };
     VkDescriptorPoolCreateInfo pool_info{};
     pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    pool_info.poolSizeCount = 3;
+    pool_info.poolSizeCount = 4;
     pool_info.pPoolSizes = sizes;
-    pool_info.maxSets = (u32) max_frames_in_flight * UNIFORM_TYPES;
+    pool_info.maxSets = (u32) max_frames_in_flight * (UNIFORM_TYPES + 3);
     if (vkCreateDescriptorPool(device, 
                                &pool_info, 
                                NULL, 
@@ -1248,45 +2985,159 @@ void create_descriptor_sets()
         printf("Failed to allocate descriptor sets\n");
         exit(1);
     }
-    u32 prev_frame = max_frames_in_flight - 1;
     VkDescriptorBufferInfo buffer_info{};
-    VkWriteDescriptorSet writes[2];
+    VkDescriptorBufferInfo light_info{};
+    VkDescriptorBufferInfo cluster_info{};
+    VkDescriptorImageInfo shadow_info{};
+    shadow_info.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+    shadow_info.imageView = shadow_array_view;
+    shadow_info.sampler = shadow_sampler;
+    VkWriteDescriptorSet writes[4];
 
     for (u32 i = 0; i < max_frames_in_flight; ++i) {
-        VkBuffer buffer = uniform_buffers[i];
-        buffer_info = create_buffer_info(buffer, 0, sizeof(GlobalUniform));
-        VkDescriptorImageInfo image_info{};
-        image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-        image_info.imageView = render_image_views[prev_frame];
-        image_info.sampler = texture_sampler;
+        // Offsets into the stream buffer are passed when binding
+        buffer_info = create_buffer_info(stream_buffer, 0, sizeof(GlobalUniform));
         writes[0] = create_buffer_write(0 + i * UNIFORM_TYPES, &buffer_info, 
-                                        VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
+                                        VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
         writes[1] = VkWriteDescriptorSet{};
         writes[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
         writes[1].dstSet = descriptor_sets[0 + i * UNIFORM_TYPES];
-        writes[1].dstBinding = 1;
+        writes[1].dstBinding = 4;
         writes[1].dstArrayElement = 0;
         writes[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
         writes[1].descriptorCount = 1;
-        writes[1].pImageInfo = &image_info;
-        vkUpdateDescriptorSets(device, 2, writes, 0, NULL);
-
-        buffer_info = create_buffer_info(buffer, material_offset, sizeof(MaterialUniform));
+        writes[1].pImageInfo = &shadow_info;
+        light_info = create_buffer_info(stream_buffer, 0, sizeof(LightData) * limits.max_lights);
+        writes[2] = create_buffer_write(0 + i * UNIFORM_TYPES, &light_info, 
+                                        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC);
+        writes[2].dstBinding = 2;
+        cluster_info = create_buffer_info(cluster_buffers[i], 0, 
+                                          sizeof(u32) * CLUSTER_STRIDE * CLUSTER_COUNT);
+        writes[3] = create_buffer_write(0 + i * UNIFORM_TYPES, &cluster_info, 
+                                        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+        writes[3].dstBinding = 3;
+        vkUpdateDescriptorSets(device, 4, writes, 0, NULL);
+
+        buffer_info = create_buffer_info(material_buffer, 0, 
+                                         sizeof(MaterialUniform) * limits.max_materials);
         writes[0] = create_buffer_write(1 + i * UNIFORM_TYPES, &buffer_info, 
-                                        VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
+                                        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
         vkUpdateDescriptorSets(device, 1, writes, 0, NULL);
 
-        buffer_info = create_buffer_info(buffer, object_offset, sizeof(ObjectUniform));
+        buffer_info = create_buffer_info(stream_buffer, 0, sizeof(InstanceData) * 
+                                         limits.max_instances * INSTANCE_COPIES);
         writes[0] = create_buffer_write(2 + i * UNIFORM_TYPES, &buffer_info, 
-                                        VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
+                                        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC);
         vkUpdateDescriptorSets(device, 1, writes, 0, NULL);
 
-        buffer_info = create_buffer_info(buffer, bone_offset, bone_stride * UNIFORM_BUF_BONE);
-        writes[0] = create_buffer_write(3 + i * UNIFORM_TYPES, &buffer_info, 
-                                        VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
-        vkUpdateDescriptorSets(device, 1, writes, 0, NULL);
+        buffer_info = create_buffer_info(stream_buffer, 0, bone_stride * limits.max_bones);
+        writes[0] = create_buffer_write(3 + i * UNIFORM_TYPES, &buffer_info, 
+                                        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC);
+        vkUpdateDescriptorSets(device, 1, writes, 0, NULL);
+    }
+
+    VkDescriptorSetLayout cull_layouts[max_frames_in_flight];
+    for (u32 i = 0; i < max_frames_in_flight; ++i) {
+        cull_layouts[i] = cull_set_layout;
+    }
+    alloc_info.descriptorSetCount = (u32) max_frames_in_flight;
+    alloc_info.pSetLayouts = cull_layouts;
+    if (vkAllocateDescriptorSets(device, &alloc_info, 
+                                 cull_descriptor_sets) != VK_SUCCESS) {
+        printf("Failed to allocate cull descriptor sets\n");
+        exit(1);
+    }
+    for (u32 i = 0; i < max_frames_in_flight; ++i) {
+        VkDescriptorBufferInfo infos[2];
+        infos[0] = create_buffer_info(stream_buffer, 0, 
+                                      sizeof(InstanceData) * limits.max_instances * INSTANCE_COPIES);
+        infos[1] = create_buffer_info(indirect_buffers[i], 0, 
+                                      sizeof(VkDrawIndexedIndirectCommand) * limits.max_instances);
+        VkWriteDescriptorSet cull_writes[2];
+        for (u32 j = 0; j < 2; ++j) {
+            cull_writes[j] = VkWriteDescriptorSet{};
+            cull_writes[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            cull_writes[j].dstSet = cull_descriptor_sets[i];
+            cull_writes[j].dstBinding = j;
+            cull_writes[j].dstArrayElement = 0;
+            cull_writes[j].descriptorType = j == 0?
+                VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            cull_writes[j].descriptorCount = 1;
+            cull_writes[j].pBufferInfo = infos + j;
+        }
+        vkUpdateDescriptorSets(device, 2, cull_writes, 0, NULL);
+    }
+
+    VkDescriptorSetLayout cluster_layouts[max_frames_in_flight];
+    for (u32 i = 0; i < max_frames_in_flight; ++i) {
+        cluster_layouts[i] = cluster_set_layout;
+    }
+    alloc_info.pSetLayouts = cluster_layouts;
+    if (vkAllocateDescriptorSets(device, &alloc_info, 
+                                 cluster_descriptor_sets) != VK_SUCCESS) {
+        printf("Failed to allocate cluster descriptor sets\n");
+        exit(1);
+    }
+    for (u32 i = 0; i < max_frames_in_flight; ++i) {
+        VkDescriptorType types[] = {
+            VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        };
+        VkDescriptorBufferInfo infos[3];
+        infos[0] = create_buffer_info(stream_buffer, 0, sizeof(GlobalUniform));
+        infos[1] = create_buffer_info(stream_buffer, 0, sizeof(LightData) * limits.max_lights);
+        infos[2] = create_buffer_info(cluster_buffers[i], 0, 
+                                      sizeof(u32) * CLUSTER_STRIDE * CLUSTER_COUNT);
+        VkWriteDescriptorSet cluster_writes[3];
+        for (u32 j = 0; j < 3; ++j) {
+            cluster_writes[j] = VkWriteDescriptorSet{};
+            cluster_writes[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            cluster_writes[j].dstSet = cluster_descriptor_sets[i];
+            cluster_writes[j].dstBinding = j;
+            cluster_writes[j].dstArrayElement = 0;
+            cluster_writes[j].descriptorType = types[j];
+            cluster_writes[j].descriptorCount = 1;
+            cluster_writes[j].pBufferInfo = infos + j;
+        }
+        vkUpdateDescriptorSets(device, 3, cluster_writes, 0, NULL);
+    }
 
-        prev_frame = (prev_frame + 1) % max_frames_in_flight;
+    VkDescriptorSetLayout taa_layouts[max_frames_in_flight];
+    for (u32 i = 0; i < max_frames_in_flight; ++i) {
+        taa_layouts[i] = taa_set_layout;
+    }
+    alloc_info.pSetLayouts = taa_layouts;
+    if (vkAllocateDescriptorSets(device, &alloc_info, 
+                                 taa_descriptor_sets) != VK_SUCCESS) {
+        printf("Failed to allocate taa descriptor sets\n");
+        exit(1);
+    }
+    // The history is what the previous frame resolved
+    u32 prev_frame = max_frames_in_flight - 1;
+    for (u32 i = 0; i < max_frames_in_flight; ++i) {
+        VkImageView views[] = {
+            render_image_views[i],
+            velocity_image_views[i],
+            history_image_views[prev_frame],
+        };
+        VkDescriptorImageInfo infos[3];
+        VkWriteDescriptorSet taa_writes[3];
+        for (u32 j = 0; j < 3; ++j) {
+            infos[j].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+            infos[j].imageView = views[j];
+            infos[j].sampler = texture_sampler;
+            taa_writes[j] = VkWriteDescriptorSet{};
+            taa_writes[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            taa_writes[j].dstSet = taa_descriptor_sets[i];
+            taa_writes[j].dstBinding = j;
+            taa_writes[j].dstArrayElement = 0;
+            taa_writes[j].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+            taa_writes[j].descriptorCount = 1;
+            taa_writes[j].pImageInfo = infos + j;
+        }
+        vkUpdateDescriptorSets(device, 3, taa_writes, 0, NULL);
+        prev_frame = i;
     }
 }
 
@@ -1294,33 +3145,37 @@ void cleanup_swapchain()
 {
     vkDestroyImageView(device, depth_image_view, NULL);
     vkDestroyImage(device, depth_image, NULL);
-    vkFreeMemory(device, depth_image_memory, NULL);
+    gpu_free(&depth_image_memory);
     for (u32 i = 0; i < max_frames_in_flight; ++i) {
         vkDestroyFramebuffer(device, framebuffers[i], NULL);
         vkDestroyImageView(device, render_image_views[i], NULL);
         vkDestroyImage(device, render_images[i], NULL);
-        vkFreeMemory(device, render_image_memory[i], NULL);
+        gpu_free(&render_image_memory[i]);
+        vkDestroyImageView(device, velocity_image_views[i], NULL);
+        vkDestroyImage(device, velocity_images[i], NULL);
+        gpu_free(&velocity_image_memory[i]);
+        vkDestroyImageView(device, history_image_views[i], NULL);
+        vkDestroyImage(device, history_images[i], NULL);
+        gpu_free(&history_image_memory[i]);
+    }
+    for (VkFramebuffer framebuffer : taa_framebuffers) {
+        vkDestroyFramebuffer(device, framebuffer, NULL);
     }
     for (VkImageView image_view : swap_chain_image_views) {
         vkDestroyImageView(device, image_view, NULL);
     }
     vkDestroySwapchainKHR(device, swap_chain, NULL);
-    for (u32 i = 0; i < PIPELINE_COUNT; ++i ) {
-        vkDestroyPipeline(device, graphics_pipelines[i], NULL);
-        vkDestroyPipelineLayout(device, pipeline_layouts[i], NULL);
-    }
 }
 
 void create_depth_resources();
+void clear_history_images();
 
 void recreate_swap_chain(GLFWwindow* window) 
 {
-    i32 width = 0;
-    i32 height = 0;
-    glfwGetFramebufferSize(window, &width, &height);
-    while (width == 0 || height == 0) {
-        glfwGetFramebufferSize(window, &width, &height);
-        glfwWaitEvents();
+    // Minimized, try again once the window has a size
+    if (framebuffer_width == 0 || framebuffer_height == 0) {
+        frame_buffer_resized = 1;
+        return;
     }
     vkDeviceWaitIdle(device);
     cleanup_swapchain();
@@ -1328,23 +3183,27 @@ void recreate_swap_chain(GLFWwindow* window)
     create_render_images();
     create_image_views();
     create_depth_resources();
+    clear_history_images();
     create_framebuffers();
-    create_pipelines();
 
     vkDestroyDescriptorPool(device, descriptor_pool, NULL);
     create_descriptor_pool();
     create_descriptor_sets();
+    submit_uploads();
 }
 
 void create_command_buffers() 
 {
     command_buffers.resize(max_frames_in_flight);
+    taa_command_buffers.resize(max_frames_in_flight);
     VkCommandBufferAllocateInfo alloc_info{};
     alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
     alloc_info.commandPool = command_pool;
     alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
     alloc_info.commandBufferCount = (u32) command_buffers.size();
     if (vkAllocateCommandBuffers(device, &alloc_info, command_buffers.data()) !=
+        VK_SUCCESS ||
+        vkAllocateCommandBuffers(device, &alloc_info, taa_command_buffers.data()) !=
         VK_SUCCESS) {
         printf("Failed to allocate command buffers\n");
         exit(1);
@@ -1384,7 +3243,8 @@ void transition_image_layout(VkImage image,
                              VkImageLayout old_layout, 
                              VkImageLayout new_layout)
 {
-    VkCommandBuffer cmd_buffer = begin_single_time_commands();
+    // Ordered before everything submitted on the graphics queue afterwards
+    VkCommandBuffer cmd_buffer = get_upload_batch()->graphics_buffer;
     VkImageMemoryBarrier barrier{};
     barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
     barrier.oldLayout = old_layout;
@@ -1431,13 +3291,12 @@ void transition_image_layout(VkImage image,
     }
     vkCmdPipelineBarrier(cmd_buffer, source_stage, destination_stage, 0,
                          0, NULL, 0, NULL, 1, &barrier);
-    end_single_time_commands(cmd_buffer);
 }
 
 void create_depth_resources()
 {
     VkFormat depth_format = find_depth_format();
-    create_image(swap_chain_extent.width, swap_chain_extent.height,
+    create_image(swap_chain_extent.width, swap_chain_extent.height, 1,
                  VK_SAMPLE_COUNT_1_BIT, depth_format,
                  VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
@@ -1449,25 +3308,156 @@ void create_depth_resources()
                             VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
 }
 
-void copy_buffer_to_image(VkBuffer buffer, 
-                          VkImage image, 
-                          u32 width, 
-                          u32 height) 
+// The first frame after creating them samples the history of the
+// previous frame, which was never written. history_valid discards it, but
+// it has to be in the layout the taa pass samples it in
+void clear_history_images()
 {
-    VkCommandBuffer cmd_buffer = begin_single_time_commands();
-    VkBufferImageCopy region{};
-    region.bufferOffset = 0;
-    region.bufferRowLength = 0;
-    region.bufferImageHeight = 0;
-    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    region.imageSubresource.mipLevel = 0;
-    region.imageSubresource.baseArrayLayer = 0;
-    region.imageSubresource.layerCount = 1;
-    region.imageOffset = {0, 0, 0};
-    region.imageExtent = { width, height, 1 };
-    vkCmdCopyBufferToImage(cmd_buffer, buffer, image,
-                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-    end_single_time_commands(cmd_buffer);
+    VkCommandBuffer cmd_buffer = get_upload_batch()->graphics_buffer;
+    VkClearColorValue clear_color{};
+    VkImageSubresourceRange range{};
+    range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    range.baseMipLevel = 0;
+    range.levelCount = 1;
+    range.baseArrayLayer = 0;
+    range.layerCount = 1;
+    for (u32 i = 0; i < max_frames_in_flight; ++i) {
+        transition_image_layout(history_images[i], render_image_format,
+                                VK_IMAGE_LAYOUT_UNDEFINED,
+                                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+        vkCmdClearColorImage(cmd_buffer, history_images[i],
+                             VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clear_color, 1, &range);
+        transition_image_layout(history_images[i], render_image_format,
+                                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    }
+}
+
+void create_shadow_render_pass()
+{
+    VkAttachmentDescription depth_attachment{};
+    depth_attachment.format = shadow_format;
+    depth_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    depth_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    depth_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depth_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    depth_attachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+    VkAttachmentReference depth_attachment_ref{};
+    depth_attachment_ref.attachment = 0;
+    depth_attachment_ref.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    VkSubpassDescription subpass{};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.colorAttachmentCount = 0;
+    subpass.pDepthStencilAttachment = &depth_attachment_ref;
+    VkSubpassDependency dependencies[2]{};
+    // The previous frame may still sample the map
+    dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+    dependencies[0].dstSubpass = 0;
+    dependencies[0].srcStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    dependencies[0].srcAccessMask = 0;
+    dependencies[0].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+                                VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    dependencies[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                                VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    dependencies[1].srcSubpass = 0;
+    dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+    dependencies[1].srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    dependencies[1].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    dependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    VkRenderPassCreateInfo render_pass_info{};
+    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    render_pass_info.attachmentCount = 1;
+    render_pass_info.pAttachments = &depth_attachment;
+    render_pass_info.subpassCount = 1;
+    render_pass_info.pSubpasses = &subpass;
+    render_pass_info.dependencyCount = 2;
+    render_pass_info.pDependencies = dependencies;
+    if (vkCreateRenderPass(device, &render_pass_info, NULL, &shadow_render_pass) !=
+        VK_SUCCESS) {
+        printf("Failed to create shadow render pass\n");
+        exit(1);
+    }
+}
+
+// One layer per cascade, each rendered through its own framebuffer. Doesn't
+// depend on the swap chain
+void create_shadow_resources()
+{
+    VkFormat formats[] = {
+        VK_FORMAT_D32_SFLOAT,
+        VK_FORMAT_D16_UNORM,
+    };
+    shadow_format = find_supported_format(formats, 2, VK_IMAGE_TILING_OPTIMAL,
+                                          VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT |
+                                          VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT |
+                                          VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT);
+    create_image(SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, SHADOW_CASCADES,
+                 VK_SAMPLE_COUNT_1_BIT, shadow_format,
+                 VK_IMAGE_TILING_OPTIMAL, 
+                 VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 &shadow_image, &shadow_image_memory);
+    shadow_array_view = create_layer_view(shadow_image, shadow_format, VK_IMAGE_ASPECT_DEPTH_BIT,
+                                          VK_IMAGE_VIEW_TYPE_2D_ARRAY, 0, SHADOW_CASCADES);
+    create_shadow_render_pass();
+    for (u32 i = 0; i < SHADOW_CASCADES; ++i) {
+        shadow_layer_views[i] = create_layer_view(shadow_image, shadow_format, 
+                                                  VK_IMAGE_ASPECT_DEPTH_BIT,
+                                                  VK_IMAGE_VIEW_TYPE_2D, i, 1);
+        VkFramebufferCreateInfo framebuffer_info{};
+        framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        framebuffer_info.renderPass = shadow_render_pass;
+        framebuffer_info.attachmentCount = 1;
+        framebuffer_info.pAttachments = shadow_layer_views + i;
+        framebuffer_info.width = SHADOW_MAP_SIZE;
+        framebuffer_info.height = SHADOW_MAP_SIZE;
+        framebuffer_info.layers = 1;
+        if (vkCreateFramebuffer(device, &framebuffer_info, NULL, 
+                                shadow_framebuffers + i) != VK_SUCCESS) {
+            printf("Failed to create shadow framebuffer\n");
+            exit(1);
+        }
+    }
+
+    // Compares against the stored depth, filtering blends the results of
+    // the 4 nearest texels. Outside of the map nothing is shadowed
+    VkSamplerCreateInfo sampler_info{};
+    sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    sampler_info.magFilter = VK_FILTER_LINEAR;
+    sampler_info.minFilter = VK_FILTER_LINEAR;
+    sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+    sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+    sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+    sampler_info.anisotropyEnable = VK_FALSE;
+    sampler_info.maxAnisotropy = 1.0f;
+    sampler_info.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
+    sampler_info.unnormalizedCoordinates = VK_FALSE;
+    sampler_info.compareEnable = VK_TRUE;
+    sampler_info.compareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+    sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    sampler_info.mipLodBias = 0.0f;
+    sampler_info.minLod = 0.0f;
+    sampler_info.maxLod = 0.0f;
+    if (vkCreateSampler(device, &sampler_info, NULL, &shadow_sampler) != VK_SUCCESS) {
+        printf("Failed to create shadow sampler\n");
+        exit(1);
+    }
+}
+
+void destroy_shadow_resources()
+{
+    vkDestroySampler(device, shadow_sampler, NULL);
+    for (u32 i = 0; i < SHADOW_CASCADES; ++i) {
+        vkDestroyFramebuffer(device, shadow_framebuffers[i], NULL);
+        vkDestroyImageView(device, shadow_layer_views[i], NULL);
+    }
+    vkDestroyRenderPass(device, shadow_render_pass, NULL);
+    vkDestroyImageView(device, shadow_array_view, NULL);
+    vkDestroyImage(device, shadow_image, NULL);
+    gpu_free(&shadow_image_memory);
 }
 
 void create_texture_image()
@@ -1485,265 +3475,884 @@ void create_texture_image()
         printf("Failed to load texture image: %s\n", path_buffer);
         exit(1);
     }
-    VkBuffer staging_buffer;
-    VkDeviceMemory staging_buffer_memory;
-    create_buffer(image_size, 
-                  VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 
-                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | 
-                  VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 
-                  &staging_buffer, &staging_buffer_memory);
-    void* data = NULL;
-    vkMapMemory(device, staging_buffer_memory, 0, image_size, 0, &data);
-    memcpy(data, pixels, image_size);
-    vkUnmapMemory(device, staging_buffer_memory);
-    stbi_image_free(pixels);
-    create_image(tex_width, tex_height, 
+    create_image(tex_width, tex_height, 1,
                  VK_SAMPLE_COUNT_1_BIT,
                  VK_FORMAT_R8G8B8A8_SRGB, 
                  VK_IMAGE_TILING_OPTIMAL, 
                  VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, 
                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 
                  &texture_image, &texture_image_memory);
-    transition_image_layout(texture_image, 
-                            VK_FORMAT_R8G8B8A8_SRGB, 
-                            VK_IMAGE_LAYOUT_UNDEFINED, 
-                            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-    copy_buffer_to_image(staging_buffer, texture_image, tex_width, tex_height);
-    transition_image_layout(texture_image, 
-                            VK_FORMAT_R8G8B8A8_SRGB, 
-                            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 
-                            VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-    vkDestroyBuffer(device, staging_buffer, NULL);
-    vkFreeMemory(device, staging_buffer_memory, NULL);
+    u8* data = upload_image(texture_image, tex_width, tex_height, image_size);
+    memcpy(data, pixels, image_size);
+    stbi_image_free(pixels);
+}
+
+
+void create_texture_image_view()
+{
+    texture_image_view = create_image_view(texture_image, 
+                                           VK_FORMAT_R8G8B8A8_SRGB,
+                                           VK_IMAGE_ASPECT_COLOR_BIT);
+}
+
+void create_texture_sampler()
+{
+    VkSamplerCreateInfo sampler_info{};
+    sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    sampler_info.magFilter = VK_FILTER_LINEAR;
+    sampler_info.minFilter = VK_FILTER_LINEAR;
+    sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.anisotropyEnable = VK_TRUE;
+    VkPhysicalDeviceProperties properties{};
+    vkGetPhysicalDeviceProperties(physical_device, &properties);
+    sampler_info.maxAnisotropy = properties.limits.maxSamplerAnisotropy;
+    sampler_info.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
+    sampler_info.unnormalizedCoordinates = VK_FALSE;
+    sampler_info.compareEnable = VK_FALSE;
+    sampler_info.compareOp = VK_COMPARE_OP_ALWAYS;
+    sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+    sampler_info.mipLodBias = 0.0f;
+    sampler_info.minLod = 0.0f;
+    sampler_info.maxLod = 0.0f;
+    if (vkCreateSampler(device, &sampler_info, NULL, &texture_sampler) != VK_SUCCESS) {
+        printf("Failed to create texture sampler\n");
+        exit(1);
+    }
+}
+
+void init_vulkan(GLFWwindow* window, RenderLimits render_limits, MaterialLibrary* library) 
+{
+    current_frame = 0;
+    // Descriptors can't cover empty ranges
+    limits.max_instances = max(render_limits.max_instances, 1);
+    limits.max_materials = max(max(render_limits.max_materials, library->material_count), 1);
+    // Every pose is uploaded together with the one of the last frame
+    limits.max_bones = max(render_limits.max_bones * 2, 1);
+    limits.max_lights = max(render_limits.max_lights, 1);
+    init_queue(&render_queue, &pool);
+    glfwGetFramebufferSize(window, &framebuffer_width, &framebuffer_height);
+
+    create_instance();
+    create_surface(window);
+    pick_physical_device(&physical_device);
+    create_logical_device();
+    init_gpu_memory(physical_device, device);
+    create_swap_chain(window);
+    create_render_images();
+    create_image_views();
+    create_render_pass();
+    create_taa_render_pass();
+    create_shadow_resources();
+    create_descriptor_set_layouts();
+    create_pipeline_cache();
+    double pipeline_start = glfwGetTime();
+    create_pipelines(library);
+    create_compute_pipelines();
+    create_fullscreen_pipelines();
+    create_overdraw_queries();
+    create_timestamp_queries();
+    float pipeline_ms = (glfwGetTime() - pipeline_start) * 1000.0;
+    if (pipeline_cold_ms > 0) {
+        printf("Created pipelines in %.1f ms, the cache saved %.1f ms\n", 
+               pipeline_ms, pipeline_cold_ms - pipeline_ms);
+    } else {
+        printf("Created pipelines in %.1f ms without a cache\n", pipeline_ms);
+        pipeline_cold_ms = pipeline_ms;
+    }
+    create_command_pool();
+    create_upload_resources();
+    create_record_pools();
+    create_depth_resources();
+    clear_history_images();
+    create_framebuffers();
+    // ENSURE(create_texture_image(), 20);
+    // create_texture_image_view();
+    create_texture_sampler();
+    upload_mesh_data();
+    create_uniform_buffer();
+    create_indirect_buffers();
+    create_cluster_buffers();
+    create_descriptor_pool();
+    create_descriptor_sets();
+    create_command_buffers();
+    create_sync_objects();
+    submit_uploads();
+    print_gpu_memory_stats();
+}
+
+// Hands out memory of the current frames partition. Thread safe, the
+// memory stays valid until the frame finished on the gpu
+StreamAllocation stream_alloc(u32 size, u32 alignment)
+{
+    u32 head = stream_head;
+    u32 offset;
+    do {
+        offset = (head + alignment - 1) / alignment * alignment;
+        assert(offset + size <= stream_end);
+    } while (!stream_head.compare_exchange_weak(head, offset + size));
+
+    StreamAllocation allocation;
+    allocation.buffer = stream_buffer;
+    allocation.offset = offset;
+    allocation.memory = stream_mapped + offset;
+    return allocation;
+}
+
+u32 get_stream_alignment(VkBufferUsageFlags usage)
+{
+    u32 alignment = 4;
+    if (usage & VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT) {
+        alignment = max(alignment, uniform_alignment);
+    }
+    if (usage & VK_BUFFER_USAGE_STORAGE_BUFFER_BIT) {
+        alignment = max(alignment, storage_alignment);
+    }
+    return alignment;
+}
+
+// The allocations are packed, the used part of the partition is flushed
+// as a whole
+void flush_stream()
+{
+    u32 begin = current_frame * stream_partition_size;
+    mark_dirty(&stream_flush, begin, stream_head - begin);
+    flush_ranges(&stream_flush);
+}
+
+u32 alloc_instance(glm::mat4* model, 
+                   glm::mat4* prev_mvp, 
+                   Model* mesh, 
+                   Bounds bounds,
+                   u32 material, 
+                   u32 bones,
+                   u32 prev_bones,
+                   u32 pipeline) 
+{
+    u32 slot = uniform_instance_alloc++;
+    assert(slot < limits.max_instances);
+    glm::vec3 center = (bounds.min + bounds.max) * 0.5f;
+
+    InstanceData instance{};
+    instance.model = *model;
+    instance.prev_mvp = *prev_mvp;
+    instance.bounds = glm::vec4(center, glm::length(bounds.max - center));
+    instance.material = material;
+    instance.bone_offset = bones;
+    instance.prev_bone_offset = prev_bones;
+    instance.index_count = mesh->index_count;
+    instance.first_index = mesh->index_offset;
+    instance.vertex_offset = mesh->vertex_offset;
+    instance.pipeline = pipeline;
+    frame_instances[slot] = instance;
+    return slot;
+}
+
+// Copies the instances into the order of the built render queue, once per
+// message. Flushed as a whole in flush_stream
+void upload_instances()
+{
+    assert(render_queue.message_count <= limits.max_instances * INSTANCE_COPIES);
+    InstanceData* dst = (InstanceData*) (stream_mapped + instance_offset);
+    for (u32 i = 0; i < render_queue.message_count; ++i) {
+        Message* message = render_queue.messages + i;
+        memcpy(dst + i, frame_instances + message->uniform_slot, sizeof(InstanceData));
+        message->uniform_slot = i;
+    }
+    if (!frame_gpu_driven) {
+        return;
+    }
+
+    // One command per opaque batch, cull.comp counts the visible instances
+    // and compacts them to first_instance. The compaction doesn't keep their
+    // order, so the blended batches are still culled and drawn by the cpu
+    u32 opaque_instances = render_queue.queue_messages[QUEUE_TRANSPARENT] - 
+        render_queue.queue_messages[QUEUE_OPAQUE];
+    u32 first_batch = render_queue.queue_batches[QUEUE_OPAQUE];
+    u32 opaque_batches = render_queue.queue_batches[QUEUE_TRANSPARENT] - first_batch;
+    assert(render_queue.message_count + opaque_instances <= limits.max_instances * INSTANCE_COPIES);
+    StreamAllocation commands = stream_alloc(sizeof(VkDrawIndexedIndirectCommand) * opaque_batches, 
+                                             sizeof(u32));
+    command_offset = commands.offset;
+    VkDrawIndexedIndirectCommand* command = (VkDrawIndexedIndirectCommand*) commands.memory;
+    for (u32 i = 0; i < opaque_batches; ++i) {
+        Batch* batch = render_queue.batches + first_batch + i;
+        command[i].indexCount = batch->index_count;
+        command[i].instanceCount = 0;
+        command[i].firstIndex = batch->index_offset;
+        command[i].vertexOffset = batch->vertex_offset;
+        command[i].firstInstance = render_queue.message_count + batch->first_instance;
+        for (u32 j = 0; j < batch->instance_count; ++j) {
+            dst[batch->first_instance + j].command = i;
+        }
+    }
+}
+
+// The previous pose follows the current one
+u32 alloc_bone_uniform(Bone* bones, Bone* prev_bones, u32 bone_count)
+{
+    u32 offset = uniform_bone_alloc.fetch_add(bone_count * 2);
+    assert(offset + bone_count * 2 <= limits.max_bones);
+
+    u32 byte_offset = bone_offset + bone_stride * offset;
+    memcpy(stream_mapped + byte_offset, bones, bone_count * bone_stride);
+    memcpy(stream_mapped + byte_offset + bone_count * bone_stride, 
+           prev_bones, bone_count * bone_stride);
+
+    return offset;
+}
+
+void init_materials(MaterialLibrary* library)
+{
+    MaterialUniform* materials = (MaterialUniform*) material_buffer_mapped;
+    for (u32 i = 0; i < library->material_count; ++i) {
+        MaterialDesc* desc = library->materials + i;
+        materials[i].roughness = desc->roughness;
+        materials[i].smoothness = desc->smoothness;
+        materials[i].specular = desc->specular;
+        materials[i].diffuse = desc->diffuse;
+    }
+    mark_dirty(&material_flush, 0, sizeof(MaterialUniform) * library->material_count);
+    flush_ranges(&material_flush);
+}
+
+float get_depth(u32 slot)
+{
+    return glm::length(glm::vec3(frame_instances[slot].bounds) - camera_position);
+}
+
+// Blended pipelines are drawn back to front after everything opaque
+u32 get_material_pipeline(u32 material, u32 layout, u32* queue)
+{
+    assert(material < material_count);
+    i32 pipeline = material_pipelines[material][layout];
+    assert(pipeline >= 0);
+    *queue = pipeline_keys[pipeline].blend == BLEND_OPAQUE? QUEUE_OPAQUE : QUEUE_TRANSPARENT;
+    return pipeline;
+}
+
+// Into the queue of the view if it sees the instance, and into the shadow
+// queue of every cascade it touches if its pipeline casts shadows. All
+// messages share the slot, upload_instances copies it for each of them
+void push_instance(u32 slot, 
+                   Bounds* bounds, 
+                   Model* model, 
+                   u32 material, 
+                   u32 bones, 
+                   u32 pipeline, 
+                   u32 queue)
+{
+    Message message;
+    message.pipeline = pipeline;
+    message.uniform_slot = slot;
+    message.material = material;
+    message.vertex_offset = model->vertex_offset;
+    message.index_count = model->index_count;
+    message.index_offset = model->index_offset;
+    message.bone_offset = bones;
+    float depth = get_depth(slot);
+
+    // The gpu driven path culls the opaque instances of the view in cull.comp
+    if ((frame_gpu_driven && queue == QUEUE_OPAQUE) || frustum_intersects(&frustum, bounds)) {
+        message.sort_key = make_sort_key(queue, pipeline, model->id, material, depth);
+        *push_message(&render_queue, queue) = message;
+    }
+    if (shadow_pipelines[pipeline] == VK_NULL_HANDLE) {
+        return;
+    }
+    for (u32 i = 0; i < SHADOW_CASCADES; ++i) {
+        if (frustum_intersects(shadow_frustums + i, bounds)) {
+            u32 shadow_queue = QUEUE_SHADOW + i;
+            message.sort_key = make_sort_key(shadow_queue, pipeline, model->id, material, depth);
+            *push_message(&render_queue, shadow_queue) = message;
+        }
+    }
+}
+
+void draw_object(glm::mat4* transform, glm::mat4* prev_mvp, Model* model, u32 material)
+{
+    u32 queue;
+    u32 pipeline = get_material_pipeline(material, VERTEX_LAYOUT_STATIC, &queue);
+    Bounds bounds = transform_bounds(model->bounds, transform);
+    u32 slot = alloc_instance(transform, prev_mvp, model, bounds, material, 0, 0, pipeline);
+    push_instance(slot, &bounds, model, material, 0, pipeline, queue);
+}
+
+void draw_rigged(glm::mat4* transform, 
+                 glm::mat4* prev_mvp, 
+                 Model* model, 
+                 u32 material, 
+                 Bone* pose, 
+                 Bone* prev_pose, 
+                 u32 bone_count)
+{
+    u32 queue;
+    u32 pipeline = get_material_pipeline(material, VERTEX_LAYOUT_SKINNED, &queue);
+    u32 bones = alloc_bone_uniform(pose, prev_pose, bone_count);
+    Bounds bounds = transform_bounds(model->bounds, transform);
+    u32 slot = alloc_instance(transform, prev_mvp, model, bounds, material, 
+                              bones, bones + bone_count, pipeline);
+    push_instance(slot, &bounds, model, material, bones, pipeline, queue);
+}
+
+void draw_lights(Light* lights, u32 count)
+{
+    u32 first = light_alloc.fetch_add(count);
+    assert(first + count <= limits.max_lights);
+
+    LightData* dst = (LightData*) (stream_mapped + light_offset) + first;
+    for (u32 i = 0; i < count; ++i) {
+        Light* light = lights + i;
+        dst[i].position = glm::vec4(light->position, light->range);
+        dst[i].color = glm::vec4(light->color, (float) light->type);
+        dst[i].direction = glm::vec4(light->direction, light->cos_outer);
+        dst[i].params = glm::vec4(light->cos_inner, 0.0f, 0.0f, 0.0f);
+    }
+}
+
+void set_depth_prepass(bool enabled)
+{
+    depth_prepass_requested = enabled;
+}
+
+void set_overdraw_measurement(bool enabled)
+{
+    if (enabled && !overdraw_supported) {
+        printf("Overdraw measurement needs pipelineStatisticsQuery\n");
+    }
+    overdraw_enabled = enabled && overdraw_supported;
+}
+
+void set_taa(bool enabled)
+{
+    taa_enabled = enabled;
+}
+
+// Expects the fence of the frame to have passed
+void read_overdraw()
+{
+    if (!overdraw_written[current_frame]) {
+        return;
+    }
+    overdraw_written[current_frame] = false;
+    u64 invocations = 0;
+    VkResult result = vkGetQueryPoolResults(device, overdraw_queries, current_frame, 1,
+                                            sizeof(u64), &invocations, sizeof(u64),
+                                            VK_QUERY_RESULT_64_BIT);
+    if (result == VK_SUCCESS) {
+        u32 pixels = render_extent.width * render_extent.height;
+        overdraw = (float) invocations / (float) max(pixels, 1);
+    }
+}
+
+// Expects the fence of the frame to have passed
+void read_shadow_timings()
+{
+    if (!shadow_timing_written[current_frame]) {
+        return;
+    }
+    shadow_timing_written[current_frame] = false;
+    u64 timestamps[SHADOW_CASCADES * 2];
+    VkResult result = vkGetQueryPoolResults(device, shadow_queries, 
+                                            current_frame * SHADOW_CASCADES * 2, 
+                                            SHADOW_CASCADES * 2, sizeof(timestamps), 
+                                            timestamps, sizeof(u64), VK_QUERY_RESULT_64_BIT);
+    if (result == VK_SUCCESS) {
+        for (u32 i = 0; i < SHADOW_CASCADES; ++i) {
+            u64 ticks = timestamps[i * 2 + 1] - timestamps[i * 2];
+            shadow_ms[i] = (float) ((double) ticks * timestamp_period / 1000000.0);
+        }
+    }
 }
 
-
-void create_texture_image_view()
+// Expects the fence of the frame to have passed
+void read_frame_timing()
 {
-    texture_image_view = create_image_view(texture_image, 
-                                           VK_FORMAT_R8G8B8A8_SRGB,
-                                           VK_IMAGE_ASPECT_COLOR_BIT);
+    if (!frame_timing_written[current_frame]) {
+        return;
+    }
+    frame_timing_written[current_frame] = false;
+    u64 timestamps[2];
+    VkResult result = vkGetQueryPoolResults(device, frame_queries, current_frame * 2, 2,
+                                            sizeof(timestamps), timestamps, sizeof(u64),
+                                            VK_QUERY_RESULT_64_BIT);
+    if (result == VK_SUCCESS) {
+        u64 ticks = timestamps[1] - timestamps[0];
+        gpu_frame_ms = (float) ((double) ticks * timestamp_period / 1000000.0);
+    }
 }
 
-void create_texture_sampler()
+// The cost of the main pass grows with the area, the scale moves a share
+// of the way to the one that would have met the budget. The shadow maps
+// have a fixed size, their time is taken off before scaling
+void update_render_scale()
 {
-    VkSamplerCreateInfo sampler_info{};
-    sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
-    sampler_info.magFilter = VK_FILTER_LINEAR;
-    sampler_info.minFilter = VK_FILTER_LINEAR;
-    sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
-    sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
-    sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
-    sampler_info.anisotropyEnable = VK_TRUE;
-    VkPhysicalDeviceProperties properties{};
-    vkGetPhysicalDeviceProperties(physical_device, &properties);
-    sampler_info.maxAnisotropy = properties.limits.maxSamplerAnisotropy;
-    sampler_info.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
-    sampler_info.unnormalizedCoordinates = VK_FALSE;
-    sampler_info.compareEnable = VK_FALSE;
-    sampler_info.compareOp = VK_COMPARE_OP_ALWAYS;
-    sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
-    sampler_info.mipLodBias = 0.0f;
-    sampler_info.minLod = 0.0f;
-    sampler_info.maxLod = 0.0f;
-    if (vkCreateSampler(device, &sampler_info, NULL, &texture_sampler) != VK_SUCCESS) {
-        printf("Failed to create texture sampler\n");
-        exit(1);
+    float shadow_total_ms = 0.0f;
+    for (u32 i = 0; i < SHADOW_CASCADES; ++i) {
+        shadow_total_ms += shadow_ms[i];
+    }
+    float main_ms = gpu_frame_ms - shadow_total_ms;
+    float main_budget_ms = TARGET_FRAME_MS * FRAME_BUDGET - shadow_total_ms;
+    if (!dynamic_resolution) {
+        render_scale = 1.0f;
+    } else if (gpu_frame_ms > 0.0f && main_ms > 0.0f) {
+        float wanted = RENDER_SCALE_MIN;
+        if (main_budget_ms > 0.0f) {
+            wanted = render_scale * sqrtf(main_budget_ms / main_ms);
+        }
+        render_scale += (wanted - render_scale) * RENDER_SCALE_RATE;
+        render_scale = fminf(fmaxf(render_scale, RENDER_SCALE_MIN), 1.0f);
     }
+    render_extent.width = max((u32) (swap_chain_extent.width * render_scale), 1);
+    render_extent.height = max((u32) (swap_chain_extent.height * render_scale), 1);
 }
 
-void init_vulkan(GLFWwindow* window) 
+void set_dynamic_resolution(bool enabled)
 {
-    current_frame = 0;
-
-    create_instance();
-    create_surface(window);
-    pick_physical_device(&physical_device);
-    create_logical_device();
-    create_swap_chain(window);
-    create_render_images();
-    create_image_views();
-    create_render_pass();
-    create_descriptor_set_layouts();
-    create_pipelines();
-    create_command_pool();
-    create_depth_resources();
-    create_framebuffers();
-    // ENSURE(create_texture_image(), 20);
-    // create_texture_image_view();
-    create_texture_sampler();
-    upload_mesh_data();
-    create_uniform_buffer();
-    create_descriptor_pool();
-    create_descriptor_sets();
-    create_command_buffers();
-    create_sync_objects();
+    if (enabled && !timing_supported) {
+        printf("Dynamic resolution needs timestampComputeAndGraphics\n");
+    }
+    dynamic_resolution = enabled;
 }
 
-void flush_uniform_buffer()
+void set_gpu_driven(bool enabled)
 {
-    // flush bones
-    VkMappedMemoryRange range{};
-    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
-    range.pNext = NULL;
-    range.memory = uniform_buffers_memory[current_frame];
-    range.offset = bone_offset;
-    range.size = get_align(bone_stride * uniform_bone_alloc, non_coherent_atom_size);
-    ranges[range_count] = range;
-    ++range_count;
+    gpu_driven = enabled && gpu_driven_supported;
+    printf("GPU driven rendering: %s\n", gpu_driven? "on" : "off");
+}
 
-    vkFlushMappedMemoryRanges(device, range_count, ranges);
-    range_count = 0;
+void set_framebuffer_size(i32 width, i32 height)
+{
+    if (width != framebuffer_width || height != framebuffer_height) {
+        framebuffer_width = width;
+        framebuffer_height = height;
+        frame_buffer_resized = 1;
+    }
 }
 
-void update_uniform_memory(u8* memory, u32 offset, u32 size, u32 current_frame)
+void begin_recorder(Recorder* recorder, VkCommandBuffer buffer, u32 pass)
 {
-    memcpy((u8*) uniform_buffers_mapped[current_frame] + offset, memory, size);
-    VkMappedMemoryRange range{};
-    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
-    range.pNext = NULL;
-    range.memory = uniform_buffers_memory[current_frame];
-    range.offset = offset;
-    range.size = get_align(size, non_coherent_atom_size);
-    ranges[range_count] = range;
-    ++range_count;
+    recorder->buffer = buffer;
+    recorder->pass = pass;
+    recorder->bind_state.pipeline = -1;
+    recorder->bind_state.vertex_buffer = -1;
+    recorder->bind_state.index_buffer = -1;
+    recorder->bind_state.sets_bound = 0;
+    recorder->stats = {};
+
+    // Dynamic state isn't inherited by secondary command buffers
+    VkViewport viewport{};
+    viewport.x = 0.0f;
+    viewport.y = 0.0f;
+    viewport.width = (float) render_extent.width;
+    viewport.height = (float) render_extent.height;
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 1.0f;
+    VkRect2D scissor{};
+    scissor.offset = {0, 0};
+    scissor.extent = render_extent;
+    if (pass == DRAW_SHADOW) {
+        viewport.width = (float) SHADOW_MAP_SIZE;
+        viewport.height = (float) SHADOW_MAP_SIZE;
+        scissor.extent = {SHADOW_MAP_SIZE, SHADOW_MAP_SIZE};
+    }
+    vkCmdSetViewport(buffer, 0, 1, &viewport);
+    vkCmdSetScissor(buffer, 0, 1, &scissor);
 }
 
-u32 alloc_object_uniform(glm::mat4* model, glm::mat4* prev_mvp) 
+void bind_pipeline(Recorder* recorder, u32 pipeline)
 {
-    assert(uniform_object_alloc < UNIFORM_BUF_OBJECT);
-    u32 slot = uniform_object_alloc++;
-    float time = glfwGetTime();
-    ObjectUniform ubo;
-    ubo.prev_mvp = *prev_mvp;
-    ubo.model = *model;
-    u32 offset = object_offset + dynamic_align[2] * slot;
-    update_uniform_memory((u8*) &ubo, offset, sizeof(ObjectUniform), current_frame);
-    return slot;
+    VkCommandBuffer buffer = recorder->buffer;
+    BindState* bind_state = &recorder->bind_state;
+    RenderStats* stats = &recorder->stats;
+
+    bool depth_only = recorder->pass != DRAW_COLOR;
+    if (bind_state->pipeline != (i32) pipeline) {
+        VkPipeline bound = graphics_pipelines[pipeline];
+        if (recorder->pass == DRAW_DEPTH) {
+            bound = depth_pipelines[pipeline];
+        } else if (recorder->pass == DRAW_SHADOW) {
+            bound = shadow_pipelines[pipeline];
+        }
+        vkCmdBindPipeline(buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, bound);
+        bind_state->pipeline = pipeline;
+        stats->pipeline_binds++;
+    }
+    u32 layout = pipeline_keys[pipeline].layout;
+    if (bind_state->vertex_buffer != (i32) layout) {
+        bool positions = depth_only && layout == VERTEX_LAYOUT_STATIC;
+        VkBuffer vertex_buffers[] = {positions? position_buffer : vertex_buffer[layout]};
+        VkDeviceSize offsets[] = {0};
+        vkCmdBindVertexBuffers(buffer, 0, 1, vertex_buffers, offsets);
+        bind_state->vertex_buffer = layout;
+        stats->buffer_binds++;
+    }
+    if (bind_state->index_buffer != (i32) layout) {
+        vkCmdBindIndexBuffer(buffer, index_buffer[layout], 0, VK_INDEX_TYPE_UINT32);
+        bind_state->index_buffer = layout;
+        stats->buffer_binds++;
+    }
+
+    // Everything per draw is looked up through gl_InstanceIndex
+    u32 set_count = layout == VERTEX_LAYOUT_STATIC? 3 : 4;
+    if (bind_state->sets_bound < set_count) {
+        u32 first = bind_state->sets_bound;
+        // One per dynamic binding of the bound sets in binding order,
+        // materials have none
+        u32 dynamic_offsets[UNIFORM_TYPES + 1];
+        u32 dynamic_count = 0;
+        for (u32 i = first; i < set_count; ++i) {
+            if (i == 0) {
+                dynamic_offsets[dynamic_count++] = global_offset;
+                dynamic_offsets[dynamic_count++] = light_offset;
+            } else if (i == 2) {
+                dynamic_offsets[dynamic_count++] = instance_offset;
+            } else if (i == 3) {
+                dynamic_offsets[dynamic_count++] = bone_offset;
+            }
+        }
+        vkCmdBindDescriptorSets(buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layouts[layout], 
+                                first, set_count - first, 
+                                descriptor_sets + current_frame * UNIFORM_TYPES + first, 
+                                dynamic_count, dynamic_offsets);
+        bind_state->sets_bound = set_count;
+        stats->descriptor_binds++;
+    }
 }
 
-u32 alloc_bone_uniform(Bone* bones, u32 bone_count)
+void draw_batch(Recorder* recorder, Batch* batch)
 {
-    assert(uniform_bone_alloc + bone_count <= UNIFORM_BUF_BONE);
-    u32 offset = uniform_bone_alloc;
-    uniform_bone_alloc += bone_count;
+    vkCmdDrawIndexed(recorder->buffer, batch->index_count, batch->instance_count, 
+                     batch->index_offset, batch->vertex_offset, batch->first_instance);
+    recorder->stats.draws++;
+    recorder->stats.instances += batch->instance_count;
+}
 
-    u32 byte_offset = bone_offset + bone_stride * offset;
-    memcpy((u8*) uniform_buffers_mapped[current_frame] + byte_offset, 
-           bones, bone_count * bone_stride);
+// Draws the batches in [first, last) that belong into the main pass
+void draw_batches(Recorder* recorder, u32 first, u32 last)
+{
+    // The cascades are drawn by record_shadows
+    u32 shadow_first = render_queue.queue_batches[QUEUE_SHADOW];
+    u32 shadow_last = render_queue.queue_batches[QUEUE_SHADOW + SHADOW_CASCADES];
+    for (u32 i = first; i < last; ++i) {
+        if (i >= shadow_first && i < shadow_last) {
+            continue;
+        }
+        Batch* batch = render_queue.batches + i;
+        bind_pipeline(recorder, batch->pipeline);
+        draw_batch(recorder, batch);
+    }
+}
 
-    return offset;
+// Opaque batches nearest first, so later ones fail the depth test early
+void draw_depth_prepass(Recorder* recorder)
+{
+    for (u32 i = 0; i < render_queue.depth_order_count; ++i) {
+        Batch* batch = render_queue.batches + render_queue.depth_order[i];
+        if (depth_pipelines[batch->pipeline] == VK_NULL_HANDLE) {
+            continue;
+        }
+        bind_pipeline(recorder, batch->pipeline);
+        draw_batch(recorder, batch);
+    }
 }
 
-void init_materials()
+void record_secondary(u32 chunk, u32 first, u32 last)
 {
-    MaterialUniform water;
-    water.smoothness = 1.0;
-    water.roughness = 0.10;
-    water.specular = glm::vec3(0.02, 0.02, 0.02);
-    water.diffuse = glm::vec3(0.07, 0.07, 0.3);
+    u32 index = current_frame * MAX_RECORD_THREADS + chunk;
+    vkResetCommandPool(device, record_pools[index], 0);
+
+    VkCommandBufferInheritanceInfo inheritance_info{};
+    inheritance_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritance_info.renderPass = render_pass;
+    inheritance_info.subpass = SUBPASS_COLOR;
+    inheritance_info.framebuffer = framebuffers[current_frame];
 
-    MaterialUniform gold;
-    gold.smoothness = 0.1;
-    gold.roughness = 0.20;
-    gold.specular = glm::vec3(1.00, 0.78, 0.34);
-    gold.diffuse = glm::vec3(0.0, 0.0, 0.0);
+    VkCommandBufferBeginInfo begin_info{};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | 
+        VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    begin_info.pInheritanceInfo = &inheritance_info;
+    if (vkBeginCommandBuffer(record_buffers[index], &begin_info) != VK_SUCCESS) {
+        printf("Failed to begin recording command buffer\n");
+    }
 
-    MaterialUniform floor;
-    floor.smoothness = 0.05;
-    floor.roughness = 1.00;
-    floor.specular = glm::vec3(0.01, 0.01, 0.01);
-    floor.diffuse = glm::vec3(0.5, 0.5, 0.5);
+    Recorder* recorder = recorders + chunk;
+    begin_recorder(recorder, record_buffers[index], DRAW_COLOR);
+    draw_batches(recorder, first, last);
 
-    for (u32 i = 0; i < max_frames_in_flight; ++i) {
-        update_uniform_memory((u8*) &water, 
-                              material_offset, 
-                              sizeof(MaterialUniform),
-                              i);
-        update_uniform_memory((u8*) &gold, 
-                              material_offset + dynamic_align[1], 
-                              sizeof(MaterialUniform),
-                              i);
-        update_uniform_memory((u8*) &floor, 
-                              material_offset + 2 * dynamic_align[1], 
-                              sizeof(MaterialUniform),
-                              i);
+    if (vkEndCommandBuffer(record_buffers[index]) != VK_SUCCESS) {
+        printf("Failed to record command buffer\n");
     }
 }
 
-void draw_object(glm::mat4* transform, glm::mat4* prev_mvp, Model* model, u32 material)
+void record_chunks(void* data, u32 first, u32 last)
 {
-    u32 slot = alloc_object_uniform(transform, prev_mvp);
+    u32 chunk_count = *(u32*) data;
+    u32 batch_count = render_queue.batch_count;
+    for (u32 chunk = first; chunk < last; ++chunk) {
+        record_secondary(chunk, 
+                         batch_count * chunk / chunk_count, 
+                         batch_count * (chunk + 1) / chunk_count);
+    }
+}
 
-    Message message;
-    message.pipeline = 0;
-    message.uniform_slot = slot;
-    message.material = material;
-    message.vertex_offset = model->vertex_offset;
-    message.index_count = model->index_count;
-    message.index_offset = model->index_offset;
-    assert(render_queue.message_count < MAX_MESSAGES);
-    render_queue.messages[render_queue.message_count++] = message;
+// Splits the batches into chunk_count ranges and records them as jobs
+void record_parallel(u32 chunk_count)
+{
+    parallel_for("record", chunk_count, 1, record_chunks, &chunk_count);
 }
 
-void draw_rigged(glm::mat4* transform, 
-                 glm::mat4* prev_mvp, 
-                 Model* model, 
-                 u32 material, 
-                 Bone* pose, 
-                 u32 bone_count)
+void add_stats(RenderStats* stats)
 {
-    u32 slot = alloc_object_uniform(transform, prev_mvp);
-    u32 bones = alloc_bone_uniform(pose, bone_count);
+    render_stats.pipeline_binds += stats->pipeline_binds;
+    render_stats.buffer_binds += stats->buffer_binds;
+    render_stats.descriptor_binds += stats->descriptor_binds;
+    render_stats.draws += stats->draws;
+    render_stats.instances += stats->instances;
+}
 
-    Message message;
-    message.pipeline = 1;
-    message.uniform_slot = slot;
-    message.material = material;
-    message.vertex_offset = model->vertex_offset;
-    message.index_count = model->index_count;
-    message.index_offset = model->index_offset;
-    message.bone_offset = bones;
-    assert(render_queue.message_count < MAX_MESSAGES);
-    render_queue.messages[render_queue.message_count++] = message;
+RenderStats get_render_stats()
+{
+    return render_stats;
+}
+
+// Expects upload_instances to have written the commands of the frame
+void record_cull(VkCommandBuffer buffer)
+{
+    u32 command_count = render_queue.queue_batches[QUEUE_TRANSPARENT] - 
+        render_queue.queue_batches[QUEUE_OPAQUE];
+    if (command_count == 0) {
+        return;
+    }
+    VkBufferCopy region{};
+    region.srcOffset = command_offset;
+    region.dstOffset = 0;
+    region.size = sizeof(VkDrawIndexedIndirectCommand) * command_count;
+    vkCmdCopyBuffer(buffer, stream_buffer, indirect_buffers[current_frame], 1, &region);
+
+    VkBufferMemoryBarrier copy_barrier{};
+    copy_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    copy_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    copy_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    copy_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    copy_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    copy_barrier.buffer = indirect_buffers[current_frame];
+    copy_barrier.offset = 0;
+    copy_barrier.size = region.size;
+    vkCmdPipelineBarrier(buffer,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0,
+                         0, NULL,
+                         1, &copy_barrier,
+                         0, NULL);
+
+    CullConstants constants;
+    for (u32 i = 0; i < 6; ++i) {
+        constants.planes[i] = frustum.planes[i];
+    }
+    // The opaque instances come first, the other queues follow
+    u32 instance_count = render_queue.queue_messages[QUEUE_TRANSPARENT];
+    constants.instance_count = instance_count;
+    vkCmdBindPipeline(buffer, VK_PIPELINE_BIND_POINT_COMPUTE, cull_pipeline);
+    vkCmdBindDescriptorSets(buffer, VK_PIPELINE_BIND_POINT_COMPUTE, cull_pipeline_layout,
+                            0, 1, cull_descriptor_sets + current_frame, 1, &instance_offset);
+    vkCmdPushConstants(buffer, cull_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT,
+                       0, sizeof(CullConstants), &constants);
+    vkCmdDispatch(buffer, (instance_count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+    // The draws read the counted commands and the compacted instances
+    VkBufferMemoryBarrier draw_barriers[2];
+    for (u32 i = 0; i < 2; ++i) {
+        draw_barriers[i] = VkBufferMemoryBarrier{};
+        draw_barriers[i].sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        draw_barriers[i].srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        draw_barriers[i].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        draw_barriers[i].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    }
+    draw_barriers[0].dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+    draw_barriers[0].buffer = indirect_buffers[current_frame];
+    draw_barriers[0].offset = 0;
+    draw_barriers[0].size = region.size;
+    draw_barriers[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    draw_barriers[1].buffer = stream_buffer;
+    draw_barriers[1].offset = instance_offset + sizeof(InstanceData) * render_queue.message_count;
+    draw_barriers[1].size = sizeof(InstanceData) * instance_count;
+    vkCmdPipelineBarrier(buffer,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+                         0,
+                         0, NULL,
+                         2, draw_barriers,
+                         0, NULL);
+}
+
+void record_clusters(VkCommandBuffer buffer)
+{
+    u32 light_count = light_alloc;
+    u32 offsets[] = {global_offset, light_offset};
+    vkCmdBindPipeline(buffer, VK_PIPELINE_BIND_POINT_COMPUTE, cluster_pipeline);
+    vkCmdBindDescriptorSets(buffer, VK_PIPELINE_BIND_POINT_COMPUTE, cluster_pipeline_layout,
+                            0, 1, cluster_descriptor_sets + current_frame, 2, offsets);
+    vkCmdPushConstants(buffer, cluster_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT,
+                       0, sizeof(u32), &light_count);
+    vkCmdDispatch(buffer, (CLUSTER_COUNT + CLUSTER_GROUP_SIZE - 1) / CLUSTER_GROUP_SIZE, 1, 1);
+
+    VkBufferMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = cluster_buffers[current_frame];
+    barrier.offset = 0;
+    barrier.size = VK_WHOLE_SIZE;
+    vkCmdPipelineBarrier(buffer,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                         0,
+                         0, NULL,
+                         1, &barrier,
+                         0, NULL);
 }
 
-void bind_pipeline(VkCommandBuffer buffer, u32 pipeline)
+// The opaque batches, one call per run of batches with the same pipeline.
+// The prepass draws them in pipeline order instead of front to back
+void draw_indirect(Recorder* recorder)
 {
-    vkCmdBindPipeline(buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphics_pipelines[pipeline]);
-    VkBuffer vertex_buffers[] = {vertex_buffer[pipeline]};
-    VkDeviceSize offsets[] = {0};
-    vkCmdBindVertexBuffers(buffer, 0, 1, vertex_buffers, offsets);
-    vkCmdBindIndexBuffer(buffer, index_buffer[pipeline], 0, VK_INDEX_TYPE_UINT32);
-    vkCmdBindDescriptorSets(buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,  pipeline_layouts[pipeline], 
-                            0, 1, descriptor_sets + 0 + current_frame * 4, 0, NULL);
+    u32 stride = sizeof(VkDrawIndexedIndirectCommand);
+    Batch* batches = render_queue.batches + render_queue.queue_batches[QUEUE_OPAQUE];
+    u32 command_count = render_queue.queue_batches[QUEUE_TRANSPARENT] - 
+        render_queue.queue_batches[QUEUE_OPAQUE];
+    u32 first = 0;
+    while (first < command_count) {
+        u32 pipeline = batches[first].pipeline;
+        u32 last = first + 1;
+        while (last < command_count && batches[last].pipeline == pipeline) {
+            last++;
+        }
+        if (recorder->pass != DRAW_DEPTH || depth_pipelines[pipeline] != VK_NULL_HANDLE) {
+            bind_pipeline(recorder, pipeline);
+            vkCmdDrawIndexedIndirect(recorder->buffer, 
+                                     indirect_buffers[current_frame], 
+                                     stride * first,
+                                     last - first,
+                                     stride);
+            recorder->stats.draws++;
+        }
+        first = last;
+    }
+    recorder->stats.instances += render_queue.queue_messages[QUEUE_TRANSPARENT] - 
+        render_queue.queue_messages[QUEUE_OPAQUE];
 }
 
-void draw_entry(VkCommandBuffer buffer, Message message)
+void record_depth_prepass(VkCommandBuffer buffer)
 {
-    u32 material = message.material;
-    u32 uniform_slot = message.uniform_slot;
-    u32 index_count = message.index_count;
-    u32 index_offset = message.index_offset;
-    u32 vertex_offset = message.vertex_offset;
+    if (!depth_prepass) {
+        return;
+    }
+    Recorder recorder;
+    begin_recorder(&recorder, buffer, DRAW_DEPTH);
+    if (frame_gpu_driven) {
+        draw_indirect(&recorder);
+    } else {
+        draw_depth_prepass(&recorder);
+    }
+    render_stats.prepass_draws = recorder.stats.draws;
+}
 
-    u32 descriptor_count = message.pipeline == 0? 2 : 3;
+// One render pass per cascade, before the main pass samples them
+void record_shadows(VkCommandBuffer buffer)
+{
+    u32 first_query = current_frame * SHADOW_CASCADES * 2;
+    if (timing_supported) {
+        vkCmdResetQueryPool(buffer, shadow_queries, first_query, SHADOW_CASCADES * 2);
+    }
+    VkClearValue clear_value{};
+    clear_value.depthStencil = {1.0f, 0};
+    VkRenderPassBeginInfo render_pass_info{};
+    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    render_pass_info.renderPass = shadow_render_pass;
+    render_pass_info.renderArea.offset = {0, 0};
+    render_pass_info.renderArea.extent = {SHADOW_MAP_SIZE, SHADOW_MAP_SIZE};
+    render_pass_info.clearValueCount = 1;
+    render_pass_info.pClearValues = &clear_value;
+
+    for (u32 i = 0; i < SHADOW_CASCADES; ++i) {
+        if (timing_supported) {
+            vkCmdWriteTimestamp(buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 
+                                shadow_queries, first_query + i * 2);
+        }
+        render_pass_info.framebuffer = shadow_framebuffers[i];
+        vkCmdBeginRenderPass(buffer, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
+        Recorder recorder;
+        begin_recorder(&recorder, buffer, DRAW_SHADOW);
+        // All pipeline layouts share the push constant range
+        vkCmdPushConstants(buffer, pipeline_layouts[VERTEX_LAYOUT_STATIC], 
+                           VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(u32), &i);
+        u32 first = render_queue.queue_batches[QUEUE_SHADOW + i];
+        u32 last = render_queue.queue_batches[QUEUE_SHADOW + i + 1];
+        for (u32 j = first; j < last; ++j) {
+            Batch* batch = render_queue.batches + j;
+            bind_pipeline(&recorder, batch->pipeline);
+            draw_batch(&recorder, batch);
+        }
+        vkCmdEndRenderPass(buffer);
+        if (timing_supported) {
+            vkCmdWriteTimestamp(buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 
+                                shadow_queries, first_query + i * 2 + 1);
+        }
+        render_stats.shadow_draws[i] = recorder.stats.draws;
+        render_stats.shadow_ms[i] = shadow_ms[i];
+    }
+    shadow_timing_written[current_frame] = timing_supported;
+}
 
-    u32 dynamic_offsets[] = { material * dynamic_align[1], uniform_slot * dynamic_align[2] };
-    vkCmdBindDescriptorSets(buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, 
-                            pipeline_layouts[message.pipeline], 1, 
-                            descriptor_count, 
-                            descriptor_sets + 1 + current_frame * UNIFORM_TYPES, 2, 
-                            dynamic_offsets);
+// Resolves the color image of this frame into its history image and the
+// swap chain image
+void record_taa(VkCommandBuffer buffer, u32 image_index)
+{
+    VkRenderPassBeginInfo render_pass_info{};
+    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    render_pass_info.renderPass = taa_render_pass;
+    u32 image_count = (u32) swap_chain_image_views.size();
+    render_pass_info.framebuffer = taa_framebuffers[current_frame * image_count + image_index];
+    render_pass_info.renderArea.offset = {0, 0};
+    render_pass_info.renderArea.extent = swap_chain_extent;
+    vkCmdBeginRenderPass(buffer, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
 
-    PushConstants push_constants;
-    push_constants.bone_offset = message.bone_offset;
-    vkCmdPushConstants(buffer, pipeline_layouts[message.pipeline], VK_SHADER_STAGE_VERTEX_BIT,
-                       0, sizeof(PushConstants), &push_constants);
-    vkCmdDrawIndexed(buffer, index_count, 1, index_offset, vertex_offset, 0);
+    VkViewport viewport{};
+    viewport.x = 0.0f;
+    viewport.y = 0.0f;
+    viewport.width = (float) swap_chain_extent.width;
+    viewport.height = (float) swap_chain_extent.height;
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 1.0f;
+    vkCmdSetViewport(buffer, 0, 1, &viewport);
+    VkRect2D scissor{};
+    scissor.offset = {0, 0};
+    scissor.extent = swap_chain_extent;
+    vkCmdSetScissor(buffer, 0, 1, &scissor);
+
+    bool enabled = frame_taa;
+    TaaConstants constants;
+    constants.current_weight = enabled? TAA_CURRENT_WEIGHT : 1.0f;
+    constants.reset = !(enabled && history_valid);
+    constants.render_scale = glm::vec2((float) render_extent.width / swap_chain_extent.width,
+                                       (float) render_extent.height / swap_chain_extent.height);
+    vkCmdBindPipeline(buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, taa_pipeline);
+    vkCmdBindDescriptorSets(buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, taa_pipeline_layout,
+                            0, 1, taa_descriptor_sets + current_frame, 0, NULL);
+    vkCmdPushConstants(buffer, taa_pipeline_layout, VK_SHADER_STAGE_FRAGMENT_BIT, 
+                       0, sizeof(TaaConstants), &constants);
+    vkCmdDraw(buffer, 3, 1, 0, 0);
+    vkCmdEndRenderPass(buffer);
+    history_valid = enabled;
 }
 
-void record_command_buffer(VkCommandBuffer buffer, u32 image_index) 
+void record_command_buffer(VkCommandBuffer buffer) 
 {
     VkCommandBufferBeginInfo begin_info{};
     begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
@@ -1752,118 +4361,95 @@ void record_command_buffer(VkCommandBuffer buffer, u32 image_index)
     if (vkBeginCommandBuffer(buffer, &begin_info) != VK_SUCCESS) {
         printf("Failed to begin recording command buffer\n");
     }
+    if (timing_supported) {
+        vkCmdResetQueryPool(buffer, frame_queries, current_frame * 2, 2);
+    }
     VkRenderPassBeginInfo render_pass_info{};
     render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
     render_pass_info.renderPass = render_pass;
     render_pass_info.framebuffer = framebuffers[current_frame];
     render_pass_info.renderArea.offset = {0, 0};
-    render_pass_info.renderArea.extent = swap_chain_extent;
+    render_pass_info.renderArea.extent = render_extent;
     VkClearValue clear_values[] = {
         {{0, 0, 0}},                                        // Color buffer
-        {1.0f, 0}                                           // Depth buffer
+        {1.0f, 0},                                          // Depth buffer
+        {{0, 0, 0}},                                        // Velocity
     };
-    render_pass_info.clearValueCount = 2;
+    render_pass_info.clearValueCount = 3;
     render_pass_info.pClearValues = clear_values;
 
+    record_clusters(buffer);
+    if (frame_gpu_driven) {
+        record_cull(buffer);
+    }
+
+    // Queries can't span secondary command buffers without inheritedQueries,
+    // measuring records on one thread
+    bool measure = overdraw_enabled && overdraw_supported;
+    u32 thread_count = 1;
+    if (!frame_gpu_driven && !measure) {
+        thread_count = render_queue.batch_count / RECORD_BATCHES_PER_THREAD;
+        thread_count = clamp(thread_count, 1, record_thread_count);
+    }
+    if (measure) {
+        vkCmdResetQueryPool(buffer, overdraw_queries, current_frame, 1);
+    }
+    overdraw_written[current_frame] = measure;
+
+    render_stats = {};
+    render_stats.overdraw = measure? overdraw : 0.0f;
+    double record_start = glfwGetTime();
+    // Only the passes are timed, the compute work before them doesn't
+    // depend on the render scale
+    if (timing_supported) {
+        vkCmdWriteTimestamp(buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 
+                            frame_queries, current_frame * 2);
+    }
+    record_shadows(buffer);
     vkCmdBeginRenderPass(buffer, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
-    
-    for (u32 i = 0; i < render_queue.message_count; ++i) {
-        Message message = render_queue.messages[i];
-        bind_pipeline(buffer, message.pipeline);
-        draw_entry(buffer, message);
+    record_depth_prepass(buffer);
+    if (thread_count > 1) {
+        vkCmdNextSubpass(buffer, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+        record_parallel(thread_count);
+        vkCmdExecuteCommands(buffer, thread_count, 
+                             record_buffers + current_frame * MAX_RECORD_THREADS);
+        for (u32 i = 0; i < thread_count; ++i) {
+            add_stats(&recorders[i].stats);
+        }
+    } else {
+        vkCmdNextSubpass(buffer, VK_SUBPASS_CONTENTS_INLINE);
+        if (measure) {
+            vkCmdBeginQuery(buffer, overdraw_queries, current_frame, 0);
+        }
+        Recorder* recorder = recorders;
+        begin_recorder(recorder, buffer, DRAW_COLOR);
+        if (frame_gpu_driven) {
+            // Blended batches keep their back to front order. draw_batches
+            // skips the cascades, the ui follows them
+            draw_indirect(recorder);
+            draw_batches(recorder, 
+                         render_queue.queue_batches[QUEUE_TRANSPARENT], 
+                         render_queue.queue_batches[QUEUE_COUNT]);
+        } else {
+            draw_batches(recorder, 0, render_queue.batch_count);
+        }
+        add_stats(&recorder->stats);
+        if (measure) {
+            vkCmdEndQuery(buffer, overdraw_queries, current_frame);
+        }
     }
+    render_stats.record_threads = thread_count;
+    render_stats.record_ms = (glfwGetTime() - record_start) * 1000.0;
     
     vkCmdEndRenderPass(buffer);
 
-    // TODO: clean this up
-    // TODO: switch image layout of other render buffer
-    VkImageMemoryBarrier swap_chain_to_dst{};
-    swap_chain_to_dst.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    swap_chain_to_dst.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    swap_chain_to_dst.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-    swap_chain_to_dst.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    swap_chain_to_dst.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    swap_chain_to_dst.image = swap_chain_images[image_index];
-    swap_chain_to_dst.subresourceRange.baseMipLevel = 0;
-    swap_chain_to_dst.subresourceRange.levelCount = 1;
-    swap_chain_to_dst.subresourceRange.baseArrayLayer = 0;
-    swap_chain_to_dst.subresourceRange.layerCount = 1;
-    swap_chain_to_dst.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    swap_chain_to_dst.srcAccessMask = 0;
-    swap_chain_to_dst.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    vkCmdPipelineBarrier(buffer,
-                         VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-                         VK_PIPELINE_STAGE_TRANSFER_BIT,
-                         0,
-                         0, NULL,
-                         0, NULL,
-                         1, &swap_chain_to_dst);
-
-    VkImageSubresourceLayers subresources;
-    subresources.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    subresources.mipLevel = 0;
-    subresources.baseArrayLayer = 0;
-    subresources.layerCount = 1;
-    VkImageBlit blit{};
-    blit.srcOffsets[0] = {0, 0, 0};
-    blit.srcOffsets[1].x = (i32) swap_chain_extent.width;
-    blit.srcOffsets[1].y = (i32) swap_chain_extent.height;
-    blit.srcOffsets[1].z = 1;
-    blit.dstOffsets[0] = {0, 0, 0};
-    blit.dstOffsets[1].x = (i32) swap_chain_extent.width;
-    blit.dstOffsets[1].y = (i32) swap_chain_extent.height;
-    blit.dstOffsets[1].z = 1;
-    blit.srcSubresource = subresources;
-    blit.dstSubresource = subresources;
-    vkCmdBlitImage(buffer,
-                   render_images[current_frame],
-                   VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                   swap_chain_images[image_index],
-                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                   1,
-                   &blit,
-                   VK_FILTER_NEAREST);
-
-    VkImageMemoryBarrier barrier{};
-    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.image = render_images[current_frame];
-    barrier.subresourceRange.baseMipLevel = 0;
-    barrier.subresourceRange.levelCount = 1;
-    barrier.subresourceRange.baseArrayLayer = 0;
-    barrier.subresourceRange.layerCount = 1;
-    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-    VkImageMemoryBarrier swap_barrier{};
-    swap_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    swap_barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-    swap_barrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-    swap_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    swap_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    swap_barrier.image = swap_chain_images[image_index];
-    swap_barrier.subresourceRange.baseMipLevel = 0;
-    swap_barrier.subresourceRange.levelCount = 1;
-    swap_barrier.subresourceRange.baseArrayLayer = 0;
-    swap_barrier.subresourceRange.layerCount = 1;
-    swap_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    swap_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    swap_barrier.dstAccessMask = 0;
-    VkImageMemoryBarrier barriers[] = {
-        barrier,
-        swap_barrier
-    };
-    vkCmdPipelineBarrier(buffer, 
-                         VK_PIPELINE_STAGE_TRANSFER_BIT,
-                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
-                         0,
-                         0, NULL,
-                         0, NULL,
-                         2, barriers);
-
+    if (timing_supported) {
+        vkCmdWriteTimestamp(buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 
+                            frame_queries, current_frame * 2 + 1);
+    }
+    frame_timing_written[current_frame] = timing_supported;
+    render_stats.gpu_ms = gpu_frame_ms;
+    render_stats.render_scale = render_scale;
     if (vkEndCommandBuffer(buffer) != VK_SUCCESS) {
         printf("Failed to record command buffer\n");
         return;
@@ -1871,28 +4457,171 @@ void record_command_buffer(VkCommandBuffer buffer, u32 image_index)
     return;
 }
 
-void start_frame(glm::vec3 camera_pos, glm::mat4 proj_view)
+void record_taa_command_buffer(VkCommandBuffer buffer, u32 image_index)
 {
-    uniform_object_alloc = 0;
-    uniform_bone_alloc = 0;
-    render_queue.message_count = 0;
+    VkCommandBufferBeginInfo begin_info{};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = 0;
+    begin_info.pInheritanceInfo = NULL;
+    if (vkBeginCommandBuffer(buffer, &begin_info) != VK_SUCCESS) {
+        printf("Failed to begin recording command buffer\n");
+    }
+    record_taa(buffer, image_index);
+    if (vkEndCommandBuffer(buffer) != VK_SUCCESS) {
+        printf("Failed to record command buffer\n");
+    }
+}
 
-    GlobalUniform ubo;
-    ubo.camera_pos = camera_pos;
-    ubo.proj_view = proj_view;
-    ubo.jitter_index = jitter_index;
-    ubo.screen_size = glm::vec2(swap_chain_extent.width, swap_chain_extent.height);
-    jitter_index = (jitter_index + 1) % 5;
-    update_uniform_memory((u8*) &ubo, 0, sizeof(GlobalUniform), current_frame);
+// Fits an orthographic projection around each slice of the view. The
+// slices are bounded by spheres, their size doesn't change as the camera
+// turns, and the projections move in whole texels. Both keep the shadow
+// edges from shimmering
+void fit_cascades(RenderView* view, glm::mat4* matrices, float* splits)
+{
+    // Directions through the screen corners, scaled to a view depth of 1
+    glm::mat4 inv_proj = glm::inverse(view->proj);
+    glm::mat4 inv_view = glm::inverse(view->view);
+    glm::vec3 rays[4];
+    for (u32 i = 0; i < 4; ++i) {
+        glm::vec4 corner = inv_proj * glm::vec4(i & 1? 1.0f : -1.0f, i & 2? 1.0f : -1.0f, 0, 1);
+        corner /= corner.w;
+        rays[i] = glm::vec3(corner) / -corner.z;
+    }
+    glm::vec3 sun = view->sun_direction;
+    glm::vec3 up = fabsf(sun.z) > 0.99f? glm::vec3(0, 1, 0) : glm::vec3(0, 0, 1);
+
+    float near_depth = view->near_plane;
+    float far_depth = fminf(view->far_plane, SHADOW_DISTANCE);
+    float split_near = near_depth;
+    for (u32 i = 0; i < SHADOW_CASCADES; ++i) {
+        float t = (float) (i + 1) / SHADOW_CASCADES;
+        float log_split = near_depth * powf(far_depth / near_depth, t);
+        float uniform_split = near_depth + (far_depth - near_depth) * t;
+        float split_far = SHADOW_SPLIT_LAMBDA * log_split + (1 - SHADOW_SPLIT_LAMBDA) * uniform_split;
+        splits[i] = split_far;
+
+        glm::vec3 center = glm::vec3(0);
+        for (u32 j = 0; j < 4; ++j) {
+            center += rays[j] * (split_near + split_far);
+        }
+        center /= 8.0f;
+        float radius = 0;
+        for (u32 j = 0; j < 4; ++j) {
+            radius = fmaxf(radius, glm::length(rays[j] * split_near - center));
+            radius = fmaxf(radius, glm::length(rays[j] * split_far - center));
+        }
+        radius = ceilf(radius * 16.0f) / 16.0f;
+
+        glm::vec3 world_center = glm::vec3(inv_view * glm::vec4(center, 1));
+        glm::vec3 eye = world_center + sun * (radius + SHADOW_CASTER_DISTANCE);
+        glm::mat4 light_view = glm::lookAt(eye, world_center, up);
+        glm::mat4 light_proj = glm::ortho(-radius, radius, -radius, radius, 
+                                          0.0f, radius * 2 + SHADOW_CASTER_DISTANCE);
+        glm::vec4 origin = light_proj * light_view * glm::vec4(0, 0, 0, 1);
+        glm::vec2 texels = glm::vec2(origin) * (SHADOW_MAP_SIZE * 0.5f);
+        glm::vec2 offset = (glm::round(texels) - texels) * (2.0f / SHADOW_MAP_SIZE);
+        light_proj[3][0] += offset.x;
+        light_proj[3][1] += offset.y;
+        matrices[i] = light_proj * light_view;
+        split_near = split_far;
+    }
 }
 
-void end_frame(GLFWwindow* window) 
+// Radical inverse of index in the given base, in [0, 1)
+float halton(u32 index, u32 base)
+{
+    float result = 0;
+    float fraction = 1;
+    while (index > 0) {
+        fraction /= base;
+        result += fraction * (index % base);
+        index /= base;
+    }
+    return result;
+}
+
+void get_shadow_frustums(RenderView* view, Frustum* frustums)
+{
+    glm::mat4 matrices[SHADOW_CASCADES];
+    float splits[SHADOW_CASCADES];
+    fit_cascades(view, matrices, splits);
+    for (u32 i = 0; i < SHADOW_CASCADES; ++i) {
+        frustums[i] = frustum_from_matrix(matrices[i]);
+    }
+}
+
+void start_frame(RenderView* view)
 {
+    reload_pipelines();
+    apply_depth_prepass();
+
+    // The partition of this frame is free again once its last use finished
     vkWaitForFences(device, 
                     1, 
                     &in_flight_fences[current_frame], 
                     VK_TRUE,
                     UINT64_MAX);
+    read_overdraw();
+    read_shadow_timings();
+    read_frame_timing();
+    update_render_scale();
+    stream_head = current_frame * stream_partition_size;
+    stream_end = stream_head + stream_partition_size;
+
+    uniform_instance_alloc = 0;
+    uniform_bone_alloc = 0;
+    light_alloc = 0;
+    reset_queue(&render_queue);
+    frame_gpu_driven = gpu_driven;
+    frame_taa = taa_enabled;
+    glm::mat4 proj_view = view->proj * view->view;
+    frustum = frustum_from_matrix(proj_view);
+    camera_position = view->camera_pos;
+
+    GlobalUniform ubo;
+    ubo.camera_pos = view->camera_pos;
+    // Only the rasterization is jittered, culling and the clusters use the
+    // unjittered projection
+    jitter = glm::vec2(0);
+    if (frame_taa) {
+        jitter_index = (jitter_index + 1) % TAA_SAMPLES;
+        jitter = glm::vec2(halton(jitter_index + 1, 2) - 0.5f, halton(jitter_index + 1, 3) - 0.5f);
+        jitter *= glm::vec2(2.0f / render_extent.width, 2.0f / render_extent.height);
+    }
+    glm::mat4 jittered = glm::translate(glm::mat4(1), glm::vec3(jitter, 0));
+    ubo.proj_view = jittered * proj_view;
+    ubo.jitter = jitter;
+    ubo.screen_size = glm::vec2(render_extent.width, render_extent.height);
+    ubo.view = view->view;
+    ubo.inv_proj = glm::inverse(view->proj);
+    float log_ratio = logf(view->far_plane / view->near_plane);
+    ubo.cluster_depth = glm::vec4(view->near_plane, 
+                                  view->far_plane, 
+                                  CLUSTER_Z / log_ratio, 
+                                  -CLUSTER_Z * logf(view->near_plane) / log_ratio);
+    ubo.cluster_grid = glm::uvec4(CLUSTER_X, CLUSTER_Y, CLUSTER_Z, CLUSTER_STRIDE);
+    float splits[SHADOW_CASCADES];
+    fit_cascades(view, ubo.shadow_matrices, splits);
+    for (u32 i = 0; i < SHADOW_CASCADES; ++i) {
+        ubo.cascade_splits[i] = splits[i];
+        shadow_frustums[i] = frustum_from_matrix(ubo.shadow_matrices[i]);
+    }
+    ubo.sun_direction = glm::vec4(view->sun_direction, 0);
+    StreamAllocation global = stream_alloc(sizeof(GlobalUniform), uniform_alignment);
+    memcpy(global.memory, &ubo, sizeof(GlobalUniform));
+    global_offset = global.offset;
+
+    // Reserved up front, jobs fill them through uniform_instance_alloc and
+    // uniform_bone_alloc
+    instance_offset = stream_alloc(sizeof(InstanceData) * limits.max_instances * INSTANCE_COPIES, 
+                                   storage_alignment).offset;
+    bone_offset = stream_alloc(bone_stride * limits.max_bones, storage_alignment).offset;
+    light_offset = stream_alloc(sizeof(LightData) * limits.max_lights, storage_alignment).offset;
+}
+
+// Expects start_frame to have waited for the fence of the frame
+void end_frame(GLFWwindow* window) 
+{
     u32 image_index;
     VkResult result = vkAcquireNextImageKHR(device, 
                                             swap_chain, 
@@ -1909,11 +4638,28 @@ void end_frame(GLFWwindow* window)
     }
     vkResetFences(device, 1, &in_flight_fences[current_frame]);
     vkResetCommandBuffer(command_buffers[current_frame], 0);
+    vkResetCommandBuffer(taa_command_buffers[current_frame], 0);
 
-    flush_uniform_buffer();
+    u64 trace_start = trace_begin();
+    build_batches(&render_queue);
+    upload_instances();
+    flush_stream();
+    trace_end("build batches", trace_start);
     
-    record_command_buffer(command_buffers[current_frame], image_index);
-    VkSubmitInfo submit_info{};
+    trace_start = trace_begin();
+    record_command_buffer(command_buffers[current_frame]);
+    record_taa_command_buffer(taa_command_buffers[current_frame], image_index);
+    trace_end("record commands", trace_start);
+    // Uploads made during the frame are ordered before its draws
+    submit_uploads();
+    retire_uploads();
+    // A wait applies to every command of its batch. The passes before the
+    // taa pass don't touch the swap chain image and go in a batch without it
+    VkSubmitInfo submit_infos[2]{};
+    submit_infos[0].sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_infos[0].commandBufferCount = 1;
+    submit_infos[0].pCommandBuffers = &command_buffers[current_frame];
+    VkSubmitInfo& submit_info = submit_infos[1];
     submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
     VkSemaphore wait_semaphores[] = {
         image_available_semaphores[current_frame]
@@ -1925,15 +4671,15 @@ void end_frame(GLFWwindow* window)
     submit_info.pWaitSemaphores = wait_semaphores;
     submit_info.pWaitDstStageMask = wait_stages;
     submit_info.commandBufferCount = 1;
-    submit_info.pCommandBuffers = &command_buffers[current_frame];
+    submit_info.pCommandBuffers = &taa_command_buffers[current_frame];
     VkSemaphore signal_semaphores[] = {
         render_finished_semaphores[current_frame]
     };
     submit_info.signalSemaphoreCount = 1;
     submit_info.pSignalSemaphores = signal_semaphores;
     if (vkQueueSubmit(graphics_queue, 
-                      1, 
-                      &submit_info,
+                      2, 
+                      submit_infos,
                       in_flight_fences[current_frame]) != VK_SUCCESS) {
         printf("Failed to submit draw command buffer\n");
         return;
@@ -1969,29 +4715,67 @@ void cleanup_vulkan()
     vkDestroySampler(device, texture_sampler, NULL);
     vkDestroyImageView(device, texture_image_view, NULL);
     vkDestroyImage(device, texture_image, NULL);
-    vkFreeMemory(device, texture_image_memory, NULL);
+    gpu_free(&texture_image_memory);
     for (u32 i = 0; i < max_frames_in_flight; ++i) {
-        vkDestroyBuffer(device, uniform_buffers[i], NULL);
-        vkFreeMemory(device, uniform_buffers_memory[i], NULL);
+        vkDestroyBuffer(device, indirect_buffers[i], NULL);
+        gpu_free(&indirect_buffers_memory[i]);
+        vkDestroyBuffer(device, cluster_buffers[i], NULL);
+        gpu_free(&cluster_buffers_memory[i]);
+    }
+    vkDestroyBuffer(device, stream_buffer, NULL);
+    gpu_free(&stream_buffer_memory);
+    vkDestroyBuffer(device, material_buffer, NULL);
+    gpu_free(&material_buffer_memory);
+    free(frame_instances);
+    save_pipeline_cache();
+    vkDestroyPipelineCache(device, pipeline_cache, NULL);
+    destroy_pipelines();
+    for (u32 i = 0; i < VERTEX_LAYOUT_COUNT; ++i ) {
+        vkDestroyPipelineLayout(device, pipeline_layouts[i], NULL);
+    }
+    if (overdraw_supported) {
+        vkDestroyQueryPool(device, overdraw_queries, NULL);
     }
+    if (timing_supported) {
+        vkDestroyQueryPool(device, shadow_queries, NULL);
+        vkDestroyQueryPool(device, frame_queries, NULL);
+    }
+    vkDestroyPipeline(device, cull_pipeline, NULL);
+    vkDestroyPipelineLayout(device, cull_pipeline_layout, NULL);
+    vkDestroyDescriptorSetLayout(device, cull_set_layout, NULL);
+    vkDestroyPipeline(device, taa_pipeline, NULL);
+    vkDestroyPipelineLayout(device, taa_pipeline_layout, NULL);
+    vkDestroyDescriptorSetLayout(device, taa_set_layout, NULL);
+    vkDestroyPipeline(device, cluster_pipeline, NULL);
+    vkDestroyPipelineLayout(device, cluster_pipeline_layout, NULL);
+    vkDestroyDescriptorSetLayout(device, cluster_set_layout, NULL);
     vkDestroyDescriptorPool(device, descriptor_pool, NULL);
     vkDestroyDescriptorSetLayout(device, descriptor_set_layouts[0], NULL);
     vkDestroyDescriptorSetLayout(device, descriptor_set_layouts[1], NULL);
     vkDestroyDescriptorSetLayout(device, descriptor_set_layouts[2], NULL);
     vkDestroyDescriptorSetLayout(device, descriptor_set_layouts[3], NULL);
-    for (u32 i = 0; i < PIPELINE_COUNT; ++i) {
+    vkDestroyBuffer(device, position_buffer, NULL);
+    gpu_free(&position_buffer_memory);
+    for (u32 i = 0; i < VERTEX_LAYOUT_COUNT; ++i) {
         vkDestroyBuffer(device, vertex_buffer[i], NULL);
-        vkFreeMemory(device, vertex_buffer_memory[i], NULL);
+        gpu_free(&vertex_buffer_memory[i]);
         vkDestroyBuffer(device, index_buffer[i], NULL);
-        vkFreeMemory(device, index_buffer_memory[i], NULL);
+        gpu_free(&index_buffer_memory[i]);
     }
     for (u32 i = 0; i < max_frames_in_flight; ++i) {
         vkDestroySemaphore(device, image_available_semaphores[i], NULL);
         vkDestroySemaphore(device, render_finished_semaphores[i], NULL);
         vkDestroyFence(device, in_flight_fences[i], NULL);
     }
+    destroy_upload_resources();
     vkDestroyCommandPool(device, command_pool, NULL);
+    for (u32 i = 0; i < max_frames_in_flight * MAX_RECORD_THREADS; ++i) {
+        vkDestroyCommandPool(device, record_pools[i], NULL);
+    }
     vkDestroyRenderPass(device, render_pass, NULL);
+    vkDestroyRenderPass(device, taa_render_pass, NULL);
+    destroy_shadow_resources();
+    shutdown_gpu_memory();
     vkDestroyDevice(device, NULL);
     vkDestroySurfaceKHR(instance, surface, NULL);
     vkDestroyInstance(instance, NULL);